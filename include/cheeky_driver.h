@@ -18,13 +18,107 @@
 #ifndef CHEEKY_DISPLAY_H_
 # define CHEEKY_DISPLAY_H_
 
-# define IOCTL_CMD_BRIGHNESS	(1 << 1)
-# define IOCTL_CMD_SPEED	(1 << 2)
-# define IOCTL_CMD_HMOVE	(1 << 3)
-# define IOCTL_CMD_VMOVE	(1 << 4)
-# define IOCTL_CMD_FLASH	(1 << 5)
-# define IOCTL_CMD_NEGATIVE	(1 << 6)
-# define IOCTL_CMD_CUSTOM	(1 << 7)
+# include <linux/ioctl.h>
+# include <linux/types.h>
+
+/*
+ * The argument of every command is a pointer, to a __u32 holding the new
+ * value, or to the CUSTOM_SIZE bytes of the usb packets for
+ * IOCTL_CMD_CUSTOM, or to the GREY_SIZE bytes of the image for
+ * IOCTL_CMD_GREY, or to the structure read or written by the command.
+ */
+# define CHEEKY_IOC_MAGIC	'C'
+# define CUSTOM_SIZE		32
+# define GREY_SIZE		84
+
+# define IOCTL_CMD_BRIGHNESS	_IOW(CHEEKY_IOC_MAGIC, 1, __u32)
+# define IOCTL_CMD_SPEED	_IOW(CHEEKY_IOC_MAGIC, 2, __u32)
+# define IOCTL_CMD_HMOVE	_IOW(CHEEKY_IOC_MAGIC, 3, __u32)
+# define IOCTL_CMD_VMOVE	_IOW(CHEEKY_IOC_MAGIC, 4, __u32)
+# define IOCTL_CMD_FLASH	_IOW(CHEEKY_IOC_MAGIC, 5, __u32)
+# define IOCTL_CMD_NEGATIVE	_IOW(CHEEKY_IOC_MAGIC, 6, __u32)
+# define IOCTL_CMD_CUSTOM	_IOW(CHEEKY_IOC_MAGIC, 7, __u8[CUSTOM_SIZE])
+# define IOCTL_CMD_RATE		_IOW(CHEEKY_IOC_MAGIC, 8, __u32)
+# define IOCTL_CMD_SET_STATE	_IOW(CHEEKY_IOC_MAGIC, 9, cheeky_state_t)
+# define IOCTL_CMD_GET_COUNTERS	_IOR(CHEEKY_IOC_MAGIC, 10, cheeky_counters_t)
+# define IOCTL_CMD_SET_PLAYLIST	_IOW(CHEEKY_IOC_MAGIC, 11, cheeky_playlist_t)
+# define IOCTL_CMD_COUNTER	_IOW(CHEEKY_IOC_MAGIC, 12, cheeky_counter_t)
+# define IOCTL_CMD_SMOOTH	_IOW(CHEEKY_IOC_MAGIC, 13, __u32)
+# define IOCTL_CMD_GREY		_IOW(CHEEKY_IOC_MAGIC, 14, __u8[GREY_SIZE])
+# define IOCTL_CMD_SET_WALL	_IOW(CHEEKY_IOC_MAGIC, 15, cheeky_wall_t)
+# define IOCTL_CMD_SET_SCREEN	_IOW(CHEEKY_IOC_MAGIC, 16, cheeky_screen_t)
+# define IOCTL_CMD_SET_LAYOUT	_IOW(CHEEKY_IOC_MAGIC, 17, cheeky_layout_t)
+
+/*
+ * The fields of cheeky_state_t applied by IOCTL_CMD_SET_STATE.
+ */
+# define STATE_TEXT		(1 << 0)
+# define STATE_BRIGHNESS	(1 << 1)
+# define STATE_SPEED		(1 << 2)
+# define STATE_RATE		(1 << 3)
+# define STATE_HMOVE		(1 << 4)
+# define STATE_VMOVE		(1 << 5)
+# define STATE_FLASH		(1 << 6)
+# define STATE_NEGATIVE		(1 << 7)
+# define STATE_SMOOTH		(1 << 8)
+# define STATE_ALL		(0x1ff)
+
+# define CHEEKY_STATE_VERSION	2
+
+/*
+ * The flags of cheeky_playlist_t.
+ */
+# define PLAYLIST_LOOP		(1 << 0)
+# define PLAYLIST_ALL		(0x01)
+
+/*
+ * The counters of a display shown by the fields %0 to %7 of its text, and
+ * the operations of IOCTL_CMD_COUNTER.
+ */
+# define CHEEKY_NB_COUNTERS	8
+# define COUNTER_SET		0
+# define COUNTER_ADD		1
+
+/*
+ * The maximum number of displays of a video wall.
+ */
+# define CHEEKY_MAX_PANELS	8
+
+/*
+ * The maximum number of regions of a layout, and how a region is combined
+ * with the regions below it.
+ */
+# define CHEEKY_MAX_REGIONS	4
+# define REGION_OR		0
+# define REGION_ANDNOT		1
+# define REGION_XOR		2
+
+/*
+ * The 1 bit pixel format of the video output: 7 lines of 4 bytes, the
+ * leftmost LED being the most significant bit of the first byte.
+ */
+# define CHEEKY_PIX_FMT_MONO	((__u32) 'C'		|	\
+				 ((__u32) 'K' << 8)	|	\
+				 ((__u32) 'Y' << 16)	|	\
+				 ((__u32) '1' << 24))
+
+/*
+ * The greyscale image of IOCTL_CMD_GREY: 7 lines of GREY_LINE_LENGTH bytes,
+ * with 4 bits per LED, from 0 (off) to 15 (on), the leftmost LED being the
+ * most significant half of the first byte.
+ */
+# define GREY_LINE_LENGTH	12
+
+/*
+ * The binary font format: a cheeky_font_header_t, followed by the index of
+ * count little endian __u16 giving the glyph of each character from first
+ * (CHEEKY_FONT_NONE for a blank character), followed by the glyphs, height
+ * bytes each.  Each byte is a row slice of the glyph, from top to bottom,
+ * the lowest bit being the leftmost LED.  The driver only takes 3x7 glyphs.
+ */
+# define CHEEKY_FONT_MAGIC	0x464b4843
+# define CHEEKY_FONT_VERSION	1
+# define CHEEKY_FONT_NONE	0xffff
 
 # define LED_NO_VMOVE		0
 # define LED_UP_TO_DOWN		1
@@ -39,5 +133,314 @@
 # define LED_HIGH_BR		2
 # define LED_NEGATIVE_OFF	0
 # define LED_NEGATIVE_ON	1
+# define LED_SMOOTH_OFF		0
+# define LED_SMOOTH_ON		1
+
+/**
+ * @brief
+ *	The header of a binary font, all fields in little endian.
+ */
+typedef struct cheeky_font_header_t {
+	__u32 magic;
+	/*!<
+	 * CHEEKY_FONT_MAGIC, "CHKF".
+	 */
+	__u16 version;
+	/*!<
+	 * CHEEKY_FONT_VERSION.
+	 */
+	__u8 width;
+	/*!<
+	 * The number of LED columns of each glyph, at most 8.
+	 */
+	__u8 height;
+	/*!<
+	 * The number of LED rows of each glyph.
+	 */
+	__u16 first;
+	/*!<
+	 * The first character of the index.
+	 */
+	__u16 count;
+	/*!<
+	 * The number of characters of the index, first + count is at most 256.
+	 */
+	__u16 glyphs;
+	/*!<
+	 * The number of glyphs, at most 256.
+	 */
+	__u16 reserved;
+	/*!<
+	 * Must be 0.
+	 */
+} cheeky_font_header_t;
+
+/**
+ * @brief
+ *	The argument of IOCTL_CMD_SET_STATE: the text and the effects of a
+ *	display, applied all at once from one frame to the next.  Only the
+ *	fields selected by mask are changed.
+ */
+typedef struct cheeky_state_t {
+	__u32 version;
+	/*!<
+	 * CHEEKY_STATE_VERSION, or 1 for the first version of the structure,
+	 * which ends with negative.
+	 */
+	__u32 mask;
+	/*!<
+	 * The STATE_* fields to apply.
+	 */
+	__u64 text;
+	/*!<
+	 * A pointer to the new text, cast to a __u64 (STATE_TEXT).
+	 */
+	__u32 length;
+	/*!<
+	 * The length of the new text, truncated to the maximum size of the text
+	 * buffer of the driver (STATE_TEXT).
+	 */
+	__u32 brighness;
+	/*!<
+	 * LED_LOW_BR, LED_MIDDLE_BR or LED_HIGH_BR (STATE_BRIGHNESS).
+	 */
+	__u32 speed;
+	/*!<
+	 * A speed level between 0 and 15 (STATE_SPEED).
+	 */
+	__u32 rate;
+	/*!<
+	 * The exact speed of the effects, in thousandths of LED column per
+	 * second (STATE_RATE), it overrides speed when both are set.
+	 */
+	__u32 hmove;
+	/*!<
+	 * LED_NO_HMOVE, LED_RIGHT_TO_LEFT or LED_LEFT_TO_RIGHT (STATE_HMOVE).
+	 */
+	__u32 vmove;
+	/*!<
+	 * LED_NO_VMOVE, LED_UP_TO_DOWN or LED_DOWN_TO_UP (STATE_VMOVE).
+	 */
+	__u32 flash;
+	/*!<
+	 * LED_NO_FLASH or LED_FLASHING (STATE_FLASH).
+	 */
+	__u32 negative;
+	/*!<
+	 * LED_NEGATIVE_OFF or LED_NEGATIVE_ON (STATE_NEGATIVE).
+	 */
+	__u32 smooth;
+	/*!<
+	 * LED_SMOOTH_OFF or LED_SMOOTH_ON (STATE_SMOOTH): when on, the frames
+	 * follow the rate of the effects, so that each frame moves the text by
+	 * exactly one LED.
+	 */
+	__u32 reserved;
+	/*!<
+	 * Must be 0.
+	 */
+} cheeky_state_t;
+
+/**
+ * @brief
+ *	The argument of IOCTL_CMD_GET_COUNTERS: the events of a display since it
+ *	was plugged.  Reading them clears the POLLPRI event of the file.
+ */
+typedef struct cheeky_counters_t {
+	__u64 frames;
+	/*!<
+	 * The number of frames the device finished receiving.
+	 */
+	__u64 wraps;
+	/*!<
+	 * The number of times the scrolling text came back to its first column,
+	 * that is the number of whole passes of the text.
+	 */
+	__u64 frame_time;
+	/*!<
+	 * The CLOCK_MONOTONIC time of the end of the last frame, in nanoseconds.
+	 */
+} cheeky_counters_t;
+
+/**
+ * @brief
+ *	A scene of a playlist: the text and effects shown, applied over the
+ *	ones of the previous scene, and how long they are shown.
+ */
+typedef struct cheeky_scene_t {
+	cheeky_state_t state;
+	/*!<
+	 * The text and the effects changed by the scene, as for
+	 * IOCTL_CMD_SET_STATE.
+	 */
+	__u64 packets;
+	/*!<
+	 * A pointer to CUSTOM_SIZE bytes of usb packets shown instead of the
+	 * text, cast to a __u64, or 0 to show the text.
+	 */
+	__u32 duration;
+	/*!<
+	 * How long the scene is shown, in milliseconds, or 0 to count passes.
+	 */
+	__u32 passes;
+	/*!<
+	 * The number of whole passes of the scrolling text the scene is shown
+	 * for, when duration is 0.  The text of the scene must then scroll
+	 * horizontally, and the scene must not show usb packets or a greyscale
+	 * image, otherwise the playlist is refused.
+	 */
+} cheeky_scene_t;
+
+/**
+ * @brief
+ *	The argument of IOCTL_CMD_SET_PLAYLIST: a sequence of scenes the driver
+ *	shows one after the other.
+ */
+typedef struct cheeky_playlist_t {
+	__u64 scenes;
+	/*!<
+	 * A pointer to the array of count cheeky_scene_t, cast to a __u64.
+	 */
+	__u32 count;
+	/*!<
+	 * The number of scenes, 0 to stop the playlist.
+	 */
+	__u32 flags;
+	/*!<
+	 * PLAYLIST_LOOP to play the scenes again after the last one, otherwise
+	 * the display goes back to its text after the last scene.
+	 */
+} cheeky_playlist_t;
+
+/**
+ * @brief
+ *	The argument of IOCTL_CMD_COUNTER: changes one of the counters shown by
+ *	the live fields of the text.
+ */
+typedef struct cheeky_counter_t {
+	__u32 slot;
+	/*!<
+	 * The counter, from 0 to CHEEKY_NB_COUNTERS - 1.
+	 */
+	__u32 op;
+	/*!<
+	 * COUNTER_SET to set the counter to value, COUNTER_ADD to add value to
+	 * it.
+	 */
+	__s64 value;
+	/*!<
+	 * The value set or added.
+	 */
+} cheeky_counter_t;
+
+/**
+ * @brief
+ *	The argument of IOCTL_CMD_SET_WALL: the displays placed on the right of
+ *	the display the command is sent to, which show the following columns of
+ *	its text.
+ */
+typedef struct cheeky_wall_t {
+	__u32 count;
+	/*!<
+	 * The number of displays in panels, 0 to split the wall.
+	 */
+	__s32 panels[CHEEKY_MAX_PANELS - 1];
+	/*!<
+	 * The file descriptors of the displays, opened on their char devices,
+	 * from left to right.
+	 */
+} cheeky_wall_t;
+
+/**
+ * @brief
+ *	The argument of IOCTL_CMD_SET_SCREEN: gives the file its own screen,
+ *	whose text and effects are shown in place of the ones of the display
+ *	while it has the highest priority.
+ */
+typedef struct cheeky_screen_t {
+	__u32 priority;
+	/*!<
+	 * The priority of the screen, the text of the display itself having
+	 * priority 0.  0 gives the screen up, the file then changes the text of
+	 * the display again.
+	 */
+	__u32 ttl;
+	/*!<
+	 * How long the screen is shown, in milliseconds from the command, 0 to
+	 * show it until the file is closed.
+	 */
+} cheeky_screen_t;
+
+/**
+ * @brief
+ *	A region of a layout: a rectangle of the display showing its own text,
+ *	which scrolls at its own speed.
+ */
+typedef struct cheeky_region_t {
+	__u64 text;
+	/*!<
+	 * A pointer to the text of the region, cast to a __u64, or 0 to show
+	 * the text of the display, with its live fields.
+	 */
+	__u32 length;
+	/*!<
+	 * The length of the text, truncated to the maximum size of the text
+	 * buffer of the driver, 0 to show the text of the display.
+	 */
+	__u32 op;
+	/*!<
+	 * REGION_OR to light the LED of the text, REGION_ANDNOT to turn them off,
+	 * REGION_XOR to invert them, over the regions below.
+	 */
+	__u8 x;
+	/*!<
+	 * The leftmost LED column of the region.
+	 */
+	__u8 y;
+	/*!<
+	 * The top LED row of the region, where the top of the text is drawn.
+	 */
+	__u8 width;
+	/*!<
+	 * The number of LED columns of the region.
+	 */
+	__u8 height;
+	/*!<
+	 * The number of LED rows of the region.
+	 */
+	__u32 hmove;
+	/*!<
+	 * LED_NO_HMOVE, LED_RIGHT_TO_LEFT or LED_LEFT_TO_RIGHT.
+	 */
+	__u32 rate;
+	/*!<
+	 * The speed of the scroll, in thousandths of LED column per second.
+	 */
+	__u32 reserved;
+	/*!<
+	 * Must be 0.
+	 */
+} cheeky_region_t;
+
+/**
+ * @brief
+ *	The argument of IOCTL_CMD_SET_LAYOUT: the regions the display is split
+ *	into, combined from the first to the last one.
+ */
+typedef struct cheeky_layout_t {
+	__u64 regions;
+	/*!<
+	 * A pointer to the array of count cheeky_region_t, cast to a __u64.
+	 */
+	__u32 count;
+	/*!<
+	 * The number of regions, up to CHEEKY_MAX_REGIONS, 0 to show the text of
+	 * the display on the whole display again.
+	 */
+	__u32 reserved;
+	/*!<
+	 * Must be 0.
+	 */
+} cheeky_layout_t;
 
 #endif /* !CHEEKY_DISPLAY_H_ */
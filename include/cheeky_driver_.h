@@ -18,18 +18,36 @@
 #ifndef CHEEKY_DRIVER_H_
 # define CHEEKY_DRIVER_H_
 
-# include <asm/uaccess.h>
-
-# include <linux/kthread.h>
+# include <linux/timerqueue.h>
+# include <linux/miscdevice.h>
+# include <linux/workqueue.h>
+# include <linux/rcupdate.h>
+# include <linux/firmware.h>
+# include <linux/rculist.h>
+# include <linux/uaccess.h>
+# include <linux/hrtimer.h>
+# include <linux/bitrev.h>
 # include <linux/kernel.h>
 # include <linux/module.h>
+# include <linux/device.h>
+# include <linux/mutex.h>
+# include <linux/kfifo.h>
 # include <linux/errno.h>
 # include <linux/sched.h>
+# include <linux/kref.h>
+# include <linux/poll.h>
+# include <linux/file.h>
 # include <linux/slab.h>
 # include <linux/init.h>
 # include <linux/usb.h>
+# include <linux/fb.h>
 # include <linux/fs.h>
 
+# include <media/videobuf2-vmalloc.h>
+# include <media/videobuf2-v4l2.h>
+# include <media/v4l2-device.h>
+# include <media/v4l2-ioctl.h>
+
 # include "cheeky_driver.h"
 
 /*
@@ -55,9 +73,20 @@
 # define HMOVE_MASK		(0x0300)
 # define VMOVE_MASK		(0x0c00)
 # define NEGATIVE_MASK		(0x1000)
+# define SMOOTH_MASK		(0x2000)
+# define GREY_MASK		(0x4000)
 
 # define NB_ROWS		7
 # define NB_COLUMNS		21
+# define NB_PACKETS		4
+
+/**
+ * @brief
+ *	The number of vertical positions a vertical move cycles through: the
+ *	rows of the usb packets, the blank eighth row included, rotate by one
+ *	row at each step.
+ */
+# define VMOVE_STEPS		(NB_PACKETS * 2)
 
 # ifndef MAX_CHARS
 /**
@@ -65,30 +94,150 @@
  *	The maximum size of the text buffer, this value may be overwritten at
  *	compile time to expand the value.
  */
-#  define MAX_CHARS		64
+#  define MAX_CHARS		4096
+# endif
+
+/**
+ * @brief
+ *	The minimum number of characters of a message, shorter texts are padded
+ *	with whitespaces so that they fill the display.
+ */
+# define MIN_CHARS		7
+
+/**
+ * @brief
+ *	The width, in LED columns, of a character in the pre-rendered strip.
+ */
+# define GLYPH_WIDTH		3
+
+# ifndef MAX_CACHED_FRAMES
+/**
+ * @brief
+ *	The maximum number of precomputed frames kept for the cycle of effects
+ *	of a device, this value may be overwritten at compile time.  Longer
+ *	cycles are rendered frame by frame.
+ */
+#  define MAX_CACHED_FRAMES	1024
 # endif
 
+# ifndef TICKER_SIZE
+/**
+ * @brief
+ *	The size of the ring of the ticker, in characters.  It must be a power
+ *	of 2, and may be overwritten at compile time.
+ */
+#  define TICKER_SIZE		16384
+# endif
+
+/**
+ * @brief
+ *	The free space of the ring of the ticker, in characters, from which
+ *	poll() reports that a file opened with O_APPEND is writable.
+ */
+# define TICKER_WAKE		(TICKER_SIZE / 4)
+
+/**
+ * @brief
+ *	The number of characters of the ticker on the display at once: enough
+ *	for NB_COLUMNS columns at any shift inside the first character.
+ */
+# define TICKER_WINDOW		(NB_COLUMNS / GLYPH_WIDTH + 1)
+
+/**
+ * @brief
+ *	The maximum number of live fields of a text, the next ones are printed
+ *	as they are.
+ */
+# define MAX_FIELDS		16
+
+/**
+ * @brief
+ *	The width, in characters, of a counter field without explicit width.
+ */
+# define COUNTER_WIDTH		6
+
+/*
+ * The kinds of live fields.
+ */
+# define FIELD_TIME		0
+# define FIELD_CLOCK		1
+# define FIELD_COUNTER		2
+
+/**
+ * @brief
+ *	The maximum number of scenes of a playlist.
+ */
+# define MAX_SCENES		64
+
+/**
+ * @brief
+ *	The number of subframes a greyscale image is dithered over: a LED of
+ *	level n, from 0 to 15, is on in n of them.
+ */
+# define GREY_SUBFRAMES		15
+
+/**
+ * @brief
+ *	The number of bytes of a line of the framebuffer of a display, its
+ *	NB_COLUMNS pixels of one bit are padded to 32 bits.
+ */
+# define FB_LINE_LENGTH		4
+
+/**
+ * @brief
+ *	The size of the framebuffer of a display, the deferred I/O works on
+ *	whole pages.
+ */
+# define FB_SIZE		PAGE_SIZE
+
+/**
+ * @brief
+ *	The fastest speed of the effects, in thousandths of LED column per
+ *	second.
+ */
+# define MAX_RATE		(1000 * 1000)
+
+/**
+ * @brief
+ *	The slowest rate of the effects followed by the frames of a smooth
+ *	display, one frame per second.
+ */
+# define MIN_SMOOTH_RATE	1000
+
+/**
+ * @brief
+ *	The size of the first version of cheeky_state_t, which
+ *	IOCTL_CMD_SET_STATE_V1 still takes.
+ */
+# define STATE_V1_SIZE		48
+
+/**
+ * @brief
+ *	IOCTL_CMD_SET_STATE as built against the first version of
+ *	cheeky_state_t.
+ */
+# define IOCTL_CMD_SET_STATE_V1	_IOC(_IOC_WRITE, CHEEKY_IOC_MAGIC, 9,	\
+				     STATE_V1_SIZE)
+
 /*
  * macros
  */
 /**
  * @brief
- *	Store the bitfield in way expected by the driver.
- * @param Bf The bitfield to store.
+ *	Returns the rate, in thousandths of LED column per second, of one of the
+ *	16 speed levels.
+ * @param Speed The speed level, between 0 and 15.
  */
-# define COMPLETE_BITFIELD(Bf)			\
-	((Bf) << 11)
+# define SPEED_TO_RATE(Speed)			\
+	((4 + 2 * (Speed)) * 1000)
 
 /**
  * @brief
- *	Returns the 3 bits corresponding to the row.
- * @param Number the row number.
- * @param Bf The bitfield to extract the 3 bits.
+ *	The size of the largest binary font the driver takes: a header, an
+ *	index of every byte value and 256 glyphs of NB_ROWS rows.
  */
-# define ROW(Number, Bf)				\
-	((Bf)					<<	\
-	 ((Number) * 3)			>>		\
-	 (29))
+# define CHEEKY_FONT_MAX_SIZE			\
+	(sizeof(cheeky_font_header_t) + 256 * 2 + 256 * NB_ROWS)
 
 /**
  * @brief
@@ -178,6 +327,30 @@
 	((Params) = ((Params) & ~NEGATIVE_MASK) |	\
 	 (((Value) << 12) & NEGATIVE_MASK))
 
+/**
+ * @brief
+ *	Set the smooth bit value, used to know if the frames follow the rate of
+ *	the effects, one LED per frame.
+ * @param Params The bitfield where to set the smooth bit.
+ * @param Value The smooth value, should be one of:
+ *		- LED_SMOOTH_OFF | 0
+ *		- LED_SMOOTH_ON | 1
+ */
+# define SET_SMOOTH(Params, Value)			\
+	((Params) = ((Params) & ~SMOOTH_MASK) |		\
+	 (((Value) << 13) & SMOOTH_MASK))
+
+/**
+ * @brief
+ *	Set the grey bit value, used to know if the custom packets are replaced
+ *	by the subframes of a greyscale image.
+ * @param Params The bitfield where to set the grey bit.
+ * @param Value 1 to show the greyscale image, 0 otherwise.
+ */
+# define SET_GREY(Params, Value)			\
+	((Params) = ((Params) & ~GREY_MASK) |		\
+	 (((Value) << 14) & GREY_MASK))
+
 /**
  * @brief
  *	Extract the brighness value from the bitfield Params.
@@ -234,6 +407,22 @@
 # define GET_NEGATIVE(Params)			\
 	(((Params) & NEGATIVE_MASK) >> 12)
 
+/**
+ * @brief
+ *	Extract the smooth value from the bitfield Params.
+ * @param Params The bitfield to extract the smooth value from
+ */
+# define GET_SMOOTH(Params)			\
+	(((Params) & SMOOTH_MASK) >> 13)
+
+/**
+ * @brief
+ *	Extract the grey value from the bitfield Params.
+ * @param Params The bitfield to extract the grey value from
+ */
+# define GET_GREY(Params)			\
+	(((Params) & GREY_MASK) >> 14)
+
 /**
  * @brief
  *	Represents a usb packet in the form expected by the led display.
@@ -258,65 +447,865 @@ typedef struct usb_packet_t {
 	 */
 } __attribute__ ((packed))	usb_packet_t;
 
+/**
+ * @brief
+ *	A live field of a text, whose characters the scheduler fills at each
+ *	frame.
+ */
+typedef struct field_t {
+	__u16 offset;
+	/*!<
+	 * The index of the first character of the field in the text.
+	 */
+	__u8 width;
+	/*!<
+	 * The number of characters of the field.
+	 */
+	__u8 kind;
+	/*!<
+	 * FIELD_TIME (HH:MM:SS), FIELD_CLOCK (HH:MM) or FIELD_COUNTER.
+	 */
+	__u8 slot;
+	/*!<
+	 * The counter shown by a FIELD_COUNTER.
+	 */
+} field_t;
+
+/**
+ * @brief
+ *	A text message and its rendered strip.  It is never modified once
+ *	rendered, and is shared by the states using it.
+ */
+typedef struct text_t {
+	struct kref ref;
+	/*!<
+	 * The number of states using the text.
+	 */
+	char* buffer;
+	/*!<
+	 * Contains the text message to be written on the display.  No more than
+	 * MAX_CHARS are supported, you may change it during the compilation.
+	 */
+	size_t length;
+	/*!<
+	 * The length if the text kept in the buffer.
+	 */
+	__u32* strip;
+	/*!<
+	 * The whole message rendered once as NB_ROWS rows of strip_words words,
+	 * the lowest bit of each word being the leftmost LED column.  The first
+	 * columns of the message are repeated after its end so that a window of
+	 * the display width can always be read without wrapping.
+	 */
+	unsigned int strip_words;
+	/*!<
+	 * The number of 32 bits words of each row of the strip.
+	 */
+	unsigned int columns;
+	/*!<
+	 * The number of LED columns of the message, GLYPH_WIDTH per character.
+	 */
+	unsigned long font_seq;
+	/*!<
+	 * The seq of the font the strip was rendered with.
+	 */
+	field_t fields[MAX_FIELDS];
+	/*!<
+	 * The live fields of the message, rendered as whitespaces in the strip.
+	 */
+	unsigned int nb_fields;
+	/*!<
+	 * The number of live fields.
+	 */
+	struct text_t* live;
+	/*!<
+	 * A copy of the text, private to the scheduler, whose live fields are
+	 * filled with their current values at each frame.  It is allocated with
+	 * the text, NULL if the text has no field.
+	 */
+} text_t;
+
+/**
+ * @brief
+ *	A region of a layout, ready to be composed.
+ */
+typedef struct region_t {
+	text_t* text;
+	/*!<
+	 * The text of the region, NULL to show the text of the display.
+	 */
+	__u8 x;
+	/*!<
+	 * The leftmost LED column of the region.
+	 */
+	__u8 y;
+	/*!<
+	 * The top LED row of the region.
+	 */
+	__u8 width;
+	/*!<
+	 * The number of LED columns of the region.
+	 */
+	__u8 height;
+	/*!<
+	 * The number of LED rows of the region.
+	 */
+	__u8 hmove;
+	/*!<
+	 * The scroll of the text of the region.
+	 */
+	__u8 op;
+	/*!<
+	 * REGION_OR, REGION_ANDNOT or REGION_XOR.
+	 */
+	unsigned int rate;
+	/*!<
+	 * The speed of the scroll, in thousandths of LED column per second.
+	 */
+} region_t;
+
+/**
+ * @brief
+ *	The regions a display is split into.  It is never modified once built,
+ *	and is shared by the states using it.
+ */
+typedef struct layout_t {
+	struct kref ref;
+	/*!<
+	 * The number of states using the layout.
+	 */
+	unsigned long seq;
+	/*!<
+	 * The sequence number of the layout, the scrolls of its regions start
+	 * again when it changes.
+	 */
+	unsigned int count;
+	/*!<
+	 * The number of regions.
+	 */
+	region_t regions[CHEEKY_MAX_REGIONS];
+	/*!<
+	 * The regions, composed from the first to the last one.
+	 */
+} layout_t;
+
+/**
+ * @brief
+ *	Everything the user set on a display: its text, its params and the
+ *	cycle of frames they give.  A state is built privately by a writer,
+ *	then published with an RCU pointer swap and never modified again.
+ */
+typedef struct state_t {
+	struct rcu_head rcu;
+	/*!<
+	 * Used to release the state once the scheduler cannot see it anymore.
+	 */
+	unsigned long seq;
+	/*!<
+	 * The sequence number of the state, incremented at each publication.
+	 */
+	unsigned long text_seq;
+	/*!<
+	 * Incremented each time the text is replaced.
+	 */
+	text_t* text;
+	/*!<
+	 * The text printed on the display.
+	 */
+	layout_t* layout;
+	/*!<
+	 * The regions composed instead of the text, NULL to print the text on
+	 * the whole display.  Usb packets and greyscale images are shown over
+	 * it.
+	 */
+	__u16 params;
+	/*!<
+	 * A bitfield of all parameters associated with the device.
+	 */
+	unsigned int rate;
+	/*!<
+	 * The speed of the effects, in thousandths of LED column per second.
+	 */
+	usb_packet_t custom_packets[NB_PACKETS];
+	/*!<
+	 * The usb packets given by the user with IOCTL_CMD_CUSTOM.
+	 */
+	__u8 grey[NB_ROWS][NB_COLUMNS];
+	/*!<
+	 * The level, from 0 to 15, of each LED of the greyscale image given with
+	 * IOCTL_CMD_GREY.
+	 */
+	usb_packet_t* frames;
+	/*!<
+	 * The precomputed cycle of frames for the text and params, NB_PACKETS
+	 * packets per frame indexed by position then vertical shift, followed by
+	 * the cleared frame used when flashing.  NULL when the cycle is longer
+	 * than MAX_CACHED_FRAMES.
+	 */
+	unsigned int frame_positions;
+	/*!<
+	 * The number of horizontal positions in frames, 1 without hmove, or the
+	 * number of subframes of a greyscale image.
+	 */
+	__u8 frame_vsteps;
+	/*!<
+	 * The number of vertical positions in frames, 1 without vmove.
+	 */
+	unsigned long broadcast_gen;
+	/*!<
+	 * The generation of the broadcast which gave the state, 0 if it was
+	 * not broadcast.  The scheduler shows previous until this generation
+	 * starts, so that all the displays switch to it on the same pass.
+	 */
+	struct state_t* previous;
+	/*!<
+	 * The state replaced by a state broadcast, kept until the broadcast
+	 * started, NULL otherwise.
+	 */
+} state_t;
+
+/**
+ * @brief
+ *	A scene of a playlist, ready to be shown.
+ */
+typedef struct scene_t {
+	state_t* state;
+	/*!<
+	 * The state shown by the scene, built and rendered when the playlist
+	 * was set, never published.
+	 */
+	__u64 duration;
+	/*!<
+	 * How long the scene is shown, in nanoseconds, 0 to count passes.
+	 */
+	unsigned int passes;
+	/*!<
+	 * The number of whole passes of the text the scene is shown for.
+	 */
+} scene_t;
+
+/**
+ * @brief
+ *	A playlist set on a display.  It is never modified once set, the
+ *	scheduler keeps which scene it plays.
+ */
+typedef struct playlist_t {
+	struct rcu_head rcu;
+	/*!<
+	 * Used to release the playlist once the scheduler cannot see it anymore.
+	 */
+	unsigned long seq;
+	/*!<
+	 * The sequence number of the playlist, so that the scheduler starts a
+	 * new playlist from its first scene.
+	 */
+	unsigned int flags;
+	/*!<
+	 * The PLAYLIST_* flags.
+	 */
+	unsigned int count;
+	/*!<
+	 * The number of scenes.
+	 */
+	scene_t scenes[];
+	/*!<
+	 * The scenes, in the order they are shown.
+	 */
+} playlist_t;
+
+/**
+ * @brief
+ *	The screen of a file, shown in place of the state of the display while
+ *	it is the screen with the highest priority which did not expire.
+ */
+typedef struct screen_t {
+	struct list_head node;
+	/*!<
+	 * Links the screens of the display, from the highest priority to the
+	 * lowest.
+	 */
+	struct rcu_head rcu;
+	/*!<
+	 * Used to release the screen once the scheduler cannot see it anymore.
+	 */
+	state_t __rcu* state;
+	/*!<
+	 * The text and the effects of the screen, NULL until the file sets
+	 * them.
+	 */
+	__u32 priority;
+	/*!<
+	 * The priority of the screen, above 0.
+	 */
+	ktime_t expires;
+	/*!<
+	 * The time at which the screen stops being shown, KTIME_MAX if never.
+	 */
+} screen_t;
+
+/**
+ * @brief
+ *	The displays of a video wall, serviced all together by the scheduler
+ *	for the first one.  It is never modified once set.
+ */
+typedef struct wall_t {
+	unsigned int count;
+	/*!<
+	 * The number of displays of the wall.
+	 */
+	struct data_t* panels[];
+	/*!<
+	 * The displays, from left to right, the first one being the display
+	 * whose state is shown.  The wall holds a reference on the others.
+	 */
+} wall_t;
+
 /**
  * @brief
  *	Represents the driver internally data that are used to
  *	display a text on the led display.
  */
 typedef struct data_t {
+	struct kref ref;
+	/*!<
+	 * Held by the usb interface until the device is unplugged, and by each
+	 * file opened on the device.
+	 */
+	int disconnected;
+	/*!<
+	 * Set when the device is unplugged, the files still opened then fail.
+	 */
 	struct usb_interface* interface;
 	/*!<
 	 * The usb interface for the device.
 	 */
-	struct task_struct* kthread;
+	struct timerqueue_node sched_node;
+	/*!<
+	 * The node of the device in the queue of the scheduler, its expiry is the
+	 * time at which the device must be serviced.
+	 */
+	struct list_head sched_batch;
+	/*!<
+	 * Links the devices serviced by the same pass of the scheduler.
+	 */
+	int sched_queued;
 	/*!<
-	 * A pointer to the thread which refresh the led display.
+	 * Set when sched_node is in the queue of the scheduler.
+	 */
+	int running;
+	/*!<
+	 * Set while the device is plugged and can be queued, and is not driven
+	 * by the first display of a wall.
+	 */
+	wall_t* wall;
+	/*!<
+	 * The wall the device is the first display of, NULL if none.  It is
+	 * only read by the scheduler, and changed under cheeky_wall_lock.
+	 */
+	struct data_t* wall_leader;
+	/*!<
+	 * The first display of the wall the device is part of, when it is not
+	 * the first one itself.
+	 */
+	struct list_head broadcast_node;
+	/*!<
+	 * Links the devices plugged, which /dev/cheeky_all writes to.
+	 */
+	int idle;
+	/*!<
+	 * Set when the device has been left idle, its next frame must then be
+	 * rendered again when it is serviced.
+	 */
+	ktime_t deadline;
+	/*!<
+	 * The deadline of the next frame of the device.
+	 */
+	__u64 period;
+	/*!<
+	 * The frame period of the state shown, in nanoseconds.
+	 */
+	ktime_t submit_time;
+	/*!<
+	 * The time at which the last frame was submitted.
+	 */
+	__u8 vdecale;
+	/*!<
+	 * The number of vertical LED to shift (if vmove is activated).
+	 */
+	__u8 flash;
+	/*!<
+	 * A on/off switch toggled by the flash effect.
 	 */
 	struct usb_device* udev;
 	/*!<
 	 * The usb device registered with this driver.
 	 */
-	struct semaphore sem_buffer;
+	state_t __rcu* state;
+	/*!<
+	 * The state of the display currently published.  The scheduler reads it
+	 * under RCU, the writers replace it with a new state.
+	 */
+	struct mutex state_lock;
+	/*!<
+	 * Serializes the writers building and publishing a new state.
+	 */
+	unsigned long texts;
+	/*!<
+	 * The number of texts set on the display, it gives each text its
+	 * text_seq.  It is protected by state_lock.
+	 */
+	unsigned long layouts;
+	/*!<
+	 * The number of layouts set on the display, it gives each layout its
+	 * seq.  It is protected by state_lock.
+	 */
+	unsigned long states;
+	/*!<
+	 * The number of states published on the display or on its screens, it
+	 * gives each state its seq.  It is protected by state_lock.
+	 */
+	struct list_head screens;
+	/*!<
+	 * The screens of the files opened on the display.  It is protected by
+	 * state_lock, the scheduler reads it under RCU.
+	 */
+	playlist_t __rcu* playlist;
+	/*!<
+	 * The playlist played instead of the state, NULL if there is none.
+	 * Publishing a new state stops it.
+	 */
+	unsigned long playlists;
+	/*!<
+	 * The number of playlists set on the display, it gives each playlist
+	 * its seq.  It is protected by state_lock.
+	 */
+	unsigned long playlist_seq;
+	/*!<
+	 * The seq of the playlist the scheduler plays.
+	 */
+	unsigned int scene;
+	/*!<
+	 * The scene of the playlist the scheduler shows.
+	 */
+	int playlist_done;
+	/*!<
+	 * Set when the playlist was played once to the end, the state is
+	 * shown again.
+	 */
+	ktime_t scene_end;
+	/*!<
+	 * The time at which the scene shown ends, KTIME_MAX if it is not timed.
+	 */
+	int screen_shown;
 	/*!<
-	 * A semaphore used during the write from a user, used not to mess the text.
+	 * Set when the scheduler shows a screen, the ticker and the video
+	 * stream then wait for the screen to go.
+	 */
+	ktime_t screen_end;
+	/*!<
+	 * The time at which the screen shown expires, KTIME_MAX if never.
+	 */
+	unsigned int scene_wraps;
+	/*!<
+	 * The number of whole passes of the text since the scene started.
+	 */
+	atomic64_t counters[CHEEKY_NB_COUNTERS];
+	/*!<
+	 * The counters shown by the counter fields of the text.
+	 */
+	unsigned long text_seq;
+	/*!<
+	 * The text_seq of the last state seen by the scheduler, to start
+	 * scrolling again from the first column when the text is replaced.
 	 */
 	usb_packet_t* display_packets;
 	/*!<
 	 * The representation of the 8bytes message we send to the usb device.
+	 * It is allocated with usb_alloc_coherent, each urb sends one packet.
 	 */
-	char* buffer;
+	dma_addr_t display_dma;
 	/*!<
-	 * Contains the text message to be written on the display.  No more than
-	 * MAX_CHARS are supported, you may change it during the compilation.
+	 * The DMA address of display_packets.
 	 */
-	__u16 params;
+	struct urb* urbs[NB_PACKETS];
 	/*!<
-	 * A bitfield of all parameters associated with the device.
+	 * The control urbs sending each packet of display_packets.
 	 */
-	__u8 length;
+	struct usb_ctrlrequest* setup;
 	/*!<
-	 * The length if the text kept in the buffer.
+	 * The SET_REPORT setup packet shared by all the urbs.
+	 */
+	struct usb_anchor submitted;
+	/*!<
+	 * Anchors the urbs in flight, so they can be killed at once.
+	 */
+	atomic_t in_flight;
+	/*!<
+	 * The number of urbs of the current frame not completed yet.
+	 */
+	usb_packet_t next_packets[NB_PACKETS];
+	/*!<
+	 * The next frame, rendered while the current one is being sent.
+	 */
+	usb_packet_t sent_packets[NB_PACKETS];
+	/*!<
+	 * The last usb packets the device acknowledged, a packet which did not
+	 * change is not sent again until keepalive milliseconds elapsed.
+	 */
+	ktime_t sent_time[NB_PACKETS];
+	/*!<
+	 * The time at which each of sent_packets was sent.
+	 */
+	unsigned long sent_valid;
+	/*!<
+	 * A bitmask of the packets of sent_packets which are known to be
+	 * displayed by the device.
+	 */
+	unsigned long packets_sent;
+	/*!<
+	 * The number of usb packets sent to the device.
+	 */
+	unsigned long packets_skipped;
+	/*!<
+	 * The number of usb packets not sent because they did not change.
+	 */
+	unsigned long wakeups;
+	/*!<
+	 * The number of times the scheduler serviced the device.
+	 */
+	unsigned long frames_dropped;
+	/*!<
+	 * The number of frames dropped because the previous one was still in
+	 * flight.
+	 */
+	unsigned long subframes_dropped;
+	/*!<
+	 * The number of subframes of a greyscale image never sent, dropped or
+	 * skipped because their deadline was over.
+	 */
+	unsigned int subframe;
+	/*!<
+	 * The subframe of the greyscale image rendered.
+	 */
+	int next_grey;
+	/*!<
+	 * Set when next_packets holds a subframe of a greyscale image.
+	 */
+	spinlock_t event_lock;
+	/*!<
+	 * Protects the counters of the events and the sequence numbers of the
+	 * frames, against the completion of the urbs.
+	 */
+	wait_queue_head_t event_wait;
+	/*!<
+	 * Woken up at the end of each frame and when the text wraps, for poll()
+	 * and for the writers of the files opened with O_SYNC.
+	 */
+	__u64 frames_done;
+	/*!<
+	 * The number of frames the device finished receiving.
+	 */
+	__u64 wraps;
+	/*!<
+	 * The number of whole passes of the scrolling text.
+	 */
+	ktime_t frame_time;
+	/*!<
+	 * The time of the end of the last frame.
+	 */
+	ktime_t rate_start;
+	/*!<
+	 * The start of the period over which the frame rate is measured.
+	 */
+	__u64 rate_frames;
+	/*!<
+	 * The value of frames_done at rate_start.
+	 */
+	unsigned int achieved_rate;
+	/*!<
+	 * The number of frames per second the device received, measured over
+	 * the last second.
+	 */
+	unsigned long next_seq;
+	/*!<
+	 * The seq of the state next_packets was rendered from.
+	 */
+	unsigned long submit_seq;
+	/*!<
+	 * The seq of the state the frame in flight was rendered from.
+	 */
+	unsigned long shown_seq;
+	/*!<
+	 * The seq of the state of the last frame the device received entirely.
+	 */
+	int frame_error;
+	/*!<
+	 * Set when an urb of the frame in flight failed.
+	 */
+# ifdef CONFIG_FB_SYSMEM_HELPERS_DEFERRED
+	struct fb_info* info;
+	/*!<
+	 * The framebuffer exposing the display, NULL if it is not registered.
+	 */
+	struct fb_deferred_io fbdefio;
+	/*!<
+	 * The deferred I/O of the framebuffer, packing the pages written
+	 * through mmap.
+	 */
+	struct delayed_work fb_damage;
+	/*!<
+	 * Packs the framebuffer after it was written with write() or drawn by
+	 * the kernel.
+	 */
+# endif
+# if IS_ENABLED(CONFIG_VIDEOBUF2_VMALLOC)
+	struct v4l2_device v4l2_dev;
+	/*!<
+	 * The v4l2 device of the video output.
+	 */
+	struct video_device vdev;
+	/*!<
+	 * The video output node of the display.
+	 */
+	int video_registered;
+	/*!<
+	 * Set when vdev is registered.
+	 */
+	struct vb2_queue video_queue;
+	/*!<
+	 * The queue of the video buffers.
+	 */
+	struct mutex video_mutex;
+	/*!<
+	 * Serializes the ioctls of the video output.
+	 */
+	spinlock_t video_lock;
+	/*!<
+	 * Protects video_queued, video_streaming and the video frame shown,
+	 * against the scheduler.
+	 */
+	struct list_head video_queued;
+	/*!<
+	 * The video buffers waiting for their presentation time, in order.
+	 */
+	int video_streaming;
+	/*!<
+	 * Set while the video output is streaming.
+	 */
+	int video_valid;
+	/*!<
+	 * Set when video_packets holds the last frame streamed, which is shown
+	 * instead of the text.
 	 */
-	__u8 start_character;
+	__u32 video_format;
 	/*!<
-	 * Keep the index of the first character printed on the display.
+	 * The pixel format of the video buffers.
+	 */
+	usb_packet_t video_packets[NB_PACKETS];
+	/*!<
+	 * The last video frame streamed, already packed.
+	 */
+# endif
+	atomic_t kicked;
+	/*!<
+	 * Set when the text or the params changed, so that the device does not
+	 * go idle with a stale frame.
+	 */
+	__u64 step_fraction;
+	/*!<
+	 * The fraction of a step of the effects accumulated over the frames,
+	 * with 32 fractional bits.
+	 */
+	unsigned int position;
+	/*!<
+	 * The strip column printed on the leftmost LED of the display.
+	 */
+	unsigned long layout_seq;
+	/*!<
+	 * The seq of the layout of the last state seen by the scheduler, to
+	 * start the scrolls of the regions again when it changes.
+	 */
+	unsigned int region_position[CHEEKY_MAX_REGIONS];
+	/*!<
+	 * The strip column printed on the leftmost LED of each region.
+	 */
+	__u64 region_fraction[CHEEKY_MAX_REGIONS];
+	/*!<
+	 * The fraction of a step of the scroll of each region, with 32
+	 * fractional bits.
+	 */
+	struct kfifo ticker;
+	/*!<
+	 * The ring of the characters appended to the ticker and not shown yet.
+	 */
+	spinlock_t ticker_lock;
+	/*!<
+	 * Protects the ring and the window of the ticker.
+	 */
+	wait_queue_head_t ticker_wait;
+	/*!<
+	 * Where the writers wait for free space in the ring.
+	 */
+	int ticker_active;
+	/*!<
+	 * Set while the ticker is shown instead of the text, from the first
+	 * append until the text is replaced.
+	 */
+	__u8 ticker_window[TICKER_WINDOW];
+	/*!<
+	 * The characters of the ticker on the display, from left to right.
+	 */
+	__u8 ticker_offset;
+	/*!<
+	 * The number of columns of the first character of ticker_window which
+	 * already went off the display.
 	 */
 } data_t;
 
 /**
  * @brief
- *	This structure is used to keep a correspondance between a character
- *	(letter) and the data (bitfield) we need to send to the led display.
+ *	What the driver keeps for each file opened on a display.
+ */
+typedef struct client_t {
+	data_t* data;
+	/*!<
+	 * The display the file was opened on.
+	 */
+	__u64 frames_seen;
+	/*!<
+	 * The frames counter when the file last read the counters.
+	 */
+	__u64 wraps_seen;
+	/*!<
+	 * The wraps counter when the file last read the counters.
+	 */
+	screen_t* screen;
+	/*!<
+	 * The screen of the file, whose text and effects it changes, or NULL
+	 * if it changes the ones of the display.  It is protected by the
+	 * state_lock of the display.
+	 */
+	int positioned;
+	/*!<
+	 * Set once the file was positioned with lseek(): from then on, each
+	 * write patches the text at its offset, even at offset 0.
+	 */
+} client_t;
+
+/**
+ * @brief
+ *	A glyph already split in its rows, as used by the scheduler.  Each
+ *	row is a 3 bits slice, the lowest bit being the leftmost LED.
+ */
+typedef struct glyph_t {
+	__u8 rows[NB_ROWS + 1];
+	/*!<
+	 * The NB_ROWS slices of the glyph, from top to bottom.  The last slice
+	 * is always blank, it fills the second row of the fourth usb packet.
+	 */
+} glyph_t;
+
+# if IS_ENABLED(CONFIG_VIDEOBUF2_VMALLOC)
+/**
+ * @brief
+ *	A buffer of the video output.
  */
-typedef struct character_map_t {
-	char letter;
+typedef struct video_buffer_t {
+	struct vb2_v4l2_buffer vb;
+	/*!<
+	 * The vb2 buffer, it must be the first field.
+	 */
+	struct list_head list;
+	/*!<
+	 * Links the buffers waiting for their presentation time.
+	 */
+} video_buffer_t;
+# endif
+
+/**
+ * @brief
+ *	The scheduler shared by all the devices.  A single timer fires at the
+ *	earliest deadline of the devices queued, and a work services all the
+ *	devices due.
+ */
+typedef struct scheduler_t {
+	spinlock_t lock;
+	/*!<
+	 * Protects the queue and the queueing state of the devices.
+	 */
+	struct timerqueue_head queue;
+	/*!<
+	 * The devices to service, ordered by deadline.
+	 */
+	struct hrtimer timer;
+	/*!<
+	 * Fires at the earliest deadline of the queue.
+	 */
+	struct workqueue_struct* workqueue;
+	/*!<
+	 * The workqueue where the devices are serviced.
+	 */
+	struct work_struct work;
+	/*!<
+	 * Services all the devices whose deadline is over.
+	 */
+	unsigned long broadcast_gen;
+	/*!<
+	 * The generation of the broadcasts started, sampled once at the start
+	 * of each pass, so that a broadcast starts on the same pass for all the
+	 * devices.  Only the work writes it.
+	 */
+} scheduler_t;
+
+/**
+ * @brief
+ *	The char device /dev/cheeky_all, which gives the same text and effects
+ *	to every display.
+ */
+typedef struct broadcast_t {
+	struct mutex lock;
+	/*!<
+	 * Protects the list of the devices, the state and the generation.  Only
+	 * the writers take it, never the scheduler.
+	 */
+	struct list_head devices;
+	/*!<
+	 * The devices plugged.
+	 */
+	state_t* state;
+	/*!<
+	 * The text and the effects last broadcast, already rendered.
+	 */
+	unsigned long gen;
+	/*!<
+	 * The generation of the last broadcast started, read by the scheduler
+	 * without any lock.
+	 */
+	struct miscdevice misc;
+	/*!<
+	 * The char device.
+	 */
+} broadcast_t;
+
+/**
+ * @brief
+ *	The font in use, unpacked from a binary font so that the glyph of a
+ *	character is found by indexing with its value.
+ */
+typedef struct font_t {
+	struct rcu_head rcu;
+	/*!<
+	 * Releases the font replaced once no renderer uses it anymore.
+	 */
+	unsigned long seq;
 	/*!<
-	 * The character to print.
+	 * The sequence number of the font, incremented at each font loaded.
 	 */
-	unsigned int bitfield;
+	glyph_t glyphs[256];
 	/*!<
-	 * The bitfield representing the character.
+	 * The glyph of every byte value, blank for the characters the font has
+	 * no glyph for.
 	 */
-} character_map_t;
+} font_t;
 
 #endif /* !CHEEKY_DRIVER_H_ */
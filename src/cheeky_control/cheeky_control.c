@@ -15,8 +15,9 @@
   along with cheeky_driver. If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <sys/ioctl.h>
+#include <unistd.h>
 #include <fcntl.h>
-#include <stropts.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -27,11 +28,17 @@
 static struct option long_options[] = {
 	{"brighness", required_argument, 0, 'b'},
 	{"speed", required_argument, 0, 's'},
+	{"rate", required_argument, 0, 'r'},
 	{"horizontal_move", required_argument, 0, 'm'},
 	{"vertical_move", required_argument, 0, 'v'},
 	{"flashing", required_argument, 0, 'f'},
 	{"text", required_argument, 0, 't'},
+	{"append", required_argument, 0, 'a'},
+	{"counter", required_argument, 0, 'c'},
 	{"negative", required_argument, 0, 'n'},
+	{"smooth", required_argument, 0, 'S'},
+	{"wall", required_argument, 0, 'w'},
+	{"screen", required_argument, 0, 'p'},
 	{"help", 0, 0, 'h'},
 	{0, 0, 0, 0}
 };
@@ -46,10 +53,16 @@ static void	usage(void)
 	       "Here is a list of all options:\n"
 	       "\t--brighness/-b: LED_LOW_BR (or 0), LED_MIDDLE_BR (or 1), LED_HIGH_BR (or 2)\n"
 	       "\t--speed/-s: A number between 0 and 15\n"
+	       "\t--rate/-r: The exact speed in LED columns per second (e.g. 12.5)\n"
 	       "\t--horizontal_move/-m: LED_NO_HMOVE (or 0), LED_RIGHT_TO_LEFT (or 1), LED_LEFT_TO_RIGHT (or 2)\n"
 	       "\t--vertical_move/-v: LED_NO_VMOVE (or 0), LED_UP_TO_DOWN (or 1), LED_DOWN_TO_UP (or 2)\n"
 	       "\t--flash/-f: LED_NO_FLASH (or 0), LED_FLASHING (or 1)\n"
 	       "\t--negative/-n: LED_NOEGATIVE_OFF (or 0), LED_NEGATIVE_ON (or 1)\n"
+	       "\t--smooth/-S: LED_SMOOTH_OFF (or 0), LED_SMOOTH_ON (or 1), one LED per frame\n"
+	       "\t--wall/-w: n,n,... groups the displays /dev/cheekyn on the right of /dev/cheeky0, none splits the wall\n"
+	       "\t--screen/-p: priority[,ms] shows the other options on a screen of this priority, for ms milliseconds or until interrupted\n"
+	       "\t--append/-a: Appends a text to the ticker\n"
+	       "\t--counter/-c: n=value sets the counter n, n+=value adds value to it\n"
 	       "\t--help/-h: Print this message\n");
 }
 
@@ -77,33 +90,26 @@ static int	is_numeric(char*	string)
  *		- LED_LOW_BR or 0
  *		- LED_MIDDLE_BR or 1
  *		- LED_HIGH_BR or 2
- * @param cheeky_device A file descriptor to the cheeky device.
+ * @param state The request where to set the new value.
  * @return 0 on success, -1 on error.
  */
-static int	set_brighness(char*	arg,
-			      int	cheeky_device)
+static int	set_brighness(char*			arg,
+			      cheeky_state_t*	state)
 {
 	if (is_numeric(arg))
-		ioctl(cheeky_device,
-		      IOCTL_CMD_BRIGHNESS,
-		      atoi(arg));
+		state->brighness = atoi(arg);
 	else if (strcmp(arg, "LED_LOW_BR") == 0)
-		ioctl(cheeky_device,
-		      IOCTL_CMD_BRIGHNESS,
-		      LED_LOW_BR);
+		state->brighness = LED_LOW_BR;
 	else if (strcmp(arg, "LED_MIDDLE_BR") == 0)
-		ioctl(cheeky_device,
-		      IOCTL_CMD_BRIGHNESS,
-		      LED_MIDDLE_BR);
+		state->brighness = LED_MIDDLE_BR;
 	else if (strcmp(arg, "LED_HIGH_BR") == 0)
-		ioctl(cheeky_device,
-		      IOCTL_CMD_BRIGHNESS,
-		      LED_HIGH_BR);
+		state->brighness = LED_HIGH_BR;
 	else {
 		printf("cheeky_display: Wrong argument to --brighness!\n");
 		usage();
 		return (-1);
 	}
+	state->mask |= STATE_BRIGHNESS;
 	return (0);
 }
 
@@ -113,29 +119,24 @@ static int	set_brighness(char*	arg,
  * @param arg The new value for the flash option, could be:
  *		- LED_NO_FLASH or 0
  *		- LED_FLASHING or 1
- * @param cheeky_device A file descriptor to te led device.
+ * @param state The request where to set the new value.
  * @return 0 on success, -1 on error.
  */
-static int	set_flashing(char*	arg,
-			     int	cheeky_device)
+static int	set_flashing(char*			arg,
+			     cheeky_state_t*	state)
 {
 	if (is_numeric(arg))
-		ioctl(cheeky_device,
-		      IOCTL_CMD_FLASH,
-		      atoi(arg));
+		state->flash = atoi(arg);
 	else if (strcmp(arg, "LED_FLASHING") == 0)
-		ioctl(cheeky_device,
-		      IOCTL_CMD_FLASH,
-		      LED_FLASHING);
+		state->flash = LED_FLASHING;
 	else if (strcmp(arg, "LED_NO_FLASH") == 0)
-		ioctl(cheeky_device,
-		      IOCTL_CMD_FLASH,
-		      LED_NO_FLASH);
+		state->flash = LED_NO_FLASH;
 	else {
 		printf("cheeky_display: Wrong argument to --flash!\n");
 		usage();
 		return (-1);
 	}
+	state->mask |= STATE_FLASH;
 	return (0);
 }
 
@@ -145,29 +146,51 @@ static int	set_flashing(char*	arg,
  * @param arg The new negative value for the negative option, could be:
  *		- LED_NEGATIVE_OFF or 0
  *		- LED_NEGATIVE_ON or 1
- * @param cheeky_device A file descriptor to the led device.
+ * @param state The request where to set the new value.
  * @return 0 on success, -1 on error.
  */
-static int	set_negative(char*	arg,
-			     int	cheeky_device)
+static int	set_negative(char*			arg,
+			     cheeky_state_t*	state)
 {
 	if (is_numeric(arg))
-		ioctl(cheeky_device,
-		      IOCTL_CMD_NEGATIVE,
-		      atoi(arg));
+		state->negative = atoi(arg);
 	else if (strcmp(arg, "LED_NEGATIVE_ON") == 0)
-		ioctl(cheeky_device,
-		      IOCTL_CMD_NEGATIVE,
-		      LED_NEGATIVE_ON);
+		state->negative = LED_NEGATIVE_ON;
 	else if (strcmp(arg, "LED_NEGATIVE_OFF") == 0)
-		ioctl(cheeky_device,
-		      IOCTL_CMD_NEGATIVE,
-		      LED_NEGATIVE_OFF);
+		state->negative = LED_NEGATIVE_OFF;
 	else {
 		printf("cheeky_display: Wrong argument to --negative!\n");
 		usage();
 		return (-1);
 	}
+	state->mask |= STATE_NEGATIVE;
+	return (0);
+}
+
+/**
+ * @brief
+ *	Change the smooth mode [on/off] of the led display.
+ * @param arg The new value for the smooth option, could be:
+ *		- LED_SMOOTH_OFF or 0
+ *		- LED_SMOOTH_ON or 1
+ * @param state The request where to set the new value.
+ * @return 0 on success, -1 on error.
+ */
+static int	set_smooth(char*			arg,
+			   cheeky_state_t*	state)
+{
+	if (is_numeric(arg))
+		state->smooth = atoi(arg);
+	else if (strcmp(arg, "LED_SMOOTH_ON") == 0)
+		state->smooth = LED_SMOOTH_ON;
+	else if (strcmp(arg, "LED_SMOOTH_OFF") == 0)
+		state->smooth = LED_SMOOTH_OFF;
+	else {
+		printf("cheeky_display: Wrong argument to --smooth!\n");
+		usage();
+		return (-1);
+	}
+	state->mask |= STATE_SMOOTH;
 	return (0);
 }
 
@@ -175,21 +198,45 @@ static int	set_negative(char*	arg,
  * @brief
  *	Change the speed value of the led display.
  * @param arg The new speed value, should be a number between 0 and 15.
- * @param cheeky_device A file descriptor to the led device.
+ * @param state The request where to set the new value.
  * @return 0 on success, -1 on error.
  */
-static int	set_speed(char*	arg,
-			  int	cheeky_device)
+static int	set_speed(char*			arg,
+			  cheeky_state_t*	state)
 {
 	if (is_numeric(arg))
-		ioctl(cheeky_device,
-		      IOCTL_CMD_SPEED,
-		      atoi(arg));
+		state->speed = atoi(arg);
 	else {
 		printf("cheeky_display: Wrong argument to --speed!\n");
 		usage();
 		return (-1);
 	}
+	state->mask |= STATE_SPEED;
+	return (0);
+}
+
+/**
+ * @brief
+ *	Change the exact speed of the effects of the led display.
+ * @param arg The new speed, in LED columns per second, may have decimals.
+ * @param state The request where to set the new value.
+ * @return 0 on success, -1 on error.
+ */
+static int	set_rate(char*			arg,
+			 cheeky_state_t*	state)
+{
+	char*		end;
+	double		rate;
+
+	rate = strtod(arg, &end);
+	if (*arg && !*end && rate >= 0)
+		state->rate = (__u32) (rate * 1000);
+	else {
+		printf("cheeky_display: Wrong argument to --rate!\n");
+		usage();
+		return (-1);
+	}
+	state->mask |= STATE_RATE;
 	return (0);
 }
 
@@ -197,15 +244,116 @@ static int	set_speed(char*	arg,
  * @brief
  *	Change the text displayed on the screen.
  * @param arg The new text to display.
- * @param cheeky_device A file descriptor to the led device.
+ * @param state The request where to set the new value.
  * @return 0 on success, -1 on error.
  */
-static int	set_text(char*	arg,
-			 int	cheeky_device)
+static int	set_text(char*			arg,
+			 cheeky_state_t*	state)
 {
-	if (write(cheeky_device, arg, strlen(arg)) == -1) {
-		printf("cheeky_display; Cannot write to device /dev/cheeky0. Is the display plugged ? "
-		       "Is you user a member of the group cheeky ?\n");
+	state->text = (__u64) (unsigned long) arg;
+	state->length = strlen(arg);
+	state->mask |= STATE_TEXT;
+	return (0);
+}
+
+/**
+ * @brief
+ *	Change one of the counters shown by the fields %0 to %7 of the text.
+ * @param arg The counter and its new value, n=value to set it or n+=value to
+ * add value to it.
+ * @param counter The request where to set the new value.
+ * @return 0 on success, -1 on error.
+ */
+static int	set_counter(char*			arg,
+			    cheeky_counter_t*	counter)
+{
+	char*		end;
+
+	counter->slot = strtoul(arg, &end, 10);
+	if (end != arg && end[0] == '=')
+		counter->op = COUNTER_SET;
+	else if (end != arg && end[0] == '+' && end[1] == '=') {
+		counter->op = COUNTER_ADD;
+		++end;
+	}
+	else {
+		printf("cheeky_display: Wrong argument to --counter!\n");
+		usage();
+		return (-1);
+	}
+	arg = end + 1;
+	counter->value = strtoll(arg, &end, 10);
+	if (!*arg || *end || counter->slot >= CHEEKY_NB_COUNTERS) {
+		printf("cheeky_display: Wrong argument to --counter!\n");
+		usage();
+		return (-1);
+	}
+	return (0);
+}
+
+/**
+ * @brief
+ *	Opens the displays placed on the right of /dev/cheeky0, to group them
+ *	into a video wall.
+ * @param arg The numbers of the displays from left to right, separated by
+ * commas (1,2 for /dev/cheeky1 and /dev/cheeky2), or none to split the wall.
+ * @param wall The request where to store the displays opened.
+ * @return 0 on success, -1 on error.
+ */
+static int	set_wall(char*			arg,
+			 cheeky_wall_t*	wall)
+{
+	char		path[32];
+	char*		end;
+
+	memset(wall, 0, sizeof(cheeky_wall_t));
+	if (strcmp(arg, "none") == 0)
+		return (0);
+	while (*arg) {
+		snprintf(path, sizeof(path), "/dev/cheeky%lu",
+			 strtoul(arg, &end, 10));
+		if (end == arg || (*end && *end != ',') ||
+		    wall->count == CHEEKY_MAX_PANELS - 1) {
+			printf("cheeky_display: Wrong argument to --wall!\n");
+			usage();
+			return (-1);
+		}
+		wall->panels[wall->count] = open(path, O_RDWR);
+		if (wall->panels[wall->count] == -1) {
+			printf("cheeky_display: Unable to open the file %s.\n",
+			       path);
+			return (-1);
+		}
+		++(wall->count);
+		arg = *end ? end + 1 : end;
+	}
+	return (0);
+}
+
+/**
+ * @brief
+ *	Gives the file a screen of its own, shown above the text of the display
+ *	and the screens of lower priority.
+ * @param arg The priority of the screen, followed by a comma and how long
+ * it is shown in milliseconds (10,5000), otherwise it is shown until
+ * cheeky_control is interrupted.
+ * @param screen The request where to set the new values.
+ * @return 0 on success, -1 on error.
+ */
+static int	set_screen(char*			arg,
+			   cheeky_screen_t*	screen)
+{
+	char*		end;
+
+	memset(screen, 0, sizeof(cheeky_screen_t));
+	screen->priority = strtoul(arg, &end, 10);
+	if (end != arg && *end == ',') {
+		arg = end + 1;
+		screen->ttl = strtoul(arg, &end, 10);
+	}
+	if (end == arg || *end || !screen->priority) {
+		printf("cheeky_display: Wrong argument to --screen!\n");
+		usage();
 		return (-1);
 	}
 	return (0);
@@ -218,33 +366,26 @@ static int	set_text(char*	arg,
  *		- LED_NO_HMOVE or 0
  *		- LED_RIGHT_TO_LEFT or 1
  *		- LED_LEFT_TO_RIGHT or 2
- * @param cheeky_device A file descriptor to the led device.
+ * @param state The request where to set the new value.
  * @return 0 on success, -1 on error.
  */
-static int	set_hmove(char*		arg,
-			  int		cheeky_device)
+static int	set_hmove(char*			arg,
+			  cheeky_state_t*	state)
 {
 	if (is_numeric(arg))
-		ioctl(cheeky_device,
-		      IOCTL_CMD_HMOVE,
-		      atoi(arg));
+		state->hmove = atoi(arg);
 	else if (strcmp(arg, "LED_RIGHT_TO_LEFT") == 0)
-		ioctl(cheeky_device,
-		      IOCTL_CMD_HMOVE,
-		      LED_RIGHT_TO_LEFT);
+		state->hmove = LED_RIGHT_TO_LEFT;
 	else if (strcmp(arg, "LED_LEFT_TO_RIGHT") == 0)
-		ioctl(cheeky_device,
-		      IOCTL_CMD_HMOVE,
-		      LED_LEFT_TO_RIGHT);
+		state->hmove = LED_LEFT_TO_RIGHT;
 	else if (strcmp(arg, "LED_NO_HMOVE") == 0)
-		ioctl(cheeky_device,
-		      IOCTL_CMD_HMOVE,
-		      LED_NO_HMOVE);
+		state->hmove = LED_NO_HMOVE;
 	else {
 		printf("cheeky_display: Wrong argument to --hmove!\n");
 		usage();
 		return (-1);
 	}
+	state->mask |= STATE_HMOVE;
 	return (0);
 }
 
@@ -255,33 +396,26 @@ static int	set_hmove(char*		arg,
  *		- LED_NO_VMOVE or 0
  *		- LED_UP_TO_DOWN or 1
  *		- LED_DOWN_TO_UP or 2
- * @param cheeky_device A file descriptor to the led device.
+ * @param state The request where to set the new value.
  * @return 0 on success, -1 on error.
  */
-static int	set_vmove(char*		arg,
-			  int		cheeky_device)
+static int	set_vmove(char*			arg,
+			  cheeky_state_t*	state)
 {
 	if (is_numeric(arg))
-		ioctl(cheeky_device,
-		      IOCTL_CMD_VMOVE,
-		      atoi(arg));
+		state->vmove = atoi(arg);
 	else if (strcmp(arg, "LED_UP_TO_DOWN") == 0)
-		ioctl(cheeky_device,
-		      IOCTL_CMD_VMOVE,
-		      LED_UP_TO_DOWN);
+		state->vmove = LED_UP_TO_DOWN;
 	else if (strcmp(arg, "LED_DOWN_TO_UP") == 0)
-		ioctl(cheeky_device,
-		      IOCTL_CMD_VMOVE,
-		      LED_DOWN_TO_UP);
+		state->vmove = LED_DOWN_TO_UP;
 	else if (strcmp(arg, "LED_NO_VMOVE") == 0)
-		ioctl(cheeky_device,
-		      IOCTL_CMD_VMOVE,
-		      LED_NO_VMOVE);
+		state->vmove = LED_NO_VMOVE;
 	else {
 		printf("cheeky_display: Wrong argument to --vmove!\n");
 		usage();
 		return (-1);
 	}
+	state->mask |= STATE_VMOVE;
 	return (0);
 }
 
@@ -296,6 +430,14 @@ static int	set_vmove(char*		arg,
 int		main(int	argc,
 		     char**	argv)
 {
+	cheeky_counter_t	counter;
+	cheeky_screen_t	screen;
+	cheeky_state_t	state;
+	cheeky_wall_t		wall;
+	char*		append = NULL;
+	int		has_counter = 0;
+	int		has_screen = 0;
+	int		has_wall = 0;
 	int		cheeky_device;
 	int		option_index = 0;
 	int		c = 0;
@@ -312,10 +454,14 @@ int		main(int	argc,
 		return (-1);
 	}
 
+	/* All the options are sent at once, when they are all parsed */
+	memset(&state, 0, sizeof(cheeky_state_t));
+	state.version = CHEEKY_STATE_VERSION;
+
 	while (1) {
 		c = getopt_long(argc,
 				argv,
-				"b:f:m:n:s:t:v:h",
+				"a:b:c:f:m:n:p:r:s:t:v:w:S:h",
 				long_options,
 				&option_index);
 
@@ -323,32 +469,58 @@ int		main(int	argc,
 			break;
 
 		switch (c) {
+		case 'a':
+			append = optarg;
+			break;
 		case 'b':
-			if (set_brighness(optarg, cheeky_device) == -1)
+			if (set_brighness(optarg, &state) == -1)
+				return (-1);
+			break;
+		case 'c':
+			if (set_counter(optarg, &counter) == -1)
 				return (-1);
+			has_counter = 1;
 			break;
 		case 'f':
-			if (set_flashing(optarg, cheeky_device) == -1)
+			if (set_flashing(optarg, &state) == -1)
 				return (-1);
 			break;
 		case 'm':
-			if (set_hmove(optarg, cheeky_device) == -1)
+			if (set_hmove(optarg, &state) == -1)
 				return (-1);
 			break;
 		case 'n':
-			if (set_negative(optarg, cheeky_device) == -1)
+			if (set_negative(optarg, &state) == -1)
+				return (-1);
+			break;
+		case 'p':
+			if (set_screen(optarg, &screen) == -1)
+				return (-1);
+			has_screen = 1;
+			break;
+		case 'r':
+			if (set_rate(optarg, &state) == -1)
 				return (-1);
 			break;
 		case 's':
-			if (set_speed(optarg, cheeky_device) == -1)
+			if (set_speed(optarg, &state) == -1)
 				return (-1);
 			break;
 		case 't':
-			if (set_text(optarg, cheeky_device) == -1)
+			if (set_text(optarg, &state) == -1)
 				return (-1);
 			break;
 		case 'v':
-			if (set_vmove(optarg, cheeky_device) == -1)
+			if (set_vmove(optarg, &state) == -1)
+				return (-1);
+			break;
+		case 'w':
+			if (set_wall(optarg, &wall) == -1)
+				return (-1);
+			has_wall = 1;
+			break;
+		case 'S':
+			if (set_smooth(optarg, &state) == -1)
 				return (-1);
 			break;
 		case 'h':
@@ -362,6 +534,49 @@ int		main(int	argc,
 		}
 	}
 
+	if (has_wall && ioctl(cheeky_device, IOCTL_CMD_SET_WALL, &wall) == -1) {
+		printf("cheeky_display: Cannot group the displays into a wall.\n");
+		close(cheeky_device);
+		return (-1);
+	}
+
+	/* The options which follow change the screen of the file */
+	if (has_screen && ioctl(cheeky_device, IOCTL_CMD_SET_SCREEN, &screen) == -1) {
+		printf("cheeky_display: Cannot set the screen of /dev/cheeky0.\n");
+		close(cheeky_device);
+		return (-1);
+	}
+
+	if (state.mask && ioctl(cheeky_device, IOCTL_CMD_SET_STATE, &state) == -1) {
+		printf("cheeky_display; Cannot write to device /dev/cheeky0. Is the display plugged ? "
+		       "Is you user a member of the group cheeky ?\n");
+		close(cheeky_device);
+		return (-1);
+	}
+
+	if (has_counter && ioctl(cheeky_device, IOCTL_CMD_COUNTER, &counter) == -1) {
+		printf("cheeky_display: Cannot set the counter of /dev/cheeky0.\n");
+		close(cheeky_device);
+		return (-1);
+	}
+
+	/* The ticker is written through a file in append mode */
+	if (append &&
+	    (fcntl(cheeky_device, F_SETFL, O_APPEND) == -1 ||
+	     write(cheeky_device, append, strlen(append)) == -1)) {
+		printf("cheeky_display: Cannot append to the ticker of /dev/cheeky0.\n");
+		close(cheeky_device);
+		return (-1);
+	}
+
+	/* The screen is shown as long as the file is opened */
+	if (has_screen) {
+		if (screen.ttl)
+			usleep(screen.ttl * 1000);
+		else
+			pause();
+	}
+
 	close(cheeky_device);
 
 	return (0);
@@ -23,533 +23,5592 @@ MODULE_DESCRIPTION("USB led display driver");
 MODULE_AUTHOR("Quentin Casasnovas");
 MODULE_LICENSE("GPL");
 
-static struct usb_device_id cheeky_id_table[] __devinitdata = {
+static const struct usb_device_id cheeky_id_table[] = {
 	{USB_DEVICE(USB_VID, USB_PID)},
 	{}
 };
 
 MODULE_DEVICE_TABLE(usb, cheeky_id_table);
 
-static const character_map_t 	character_map[] = {
-	{'A', COMPLETE_BITFIELD(0b111101101111101101101)},
-	{'B', COMPLETE_BITFIELD(0b011101101011101101011)},
-	{'C', COMPLETE_BITFIELD(0b110001001001001001110)},
-	{'D', COMPLETE_BITFIELD(0b011111101101101111011)},
-	{'E', COMPLETE_BITFIELD(0b111001001011001001111)},
-	{'F', COMPLETE_BITFIELD(0b111001001011001001001)},
-	{'G', COMPLETE_BITFIELD(0b110001001111101101110)},
-	{'H', COMPLETE_BITFIELD(0b101101101111101101101)},
-	{'I', COMPLETE_BITFIELD(0b010000010010010010010)},
-	{'J', COMPLETE_BITFIELD(0b110100100101101101010)},
-	{'K', COMPLETE_BITFIELD(0b101101111001011101101)},
-	{'L', COMPLETE_BITFIELD(0b001001001001001001111)},
-	{'M', COMPLETE_BITFIELD(0b101111111101101101101)},
-	{'N', COMPLETE_BITFIELD(0b101101111111101101101)},
-	{'O', COMPLETE_BITFIELD(0b010101101101101101010)},
-	{'P', COMPLETE_BITFIELD(0b011101101011001001001)},
-	{'Q', COMPLETE_BITFIELD(0b010101101101101111110)},
-	{'R', COMPLETE_BITFIELD(0b011101101011001011101)},
-	{'S', COMPLETE_BITFIELD(0b010101001010100101010)},
-	{'T', COMPLETE_BITFIELD(0b111010010010010010010)},
-	{'U', COMPLETE_BITFIELD(0b101101101101101101010)},
-	{'V', COMPLETE_BITFIELD(0b101101101101101010010)},
-	{'W', COMPLETE_BITFIELD(0b101101101111111101010)},
-	{'X', COMPLETE_BITFIELD(0b101101101010101101101)},
-	{'Y', COMPLETE_BITFIELD(0b101101101010010010010)},
-	{'Z', COMPLETE_BITFIELD(0b111100010010010001111)},
-	{'0', COMPLETE_BITFIELD(0b010101101101101101010)},
-	{'1', COMPLETE_BITFIELD(0b010011010010010010111)},
-	{'2', COMPLETE_BITFIELD(0b010101101100010011111)},
-	{'3', COMPLETE_BITFIELD(0b010101100010100100111)},
-	{'4', COMPLETE_BITFIELD(0b001001001101111100100)},
-	{'5', COMPLETE_BITFIELD(0b111001001011100100011)},
-	{'6', COMPLETE_BITFIELD(0b110001001011101101010)},
-	{'7', COMPLETE_BITFIELD(0b111100100010010001001)},
-	{'8', COMPLETE_BITFIELD(0b010101101010101101010)},
-	{'9', COMPLETE_BITFIELD(0b010101101110100101010)},
-	{'-', COMPLETE_BITFIELD(0b000000000111000000000)},
-	{'_', COMPLETE_BITFIELD(0b000000000000000000111)},
-	{'(', COMPLETE_BITFIELD(0b100010010001010010100)},
-	{')', COMPLETE_BITFIELD(0b001010010100010010001)},
-	{'\\', COMPLETE_BITFIELD(0b001001010010010100100)},
-	{'/', COMPLETE_BITFIELD(0b100100010010010001001)},
-	{'|', COMPLETE_BITFIELD(0b010010010010010010010)},
-	{'\'', COMPLETE_BITFIELD(0b010010000000000000000)},
-	{'<', COMPLETE_BITFIELD(0b100010001001001010100)},
-	{'>', COMPLETE_BITFIELD(0b001010100100100010001)},
-	{'!', COMPLETE_BITFIELD(0b010010010010010000010)},
-	{'?', COMPLETE_BITFIELD(0b010101101100010000010)},
-	{'.', COMPLETE_BITFIELD(0b000000000000000000001)},
-	{',', COMPLETE_BITFIELD(0b000000000000000100010)},
-	{';', COMPLETE_BITFIELD(0b000000010000010001000)},
-	{':', COMPLETE_BITFIELD(0b000000010000010000000)},
-	{'^', COMPLETE_BITFIELD(0b010101000000000000000)},
-	{'=', COMPLETE_BITFIELD(0b000000111000111000000)},
-	{'+', COMPLETE_BITFIELD(0b000000010111010000000)},
-	{'"', COMPLETE_BITFIELD(0b110011000000000000000)},
-	{' ', COMPLETE_BITFIELD(0b000000000000000000000)},
-	{'\0',COMPLETE_BITFIELD(0b000000000000000000000)}
+/**
+ * @brief
+ *	The maximum time, in milliseconds, a usb packet which did not change is
+ *	left without being sent again to the device, 0 to never send it again.
+ */
+static unsigned int		keepalive = 1000;
+module_param(keepalive, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(keepalive, "Interval in ms at which unchanged packets are sent again (0: never)");
+
+/**
+ * @brief
+ *	The number of frames per second rendered for each device, independently
+ *	of the speed of the effects.
+ */
+static unsigned int		frame_rate = 50;
+module_param(frame_rate, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(frame_rate, "Frames per second rendered for each display (1-1000)");
+
+/**
+ * @brief
+ *	The number of subframes per second rendered for a display showing a
+ *	greyscale image, which is dithered over GREY_SUBFRAMES subframes.
+ */
+static unsigned int		grey_rate = 750;
+module_param(grey_rate, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(grey_rate, "Subframes per second rendered for greyscale images (1-1000)");
+
+/**
+ * @brief
+ *	The name of the binary font loaded with request_firmware() instead of
+ *	the built-in one, empty for the built-in font.  Setting it while the
+ *	module is loaded swaps the font at once.
+ */
+static char*			font_name;
+static const struct kernel_param_ops	cheeky_font_ops;
+module_param_cb(font, &cheeky_font_ops, &font_name, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(font, "Binary font loaded from the firmware directory (empty: built-in font)");
+
+/**
+ * @brief
+ *	The built-in binary font, written by cheeky_font -c from
+ *	src/cheeky_font/default.font.  The lowercase letters share the glyphs of
+ *	the uppercase ones.
+ */
+static const __u8		cheeky_default_font[] = {
+	/* Header: "CHKF", version 1, 3x7 glyphs, characters 32 to 124, 57 glyphs */
+	0x43, 0x48, 0x4b, 0x46, 0x01, 0x00, 0x03, 0x07, 0x20, 0x00, 0x5d, 0x00, 0x39, 0x00, 0x00, 0x00,
+	/* Index */
+	0x38, 0x00,	/* 32 */
+	0x2e, 0x00,	/* ! */
+	0x37, 0x00,	/* " */
+	0xff, 0xff,	/* # */
+	0xff, 0xff,	/* $ */
+	0xff, 0xff,	/* % */
+	0xff, 0xff,	/* & */
+	0x2b, 0x00,	/* ' */
+	0x26, 0x00,	/* ( */
+	0x27, 0x00,	/* ) */
+	0xff, 0xff,	/* * */
+	0x36, 0x00,	/* + */
+	0x31, 0x00,	/* , */
+	0x24, 0x00,	/* - */
+	0x30, 0x00,	/* . */
+	0x29, 0x00,	/* / */
+	0x1a, 0x00,	/* 0 */
+	0x1b, 0x00,	/* 1 */
+	0x1c, 0x00,	/* 2 */
+	0x1d, 0x00,	/* 3 */
+	0x1e, 0x00,	/* 4 */
+	0x1f, 0x00,	/* 5 */
+	0x20, 0x00,	/* 6 */
+	0x21, 0x00,	/* 7 */
+	0x22, 0x00,	/* 8 */
+	0x23, 0x00,	/* 9 */
+	0x33, 0x00,	/* : */
+	0x32, 0x00,	/* ; */
+	0x2c, 0x00,	/* < */
+	0x35, 0x00,	/* = */
+	0x2d, 0x00,	/* > */
+	0x2f, 0x00,	/* ? */
+	0xff, 0xff,	/* @ */
+	0x00, 0x00,	/* A */
+	0x01, 0x00,	/* B */
+	0x02, 0x00,	/* C */
+	0x03, 0x00,	/* D */
+	0x04, 0x00,	/* E */
+	0x05, 0x00,	/* F */
+	0x06, 0x00,	/* G */
+	0x07, 0x00,	/* H */
+	0x08, 0x00,	/* I */
+	0x09, 0x00,	/* J */
+	0x0a, 0x00,	/* K */
+	0x0b, 0x00,	/* L */
+	0x0c, 0x00,	/* M */
+	0x0d, 0x00,	/* N */
+	0x0e, 0x00,	/* O */
+	0x0f, 0x00,	/* P */
+	0x10, 0x00,	/* Q */
+	0x11, 0x00,	/* R */
+	0x12, 0x00,	/* S */
+	0x13, 0x00,	/* T */
+	0x14, 0x00,	/* U */
+	0x15, 0x00,	/* V */
+	0x16, 0x00,	/* W */
+	0x17, 0x00,	/* X */
+	0x18, 0x00,	/* Y */
+	0x19, 0x00,	/* Z */
+	0xff, 0xff,	/* [ */
+	0x28, 0x00,	/* \ */
+	0xff, 0xff,	/* ] */
+	0x34, 0x00,	/* ^ */
+	0x25, 0x00,	/* _ */
+	0xff, 0xff,	/* ` */
+	0x00, 0x00,	/* a */
+	0x01, 0x00,	/* b */
+	0x02, 0x00,	/* c */
+	0x03, 0x00,	/* d */
+	0x04, 0x00,	/* e */
+	0x05, 0x00,	/* f */
+	0x06, 0x00,	/* g */
+	0x07, 0x00,	/* h */
+	0x08, 0x00,	/* i */
+	0x09, 0x00,	/* j */
+	0x0a, 0x00,	/* k */
+	0x0b, 0x00,	/* l */
+	0x0c, 0x00,	/* m */
+	0x0d, 0x00,	/* n */
+	0x0e, 0x00,	/* o */
+	0x0f, 0x00,	/* p */
+	0x10, 0x00,	/* q */
+	0x11, 0x00,	/* r */
+	0x12, 0x00,	/* s */
+	0x13, 0x00,	/* t */
+	0x14, 0x00,	/* u */
+	0x15, 0x00,	/* v */
+	0x16, 0x00,	/* w */
+	0x17, 0x00,	/* x */
+	0x18, 0x00,	/* y */
+	0x19, 0x00,	/* z */
+	0xff, 0xff,	/* { */
+	0x2a, 0x00,	/* | */
+	/* Glyphs */
+	0b111, 0b101, 0b101, 0b111, 0b101, 0b101, 0b101,	/* A a */
+	0b011, 0b101, 0b101, 0b011, 0b101, 0b101, 0b011,	/* B b */
+	0b110, 0b001, 0b001, 0b001, 0b001, 0b001, 0b110,	/* C c */
+	0b011, 0b111, 0b101, 0b101, 0b101, 0b111, 0b011,	/* D d */
+	0b111, 0b001, 0b001, 0b011, 0b001, 0b001, 0b111,	/* E e */
+	0b111, 0b001, 0b001, 0b011, 0b001, 0b001, 0b001,	/* F f */
+	0b110, 0b001, 0b001, 0b111, 0b101, 0b101, 0b110,	/* G g */
+	0b101, 0b101, 0b101, 0b111, 0b101, 0b101, 0b101,	/* H h */
+	0b010, 0b000, 0b010, 0b010, 0b010, 0b010, 0b010,	/* I i */
+	0b110, 0b100, 0b100, 0b101, 0b101, 0b101, 0b010,	/* J j */
+	0b101, 0b101, 0b111, 0b001, 0b011, 0b101, 0b101,	/* K k */
+	0b001, 0b001, 0b001, 0b001, 0b001, 0b001, 0b111,	/* L l */
+	0b101, 0b111, 0b111, 0b101, 0b101, 0b101, 0b101,	/* M m */
+	0b101, 0b101, 0b111, 0b111, 0b101, 0b101, 0b101,	/* N n */
+	0b010, 0b101, 0b101, 0b101, 0b101, 0b101, 0b010,	/* O o */
+	0b011, 0b101, 0b101, 0b011, 0b001, 0b001, 0b001,	/* P p */
+	0b010, 0b101, 0b101, 0b101, 0b101, 0b111, 0b110,	/* Q q */
+	0b011, 0b101, 0b101, 0b011, 0b001, 0b011, 0b101,	/* R r */
+	0b010, 0b101, 0b001, 0b010, 0b100, 0b101, 0b010,	/* S s */
+	0b111, 0b010, 0b010, 0b010, 0b010, 0b010, 0b010,	/* T t */
+	0b101, 0b101, 0b101, 0b101, 0b101, 0b101, 0b010,	/* U u */
+	0b101, 0b101, 0b101, 0b101, 0b101, 0b010, 0b010,	/* V v */
+	0b101, 0b101, 0b101, 0b111, 0b111, 0b101, 0b010,	/* W w */
+	0b101, 0b101, 0b101, 0b010, 0b101, 0b101, 0b101,	/* X x */
+	0b101, 0b101, 0b101, 0b010, 0b010, 0b010, 0b010,	/* Y y */
+	0b111, 0b100, 0b010, 0b010, 0b010, 0b001, 0b111,	/* Z z */
+	0b010, 0b101, 0b101, 0b101, 0b101, 0b101, 0b010,	/* 0 */
+	0b010, 0b011, 0b010, 0b010, 0b010, 0b010, 0b111,	/* 1 */
+	0b010, 0b101, 0b101, 0b100, 0b010, 0b011, 0b111,	/* 2 */
+	0b010, 0b101, 0b100, 0b010, 0b100, 0b100, 0b111,	/* 3 */
+	0b001, 0b001, 0b001, 0b101, 0b111, 0b100, 0b100,	/* 4 */
+	0b111, 0b001, 0b001, 0b011, 0b100, 0b100, 0b011,	/* 5 */
+	0b110, 0b001, 0b001, 0b011, 0b101, 0b101, 0b010,	/* 6 */
+	0b111, 0b100, 0b100, 0b010, 0b010, 0b001, 0b001,	/* 7 */
+	0b010, 0b101, 0b101, 0b010, 0b101, 0b101, 0b010,	/* 8 */
+	0b010, 0b101, 0b101, 0b110, 0b100, 0b101, 0b010,	/* 9 */
+	0b000, 0b000, 0b000, 0b111, 0b000, 0b000, 0b000,	/* - */
+	0b000, 0b000, 0b000, 0b000, 0b000, 0b000, 0b111,	/* _ */
+	0b100, 0b010, 0b010, 0b001, 0b010, 0b010, 0b100,	/* ( */
+	0b001, 0b010, 0b010, 0b100, 0b010, 0b010, 0b001,	/* ) */
+	0b001, 0b001, 0b010, 0b010, 0b010, 0b100, 0b100,	/* \ */
+	0b100, 0b100, 0b010, 0b010, 0b010, 0b001, 0b001,	/* / */
+	0b010, 0b010, 0b010, 0b010, 0b010, 0b010, 0b010,	/* | */
+	0b010, 0b010, 0b000, 0b000, 0b000, 0b000, 0b000,	/* ' */
+	0b100, 0b010, 0b001, 0b001, 0b001, 0b010, 0b100,	/* < */
+	0b001, 0b010, 0b100, 0b100, 0b100, 0b010, 0b001,	/* > */
+	0b010, 0b010, 0b010, 0b010, 0b010, 0b000, 0b010,	/* ! */
+	0b010, 0b101, 0b101, 0b100, 0b010, 0b000, 0b010,	/* ? */
+	0b000, 0b000, 0b000, 0b000, 0b000, 0b000, 0b001,	/* . */
+	0b000, 0b000, 0b000, 0b000, 0b000, 0b100, 0b010,	/* , */
+	0b000, 0b000, 0b010, 0b000, 0b010, 0b001, 0b000,	/* ; */
+	0b000, 0b000, 0b010, 0b000, 0b010, 0b000, 0b000,	/* : */
+	0b010, 0b101, 0b000, 0b000, 0b000, 0b000, 0b000,	/* ^ */
+	0b000, 0b000, 0b111, 0b000, 0b111, 0b000, 0b000,	/* = */
+	0b000, 0b000, 0b010, 0b111, 0b010, 0b000, 0b000,	/* + */
+	0b110, 0b011, 0b000, 0b000, 0b000, 0b000, 0b000,	/* " */
+	0b000, 0b000, 0b000, 0b000, 0b000, 0b000, 0b000,	/* space */
 };
 
 static struct usb_driver cheeky_driver;
+static const struct file_operations	cheeky_fops;
+static void			cheeky_delete(struct kref*	ref);
+static int			cheeky_set_state(client_t*			client,
+						 const cheeky_state_t*	request);
+static int			cheeky_refont_state(state_t*	state);
 
 /**
  * @brief
- *	Returns the bitfield associated with the character c.
- * @param c The letter we're searching the bitfield for.
- * @return The bitfield corresponding to the letter c.
+ *	The font in use, replaced as a whole by cheeky_set_font(), so that a
+ *	renderer holding the RCU read lock always sees a single font.
  */
-static unsigned int		cheeky_get_bitfield(char		c)
-{
-	const character_map_t*	chars_map = character_map;
+static font_t __rcu*		cheeky_font;
 
-	while (chars_map->letter != '\0'	&&
-	       chars_map->letter != c) {
-		if (c >= 'a'	&&
-		    c <= 'z'	&&
-		    c - 32 == chars_map->letter)
-			break;
-		else
-			++chars_map;
-	}
+/**
+ * @brief
+ *	Serializes the fonts set, and the firmware device with them.
+ */
+static DEFINE_MUTEX(cheeky_font_lock);
+
+/**
+ * @brief
+ *	The device the fonts are requested for, NULL while /dev/cheeky_all is
+ *	not registered: a font set before only changes font_name.
+ */
+static struct device*		cheeky_font_device;
+
+/**
+ * @brief
+ *	The rank of each subframe of a greyscale image: a LED is on in the
+ *	subframes whose rank is below its level.  The ranks are the bit
+ *	reversal of the subframe numbers, so that the subframes a LED is on are
+ *	spread over the cycle instead of making a single pulse.
+ */
+static const __u8		grey_rank[GREY_SUBFRAMES] = {
+	7, 3, 11, 1, 9, 5, 13, 0, 8, 4, 12, 2, 10, 6, 14
+};
 
-	return (chars_map->bitfield);
+/**
+ * @brief
+ *	Returns the glyph of a character in the font in use, the caller holding
+ *	the RCU read lock.
+ * @param c The character.
+ * @return The glyph.
+ */
+static inline const glyph_t*	cheeky_glyph(unsigned char	c)
+{
+	return (&rcu_dereference(cheeky_font)->glyphs[c]);
 }
 
 /**
  * @brief
- *	Refresh rows row_number AND (row_number + 1) in the usb packet
- *	that we'll send to the led device. This function is also in charge
- *	to make the horizontal move and the negative display.
- * @param data Our private structure where all params are located.
- * @param row_number The first row this function is updating.
- * @param decale The number of LED, between 0 and 2, to shift.
+ *	Returns the seq of the font in use.
+ * @return The seq.
  */
-static void		cheeky_refresh_row(data_t*		data,
-					__u8		row_number,
-					__u8		decale)
+static unsigned long		cheeky_font_seq(void)
 {
-	unsigned int		bitfield;
-	char			char_to_print;
-	__be32		first_row = 0;
-	__be32		second_row = 0;
-	__u8			i;
-	__s8			hmove;
+	unsigned long		seq;
 
-	data->display_packets[row_number].brighness = GET_BRIGHNESS(data->params);
-	data->display_packets[row_number].row_number = row_number * 2;
+	rcu_read_lock();
+	seq = rcu_dereference(cheeky_font)->seq;
+	rcu_read_unlock();
 
-	/* Updating the usb packet depending on the text buffer */
-	for (i = 0; i < 8; ++i)	{
-		up(&data->sem_buffer);
-		char_to_print =
-			data->buffer[(i + data->start_character) % data->length];
-		down(&data->sem_buffer);
+	return (seq);
+}
 
-		bitfield = cheeky_get_bitfield(char_to_print);
+/**
+ * @brief
+ *	Sets the 3 bits of a glyph row slice at column in a strip row, in place
+ *	of the slice rendered there before.
+ * @param row The strip row to update.
+ * @param words The number of words of the strip row.
+ * @param column The column of the leftmost LED of the slice.
+ * @param slice The glyph row slice.
+ */
+static void		cheeky_strip_set(__u32*		row,
+					 unsigned int	words,
+					 unsigned int	column,
+					 __u8		slice)
+{
+	unsigned int		word = column / 32;
+	unsigned int		bit = column % 32;
+	__u32			mask = (1 << GLYPH_WIDTH) - 1;
 
-		first_row |= ROW(row_number * 2, bitfield) << (3 * (i + 1));
-		second_row |= ROW(row_number * 2 + 1, bitfield) << (3 * (i + 1));
+	if (word >= words)
+		return;
+	row[word] &= ~(mask << bit);
+	row[word] |= (__u32) slice << bit;
+	if (bit > 32 - GLYPH_WIDTH && word + 1 < words) {
+		row[word + 1] &= ~(mask >> (32 - bit));
+		row[word + 1] |= (__u32) slice >> (32 - bit);
 	}
+}
 
-	/* If there is a horizontal move, just shift the bits :) */
-	hmove = GET_HMOVE(data->params);
-	if (hmove & LED_RIGHT_TO_LEFT) {
-		first_row >>= decale;
-		second_row >>= decale;
-	}
-	else if (hmove & LED_LEFT_TO_RIGHT) {
-		up(&data->sem_buffer);
-		char_to_print =
-			data->buffer[(i - 2 + data->start_character) % data->length];
-		down(&data->sem_buffer);
+/**
+ * @brief
+ *	Renders a whole text message into a strip of NB_ROWS rows.  The first
+ *	characters are rendered again after the end of the message, so that a
+ *	32 bits window starting at any column of the message can be read.  The
+ *	whole strip is rendered with the same font, even if it is swapped.
+ * @param text The message to render.
+ * @param length The length of the message, at least MIN_CHARS.
+ * @param words Where to store the number of words of each strip row.
+ * @param font_seq Where to store the seq of the font used.
+ * @return The newly allocated strip, NULL if we are out of memory.
+ */
+static __u32*		cheeky_render_strip(const char*	text,
+					    size_t		length,
+					    unsigned int*	words,
+					    unsigned long*	font_seq)
+{
+	const glyph_t*	glyph;
+	const font_t*		font;
+	__u32*		strip;
+	unsigned int		i;
+	__u8			row;
 
-		bitfield = cheeky_get_bitfield(char_to_print);
-		first_row |= ROW(row_number * 2, bitfield);
-		second_row |= ROW(row_number * 2 + 1, bitfield);
+	*words = (length * GLYPH_WIDTH) / 32 + 2;
+	strip = kzalloc(NB_ROWS * *words * sizeof(__u32), GFP_KERNEL);
+	if (!strip)
+		return (NULL);
 
-		first_row <<= decale;
-		second_row <<= decale;
+	rcu_read_lock();
+	font = rcu_dereference(cheeky_font);
+	*font_seq = font->seq;
+	for (i = 0; i * GLYPH_WIDTH < *words * 32; ++i) {
+		glyph = &font->glyphs[(unsigned char) text[i % length]];
+		for (row = 0; row < NB_ROWS; ++row)
+			cheeky_strip_set(strip + row * *words,
+					 *words,
+					 i * GLYPH_WIDTH,
+					 glyph->rows[row]);
 	}
+	rcu_read_unlock();
+
+	return (strip);
+}
+
+/**
+ * @brief
+ *	Returns the NB_COLUMNS columns of a strip row starting at column,
+ *	using at most two word reads.
+ * @param row The strip row.
+ * @param column The column printed on the leftmost LED.
+ * @return The window, the lowest bit being the leftmost LED.
+ */
+static __u32		cheeky_strip_window(const __u32*	row,
+					    unsigned int	column)
+{
+	unsigned int		word = column / 32;
+	unsigned int		bit = column % 32;
+	__u32			window;
+
+	window = row[word] >> bit;
+	if (bit)
+		window |= row[word + 1] << (32 - bit);
+
+	return (window & ((1 << NB_COLUMNS) - 1));
+}
+
+/**
+ * @brief
+ *	Renders some characters of a text again in its strip, after they were
+ *	replaced in its buffer.
+ * @param text The text, which must not be shared with the scheduler.
+ * @param offset The index of the first character.
+ * @param chars The new characters.
+ * @param count The number of characters.
+ */
+static void		cheeky_render_chars(text_t*	text,
+					    size_t	offset,
+					    const char*	chars,
+					    size_t	count)
+{
+	const glyph_t*	glyph;
+	unsigned int		copy;
+	unsigned int		i;
+	__u8			row;
+
+	/* The first characters are also repeated after the end of the strip */
+	rcu_read_lock();
+	for (copy = offset; copy * GLYPH_WIDTH < text->strip_words * 32;
+	     copy += text->length)
+		for (i = 0; i < count; ++i) {
+			glyph = cheeky_glyph(chars[i]);
+			for (row = 0; row < NB_ROWS; ++row)
+				cheeky_strip_set(text->strip +
+						 row * text->strip_words,
+						 text->strip_words,
+						 (copy + i) * GLYPH_WIDTH,
+						 glyph->rows[row]);
+		}
+	rcu_read_unlock();
+}
+
+/**
+ * @brief
+ *	Releases a rendered text once the last state using it is gone.
+ * @param ref The reference counter of the text.
+ */
+static void		cheeky_free_text(struct kref*	ref)
+{
+	text_t*		text = container_of(ref, text_t, ref);
+
+	if (text->live)
+		kref_put(&text->live->ref, cheeky_free_text);
+	kfree(text->buffer);
+	kfree(text->strip);
+	kfree(text);
+}
+
+/**
+ * @brief
+ *	Packs two rows of LED in a usb packet, as expected by the led device.
+ *	This function is also in charge of the negative display.
+ * @param packet The usb packet to fill.
+ * @param row_number The index of the packet, it holds rows row_number * 2
+ * and row_number * 2 + 1.
+ * @param first_row The first row, the lowest bit being the leftmost LED.
+ * @param second_row The second row.
+ * @param params The params of the display.
+ */
+static void		cheeky_pack_packet(usb_packet_t*	packet,
+					   __u8			row_number,
+					   __u32		first_row,
+					   __u32		second_row,
+					   __u16		params)
+{
+	packet->brighness = GET_BRIGHNESS(params);
+	packet->row_number = row_number * 2;
 
 	/*
 	 * Reverse the byte order of the usb packet, the led device is excepting
 	 * bigendian bytesx
 	 */
-	if (GET_NEGATIVE(data->params))	{
-		data->display_packets[row_number].first_row =
-			cpu_to_be32((first_row << 5));
-		data->display_packets[row_number].second_row =
-			cpu_to_be32((second_row << 5));
+	if (GET_NEGATIVE(params))	{
+		packet->first_row = cpu_to_be32((first_row << 8));
+		packet->second_row = cpu_to_be32((second_row << 8));
 	}
 	else {
-		data->display_packets[row_number].first_row =
-			cpu_to_be32(~(first_row << 5));
-		data->display_packets[row_number].second_row =
-			cpu_to_be32(~(second_row << 5));
+		packet->first_row = cpu_to_be32(~(first_row << 8));
+		packet->second_row = cpu_to_be32(~(second_row << 8));
+	}
+}
+
+/**
+ * @brief
+ *	Turns a line of one bit pixels, the leftmost LED being the most
+ *	significant bit of the first byte, into a row with the leftmost LED in
+ *	the lowest bit.
+ * @param line The NB_COLUMNS bits of the line.
+ * @return The row.
+ */
+static __u32		cheeky_mono_row(const __u8*	line)
+{
+	return ((bitrev8(line[0])		|
+		 bitrev8(line[1]) << 8	|
+		 bitrev8(line[2]) << 16) & ((1 << NB_COLUMNS) - 1));
+}
+
+/**
+ * @brief
+ *	Refresh rows row_number AND (row_number + 1) in a usb packet that we'll
+ *	send to the led device, from the window of the strip at position.
+ * @param state The state of the display to render.
+ * @param text The text of the state, with its live fields filled in.
+ * @param packets The frame to update.
+ * @param row_number The usb packet this function is updating.
+ * @param position The strip column printed on the leftmost LED.
+ */
+static void		cheeky_refresh_row(const state_t*	state,
+					const text_t*		text,
+					usb_packet_t*		packets,
+					__u8			row_number,
+					unsigned int		position)
+{
+	__u32			first_row;
+	__u32			second_row = 0;
+
+	first_row = cheeky_strip_window(text->strip +
+					row_number * 2 * text->strip_words,
+					position);
+	if (row_number * 2 + 1 < NB_ROWS)
+		second_row = cheeky_strip_window(text->strip +
+						 (row_number * 2 + 1) *
+						 text->strip_words,
+						 position);
+
+	cheeky_pack_packet(&packets[row_number], row_number,
+			   first_row, second_row, state->params);
+}
+
+/**
+ * @brief
+ *	Makes a vertical switch with the rows if choosen by the user.
+ * @param packets The frame to update.
+ * @param direction The vertical move, LED_UP_TO_DOWN or LED_DOWN_TO_UP.
+ * @param vdecale Number of line to shift.
+ */
+static void		cheeky_vertical_move(usb_packet_t*	packets,
+					  __s8		direction,
+					  __u8		vdecale)
+{
+	unsigned int		rows[NB_PACKETS * 2];
+	__u8			shift;
+	__u8			i;
+
+	if (!vdecale)
+		return;
+	if (direction & LED_DOWN_TO_UP)
+		shift = vdecale;
+	else if (direction & LED_UP_TO_DOWN)
+		shift = NB_PACKETS * 2 - vdecale;
+	else
+		return;
+
+	for (i = 0; i < NB_PACKETS; ++i) {
+		rows[i * 2] = packets[i].first_row;
+		rows[i * 2 + 1] = packets[i].second_row;
+	}
+	for (i = 0; i < NB_PACKETS; ++i) {
+		packets[i].first_row = rows[(i * 2 + shift) % (NB_PACKETS * 2)];
+		packets[i].second_row =
+			rows[(i * 2 + 1 + shift) % (NB_PACKETS * 2)];
+	}
+}
+
+/**
+ * @brief
+ *	Renders a subframe of the greyscale image of a state.
+ * @param state The state of the display to render.
+ * @param packets Where to store the NB_PACKETS usb packets of the subframe.
+ * @param subframe The subframe, below GREY_SUBFRAMES.
+ */
+static void		cheeky_grey_frame(const state_t*	state,
+					  usb_packet_t*		packets,
+					  unsigned int		subframe)
+{
+	__u32			rows[NB_PACKETS * 2];
+	__u8			rank = grey_rank[subframe];
+	__u8			column;
+	__u8			row;
+
+	memset(rows, 0, sizeof(rows));
+	for (row = 0; row < NB_ROWS; ++row)
+		for (column = 0; column < NB_COLUMNS; ++column)
+			if (state->grey[row][column] > rank)
+				rows[row] |= 1 << column;
+
+	for (row = 0; row < NB_PACKETS; ++row)
+		cheeky_pack_packet(&packets[row], row,
+				   rows[row * 2], rows[row * 2 + 1],
+				   state->params);
+}
+
+/**
+ * @brief
+ *	Renders the frame shown at a given phase of the effects, without the
+ *	flash.
+ * @param state The state of the display to render.
+ * @param text The text of the state, with its live fields filled in.
+ * @param packets Where to store the NB_PACKETS usb packets of the frame.
+ * @param position The strip column printed on the leftmost LED, or the
+ * subframe of a greyscale image.
+ * @param vdecale The number of vertical LED to shift.
+ */
+static void		cheeky_render_frame(const state_t*	state,
+					const text_t*		text,
+					usb_packet_t*		packets,
+					unsigned int		position,
+					__u8			vdecale)
+{
+	__u8			i;
+
+	if (GET_GREY(state->params))
+		cheeky_grey_frame(state, packets, position);
+	else if (GET_CUSTOM(state->params))
+		memcpy(packets, state->custom_packets,
+		       sizeof(usb_packet_t) * NB_PACKETS);
+	else
+		for (i = 0; i < NB_PACKETS; ++i)
+			cheeky_refresh_row(state, text, packets, i, position);
+	cheeky_vertical_move(packets, GET_VMOVE(state->params), vdecale);
+}
+
+/**
+ * @brief
+ *	Turns off all the LED of a frame, keeping its brighness and row numbers.
+ * @param packets The frame to clear.
+ */
+static void		cheeky_clear_frame(usb_packet_t*	packets)
+{
+	__u8			i;
+
+	for (i = 0; i < NB_PACKETS; ++i) {
+		packets[i].first_row = ~0;
+		packets[i].second_row = ~0;
+	}
+}
+
+/**
+ * @brief
+ *	Releases a layout and the texts of its regions once the last state
+ *	using it is gone.
+ * @param ref The reference counter of the layout.
+ */
+static void		cheeky_free_layout(struct kref*	ref)
+{
+	layout_t*		layout = container_of(ref, layout_t, ref);
+	unsigned int		i;
+
+	for (i = 0; i < layout->count; ++i)
+		if (layout->regions[i].text)
+			kref_put(&layout->regions[i].text->ref,
+				 cheeky_free_text);
+	kfree(layout);
+}
+
+/**
+ * @brief
+ *	Tells if a state shows its layout, that is if it has one and shows
+ *	neither usb packets nor a greyscale image.
+ * @param state The state of the display.
+ * @return 1 if the regions are composed, 0 otherwise.
+ */
+static int		cheeky_has_layout(const state_t*	state)
+{
+	return (state->layout			&&
+		!GET_CUSTOM(state->params)	&&
+		!GET_GREY(state->params));
+}
+
+/**
+ * @brief
+ *	Tells if a region of the layout shown by a state scrolls.
+ * @param state The state of the display.
+ * @return 1 if a region scrolls, 0 otherwise.
+ */
+static int		cheeky_layout_moves(const state_t*	state)
+{
+	unsigned int		i;
+
+	if (!cheeky_has_layout(state))
+		return (0);
+	for (i = 0; i < state->layout->count; ++i)
+		if (state->layout->regions[i].hmove &&
+		    state->layout->regions[i].rate)
+			return (1);
+
+	return (0);
+}
+
+/**
+ * @brief
+ *	Computes the whole cycle of frames for the text and params of a state
+ *	which is not published yet.  The frames are stored already packed,
+ *	indexed by position then vdecale, and followed by the cleared frame used
+ *	when flashing.  The positions of a greyscale image are its subframes.
+ *	If the cycle does not fit in MAX_CACHED_FRAMES, or if the text has live
+ *	fields, or for a layout, or if we are out of memory, no cache is kept
+ *	and the scheduler renders each frame itself.
+ * @param state The new state of the display.
+ */
+static void		cheeky_build_frames(state_t*	state)
+{
+	usb_packet_t*		frames = NULL;
+	unsigned int		positions = 1;
+	unsigned int		nb_frames;
+	unsigned int		position;
+	__u8			vsteps = 1;
+	__u8			vdecale;
+
+	if (GET_GREY(state->params))
+		positions = GREY_SUBFRAMES;
+	else if (GET_HMOVE(state->params) && !GET_CUSTOM(state->params) &&
+		 !state->layout)
+		positions = state->text->columns;
+	if (GET_VMOVE(state->params))
+		vsteps = VMOVE_STEPS;
+	nb_frames = positions * vsteps;
+
+	if (nb_frames <= MAX_CACHED_FRAMES && !cheeky_has_layout(state) &&
+	    (!state->text->nb_fields || GET_CUSTOM(state->params))) {
+		frames = kmalloc(sizeof(usb_packet_t) * NB_PACKETS *
+				 (nb_frames + 1), GFP_KERNEL | __GFP_NOWARN);
+	}
+	if (frames) {
+		for (position = 0; position < positions; ++position)
+			for (vdecale = 0; vdecale < vsteps; ++vdecale)
+				cheeky_render_frame(state, state->text,
+						    frames + NB_PACKETS *
+						    (position * vsteps + vdecale),
+						    position,
+						    vdecale);
+		memcpy(frames + NB_PACKETS * nb_frames,
+		       frames,
+		       sizeof(usb_packet_t) * NB_PACKETS);
+		cheeky_clear_frame(frames + NB_PACKETS * nb_frames);
+	}
+
+	kfree(state->frames);
+	state->frames = frames;
+	state->frame_positions = positions;
+	state->frame_vsteps = vsteps;
+}
+
+/**
+ * @brief
+ *	Takes over the cycle of frames of the published state for a new state
+ *	whose text was only patched, and renders again the frames showing the
+ *	columns patched.  The cycle is left to cheeky_build_frames when the
+ *	params or the length of the text changed.
+ * @param state The new state of the display.
+ * @param old The state published.
+ * @param column The first strip column patched.
+ * @param width The number of strip columns patched.
+ */
+static void		cheeky_patch_frames(state_t*		state,
+					    const state_t*	old,
+					    unsigned int	column,
+					    unsigned int	width)
+{
+	unsigned int		columns = state->text->columns;
+	unsigned int		positions = old->frame_positions;
+	unsigned int		position;
+	unsigned int		distance;
+	usb_packet_t*		frames;
+	__u8			vsteps = old->frame_vsteps;
+	__u8			vdecale;
+
+	if (!old->frames			||
+	    old->params != state->params	||
+	    old->text->columns != columns)
+		return;
+
+	frames = kmemdup(old->frames, sizeof(usb_packet_t) * NB_PACKETS *
+			 (positions * vsteps + 1), GFP_KERNEL);
+	if (!frames)
+		return;
+
+	for (position = 0; position < positions; ++position) {
+		/* Skip the windows which show none of the columns patched */
+		distance = (column + columns - position) % columns;
+		if (distance >= NB_COLUMNS && distance + width <= columns)
+			continue;
+		for (vdecale = 0; vdecale < vsteps; ++vdecale)
+			cheeky_render_frame(state, state->text,
+					    frames + NB_PACKETS *
+					    (position * vsteps + vdecale),
+					    position,
+					    vdecale);
+	}
+
+	state->frames = frames;
+	state->frame_positions = positions;
+	state->frame_vsteps = vsteps;
+}
+
+#if IS_ENABLED(CONFIG_VIDEOBUF2_VMALLOC)
+/**
+ * @brief
+ *	Packs the pixels of a video buffer into video_packets.
+ * @param data Our private structure.
+ * @param state The state of the display, for its brighness and negative.
+ * @param vb The video buffer.
+ */
+static void		cheeky_video_pack(data_t*		data,
+					  const state_t*	state,
+					  struct vb2_buffer*	vb)
+{
+	const __u8*		pixels = vb2_plane_vaddr(vb, 0);
+	__u32			rows[NB_PACKETS * 2];
+	__u8			column;
+	__u8			row;
+
+	memset(rows, 0, sizeof(rows));
+	for (row = 0; row < NB_ROWS; ++row) {
+		if (data->video_format == V4L2_PIX_FMT_GREY) {
+			for (column = 0; column < NB_COLUMNS; ++column)
+				if (pixels[row * NB_COLUMNS + column] & 0x80)
+					rows[row] |= 1 << column;
+		}
+		else
+			rows[row] = cheeky_mono_row(pixels +
+						    row * FB_LINE_LENGTH);
+	}
+
+	for (row = 0; row < NB_PACKETS; ++row)
+		cheeky_pack_packet(&data->video_packets[row], row,
+				   rows[row * 2], rows[row * 2 + 1],
+				   state->params);
+}
+
+/**
+ * @brief
+ *	Takes the last video buffer due at the deadline of the frame being
+ *	rendered, packs it and gives it back to the application.  The buffers
+ *	due before it are given back without being shown.  The last frame
+ *	streamed stays on the display until the next one is due.
+ * @param data Our private structure.
+ * @param state The state of the display, as published.
+ * @return 1 if next_packets was filled with a video frame, 0 otherwise.
+ */
+static int		cheeky_video_frame(data_t*		data,
+					   const state_t*	state)
+{
+	video_buffer_t*	shown = NULL;
+	video_buffer_t*	buffer;
+	unsigned long		flags;
+	__u64			deadline;
+
+	deadline = ktime_to_ns(data->deadline);
+	spin_lock_irqsave(&data->video_lock, flags);
+	if (!data->video_streaming)
+		data->video_valid = 0;
+	while (data->video_streaming && !list_empty(&data->video_queued)) {
+		buffer = list_first_entry(&data->video_queued,
+					  video_buffer_t, list);
+		if (buffer->vb.vb2_buf.timestamp > deadline)
+			break;
+		list_del(&buffer->list);
+		if (shown)
+			vb2_buffer_done(&shown->vb.vb2_buf, VB2_BUF_STATE_DONE);
+		shown = buffer;
+	}
+	if (shown) {
+		cheeky_video_pack(data, state, &shown->vb.vb2_buf);
+		vb2_buffer_done(&shown->vb.vb2_buf, VB2_BUF_STATE_DONE);
+		data->video_valid = 1;
+	}
+	if (data->video_valid)
+		memcpy(data->next_packets, data->video_packets,
+		       sizeof(usb_packet_t) * NB_PACKETS);
+	spin_unlock_irqrestore(&data->video_lock, flags);
+
+	return (data->video_valid);
+}
+
+/**
+ * @brief
+ *	Tells if video buffers are waiting for their presentation time, in
+ *	which case the device must not go idle.
+ * @param data Our private structure.
+ * @return 1 if buffers are queued, 0 otherwise.
+ */
+static int		cheeky_video_pending(data_t*	data)
+{
+	unsigned long		flags;
+	int			pending;
+
+	spin_lock_irqsave(&data->video_lock, flags);
+	pending = data->video_streaming && !list_empty(&data->video_queued);
+	spin_unlock_irqrestore(&data->video_lock, flags);
+
+	return (pending);
+}
+#else
+static int		cheeky_video_frame(data_t*		data,
+					   const state_t*	state)
+{
+	return (0);
+}
+
+static int		cheeky_video_pending(data_t*	data)
+{
+	return (0);
+}
+#endif /* CONFIG_VIDEOBUF2_VMALLOC */
+
+/**
+ * @brief
+ *	Tells if the ticker still has something to scroll: characters in its
+ *	ring, or on the display.  The caller must hold ticker_lock.
+ * @param data Our private structure.
+ * @return 1 if the ticker scrolls, 0 otherwise.
+ */
+static int		cheeky_ticker_scrolls(data_t*	data)
+{
+	__u8			i;
+
+	if (!kfifo_is_empty(&data->ticker))
+		return (1);
+	for (i = 0; i < TICKER_WINDOW; ++i)
+		if (data->ticker_window[i] != ' ')
+			return (1);
+
+	return (0);
+}
+
+/**
+ * @brief
+ *	Tells if the scheduler must keep servicing a device for its ticker.
+ * @param data Our private structure.
+ * @param state The state of the display, as published.
+ * @return 1 if the ticker is active and scrolls, 0 otherwise.
+ */
+static int		cheeky_ticker_pending(data_t*		data,
+					      const state_t*	state)
+{
+	int			pending;
+
+	if (!state->rate || data->screen_shown)
+		return (0);
+
+	spin_lock(&data->ticker_lock);
+	pending = data->ticker_active && cheeky_ticker_scrolls(data);
+	spin_unlock(&data->ticker_lock);
+
+	return (pending);
+}
+
+/**
+ * @brief
+ *	Returns the free space of the ring of the ticker.
+ * @param data Our private structure.
+ * @return The number of characters which can be appended.
+ */
+static unsigned int	cheeky_ticker_avail(data_t*	data)
+{
+	unsigned int		avail;
+
+	spin_lock(&data->ticker_lock);
+	avail = kfifo_avail(&data->ticker);
+	spin_unlock(&data->ticker_lock);
+
+	return (avail);
+}
+
+/**
+ * @brief
+ *	Scrolls the ticker from right to left.  Each character which went off
+ *	the display is dropped from the window and the next character of the
+ *	ring comes in, so that the ring only keeps what was not shown yet.
+ *	The ticker stops once its last character went off the display, and
+ *	waits while a screen is shown.
+ * @param data Our private structure.
+ * @param steps The number of LED columns to scroll.
+ * @return 1 if the ticker is active, 0 if the text is shown.
+ */
+static int		cheeky_ticker_advance(data_t*		data,
+					      unsigned int	steps)
+{
+	int			consumed = 0;
+	int			active;
+
+	if (data->screen_shown)
+		return (0);
+
+	spin_lock(&data->ticker_lock);
+	active = data->ticker_active;
+	while (active && steps-- && cheeky_ticker_scrolls(data)) {
+		if (++(data->ticker_offset) < GLYPH_WIDTH)
+			continue;
+		data->ticker_offset = 0;
+		memmove(data->ticker_window, data->ticker_window + 1,
+			TICKER_WINDOW - 1);
+		if (kfifo_get(&data->ticker,
+			      &data->ticker_window[TICKER_WINDOW - 1]))
+			consumed = 1;
+		else
+			data->ticker_window[TICKER_WINDOW - 1] = ' ';
 	}
+	spin_unlock(&data->ticker_lock);
+
+	/* Some space was freed for the writers */
+	if (consumed)
+		wake_up_interruptible(&data->ticker_wait);
+
+	return (active);
+}
+
+/**
+ * @brief
+ *	Renders the ticker in next_packets when it is active and no screen is
+ *	shown, with the brighness and the effects of the state.
+ * @param data Our private structure.
+ * @param state The state of the display, as published.
+ * @param vdecale The number of vertical LED to shift (if vmove is activated).
+ * @param flash A on/off switch.
+ * @return 1 if the ticker was rendered, 0 if the text is shown.
+ */
+static int		cheeky_ticker_frame(data_t*		data,
+					    const state_t*	state,
+					    __u8		vdecale,
+					    __u8		flash)
+{
+	__u32			rows[NB_PACKETS * 2] = { 0 };
+	const glyph_t*	glyph;
+	__u8			row;
+	__u8			i;
+
+	if (data->screen_shown)
+		return (0);
+
+	spin_lock(&data->ticker_lock);
+	if (!data->ticker_active) {
+		spin_unlock(&data->ticker_lock);
+		return (0);
+	}
+	for (i = 0; i < TICKER_WINDOW; ++i) {
+		glyph = cheeky_glyph(data->ticker_window[i]);
+		for (row = 0; row < NB_ROWS; ++row)
+			rows[row] |= (__u32) glyph->rows[row] << (i * GLYPH_WIDTH);
+	}
+	for (row = 0; row < NB_ROWS; ++row)
+		rows[row] = (rows[row] >> data->ticker_offset) &
+			((1 << NB_COLUMNS) - 1);
+	spin_unlock(&data->ticker_lock);
+
+	for (i = 0; i < NB_PACKETS; ++i)
+		cheeky_pack_packet(&data->next_packets[i], i,
+				   rows[i * 2], rows[i * 2 + 1],
+				   state->params);
+	cheeky_vertical_move(data->next_packets, GET_VMOVE(state->params),
+			     vdecale);
+	if (GET_FLASH(state->params) && flash)
+		cheeky_clear_frame(data->next_packets);
+
+	return (1);
+}
+
+/**
+ * @brief
+ *	Stops the ticker and empties its ring, the text of the state is shown
+ *	again.
+ * @param data Our private structure.
+ */
+static void		cheeky_ticker_stop(data_t*	data)
+{
+	spin_lock(&data->ticker_lock);
+	data->ticker_active = 0;
+	kfifo_reset(&data->ticker);
+	spin_unlock(&data->ticker_lock);
+
+	wake_up_interruptible(&data->ticker_wait);
+}
+
+/**
+ * @brief
+ *	Formats the current value of a live field.
+ * @param data Our private structure.
+ * @param field The field.
+ * @param tm The local time of the frame.
+ * @param value Where to store the width characters of the field, at least
+ * 16 bytes.
+ */
+static void		cheeky_format_field(data_t*		data,
+					    const field_t*	field,
+					    const struct tm*	tm,
+					    char*		value)
+{
+	char			number[24];
+	int			length;
+
+	switch (field->kind) {
+	case FIELD_TIME:
+		snprintf(value, 16, "%02d:%02d:%02d",
+			 tm->tm_hour, tm->tm_min, tm->tm_sec);
+		break;
+	case FIELD_CLOCK:
+		snprintf(value, 16, "%02d:%02d", tm->tm_hour, tm->tm_min);
+		break;
+	default:
+		length = snprintf(number, sizeof(number), "%*lld", field->width,
+				  (long long) atomic64_read(&data->counters[field->slot]));
+		/* A value too wide for its field is not truncated silently */
+		if (length > field->width)
+			memset(value, '#', field->width);
+		else
+			memcpy(value, number, field->width);
+		break;
+	}
+}
+
+/**
+ * @brief
+ *	Returns the text to render for a state.  The live fields of a text are
+ *	filled with their current values at each frame in its live copy: only
+ *	the glyph columns of the fields whose value changed are rendered
+ *	again.  The caller must be in an RCU read-side critical section.
+ * @param data Our private structure.
+ * @param state The state of the display, as published.
+ * @return The text to render.
+ */
+static const text_t*	cheeky_live_text(data_t*		data,
+					 const state_t*	state)
+{
+	text_t*		live = state->text->live;
+	const field_t*	field;
+	char			value[16];
+	struct tm		tm;
+	unsigned int		i;
+
+	if (!live)
+		return (state->text);
+
+	time64_to_tm(ktime_get_real_seconds(), -sys_tz.tz_minuteswest * 60, &tm);
+	for (i = 0; i < live->nb_fields; ++i) {
+		field = &live->fields[i];
+		cheeky_format_field(data, field, &tm, value);
+		if (!memcmp(live->buffer + field->offset, value, field->width))
+			continue;
+		memcpy(live->buffer + field->offset, value, field->width);
+		cheeky_render_chars(live, field->offset, value, field->width);
+	}
+
+	return (live);
+}
+
+/**
+ * @brief
+ *	Composes the regions of the layout of a state, each one showing the
+ *	window of its text at its own scroll, clipped to its rectangle and
+ *	combined with the rows composed so far with its 32 bits row masks.
+ *	The caller must be in an RCU read-side critical section.
+ * @param data Our private structure.
+ * @param state The state of the display, as published.
+ * @param packets Where to store the NB_PACKETS usb packets of the frame.
+ * @param vdecale The number of vertical LED to shift.
+ */
+static void		cheeky_layout_frame(data_t*		data,
+					    const state_t*	state,
+					    usb_packet_t*	packets,
+					    __u8		vdecale)
+{
+	__u32			rows[NB_PACKETS * 2] = { 0 };
+	const layout_t*	layout = state->layout;
+	const text_t*		shown = cheeky_live_text(data, state);
+	const region_t*	region;
+	const text_t*		text;
+	unsigned int		position;
+	unsigned int		i;
+	__u32			mask;
+	__u32			bits;
+	__u8			row;
+
+	for (i = 0; i < layout->count; ++i) {
+		region = &layout->regions[i];
+		text = region->text ? region->text : shown;
+		position = data->region_position[i] % text->columns;
+		mask = ((1 << region->width) - 1) << region->x;
+		for (row = region->y; row < region->y + region->height; ++row) {
+			bits = (cheeky_strip_window(text->strip +
+						    (row - region->y) *
+						    text->strip_words,
+						    position) << region->x) & mask;
+			if (region->op == REGION_ANDNOT)
+				rows[row] &= ~bits;
+			else if (region->op == REGION_XOR)
+				rows[row] ^= bits;
+			else
+				rows[row] |= bits;
+		}
+	}
+
+	for (row = 0; row < NB_PACKETS; ++row)
+		cheeky_pack_packet(&packets[row], row,
+				   rows[row * 2], rows[row * 2 + 1],
+				   state->params);
+	cheeky_vertical_move(packets, GET_VMOVE(state->params), vdecale);
+}
+
+/**
+ * @brief
+ *	Scrolls the regions of the layout of a state, each one at its own
+ *	rate.
+ * @param data Our private structure.
+ * @param state The state of the display, as published.
+ * @param periods The number of frame periods elapsed.
+ */
+static void		cheeky_layout_advance(data_t*		data,
+					      const state_t*	state,
+					      unsigned int	periods)
+{
+	const region_t*	region;
+	unsigned int		columns;
+	unsigned int		steps;
+	unsigned int		i;
+
+	if (!cheeky_layout_moves(state))
+		return;
+
+	for (i = 0; i < state->layout->count; ++i) {
+		region = &state->layout->regions[i];
+		if (!region->hmove)
+			continue;
+		data->region_fraction[i] +=
+			div_u64((__u64) region->rate << 32,
+				1000 * clamp_t(unsigned int, frame_rate,
+					       1, 1000)) * periods;
+		steps = data->region_fraction[i] >> 32;
+		data->region_fraction[i] &= 0xffffffff;
+
+		columns = region->text ? region->text->columns :
+			state->text->columns;
+		if (region->hmove & LED_RIGHT_TO_LEFT)
+			data->region_position[i] =
+				(data->region_position[i] + steps) % columns;
+		else
+			data->region_position[i] =
+				(data->region_position[i] + columns -
+				 steps % columns) % columns;
+	}
+}
+
+/**
+ * @brief
+ *	Returns the number of displays a device is serviced with: the displays
+ *	of its wall, or the device alone.
+ * @param wall The wall of the device, NULL if none.
+ * @return The number of displays.
+ */
+static unsigned int	cheeky_nb_panels(const wall_t*	wall)
+{
+	return (wall ? wall->count : 1);
+}
+
+/**
+ * @brief
+ *	Returns one of the displays a device is serviced with.
+ * @param data Our private structure.
+ * @param wall The wall of the device, NULL if none.
+ * @param i The index of the display, below cheeky_nb_panels().
+ * @return The display.
+ */
+static data_t*		cheeky_panel(data_t*		data,
+				     const wall_t*	wall,
+				     unsigned int	i)
+{
+	return (wall ? wall->panels[i] : data);
+}
+
+/**
+ * @brief
+ *	Fills the next_packets of a display with the frame of the current phase
+ *	at a given position, taken from the cache if it holds it.  The caller
+ *	must be in an RCU read-side critical section.
+ * @param data Our private structure, whose live fields are rendered.
+ * @param panel The display the frame is for, data or a display of its wall.
+ * @param state The state of the display, as published.
+ * @param position The strip column printed on the leftmost LED of the
+ * display, or the subframe of a greyscale image.
+ * @param vdecale The number of vertical LED to shift (if vmove is activated).
+ * @param flash A on/off switch.
+ */
+static void		cheeky_panel_frame(data_t*		data,
+					   data_t*		panel,
+					   const state_t*	state,
+					   unsigned int		position,
+					   __u8			vdecale,
+					   __u8			flash)
+{
+	unsigned int		index;
+
+	panel->next_grey = GET_GREY(state->params);
+	if (state->frames && (state->frame_positions > 1 || !position)) {
+		if (GET_FLASH(state->params) && flash)
+			index = state->frame_positions * state->frame_vsteps;
+		else
+			index = position * state->frame_vsteps +
+				(state->frame_vsteps > 1 ? vdecale : 0);
+		memcpy(panel->next_packets,
+		       state->frames + NB_PACKETS * index,
+		       sizeof(usb_packet_t) * NB_PACKETS);
+	}
+	else {
+		if (cheeky_has_layout(state))
+			cheeky_layout_frame(data, state, panel->next_packets,
+					    vdecale);
+		else
+			cheeky_render_frame(state,
+					    cheeky_live_text(data, state),
+					    panel->next_packets,
+					    position,
+					    vdecale);
+		if (GET_FLASH(state->params) && flash)
+			cheeky_clear_frame(panel->next_packets);
+	}
+}
+
+/**
+ * @brief
+ *	Fills next_packets with the frame of the current phase, taken from the
+ *	cache if there is one, or with the video frame streamed or the ticker
+ *	if any and no screen is shown.  The other displays of a wall show the
+ *	following windows of the strip, or the same usb packets or image.  The
+ *	caller must be in an RCU read-side critical section.
+ * @param data Our private structure.
+ * @param state The state of the display, as published.
+ * @param vdecale The number of vertical LED to shift (if vmove is activated).
+ * @param flash A on/off switch.
+ */
+static void		cheeky_current_frame(data_t*		data,
+					  const state_t*	state,
+					  __u8			vdecale,
+					  __u8			flash)
+{
+	const wall_t*		wall = READ_ONCE(data->wall);
+	unsigned int		position;
+	unsigned int		i;
+
+	position = GET_GREY(state->params) ? data->subframe : data->position;
+	if (state->frames && state->frame_positions == 1)
+		position = 0;
+
+	data->next_seq = state->seq;
+	data->next_grey = 0;
+	if ((data->screen_shown || !cheeky_video_frame(data, state)) &&
+	    !cheeky_ticker_frame(data, state, vdecale, flash))
+		cheeky_panel_frame(data, data, state, position, vdecale, flash);
+
+	for (i = 1; i < cheeky_nb_panels(wall); ++i)
+		cheeky_panel_frame(data, wall->panels[i], state,
+				   GET_CUSTOM(state->params) ? position :
+				   (position + i * NB_COLUMNS) %
+				   state->text->columns,
+				   vdecale, flash);
+}
+
+/**
+ * @brief
+ *	Returns the frame period of a state.  A greyscale image is rendered at
+ *	grey_rate subframes per second, a smooth display renders a frame each
+ *	time its effects move by one LED, the others, and the layouts whose
+ *	regions scroll at their own rates, render frame_rate frames per second.
+ * @param state The state of the display, as published.
+ * @return The frame period, in nanoseconds.
+ */
+static __u64		cheeky_frame_period(const state_t*	state)
+{
+	if (GET_GREY(state->params))
+		return (NSEC_PER_SEC / clamp_t(unsigned int, grey_rate, 1, 1000));
+	if (GET_SMOOTH(state->params) && state->rate &&
+	    !cheeky_has_layout(state))
+		return (div_u64(NSEC_PER_SEC * 1000ULL,
+				clamp_t(__u32, state->rate,
+					MIN_SMOOTH_RATE, MAX_RATE)));
+
+	return (NSEC_PER_SEC / clamp_t(unsigned int, frame_rate, 1, 1000));
+}
+
+/**
+ * @brief
+ *	Catches the scheduler up with a newly published state: the frames
+ *	follow its period, and the scroll starts again from the first column
+ *	when the text was replaced, as the ones of the regions when the layout
+ *	was.
+ * @param data Our private structure.
+ * @param state The state of the display, as published.
+ */
+static void		cheeky_follow_state(data_t*		data,
+					    const state_t*	state)
+{
+	unsigned long		layout_seq;
+
+	data->period = cheeky_frame_period(state);
+	layout_seq = state->layout ? state->layout->seq : 0;
+	if (layout_seq != data->layout_seq) {
+		data->layout_seq = layout_seq;
+		memset(data->region_position, 0,
+		       sizeof(data->region_position));
+		memset(data->region_fraction, 0,
+		       sizeof(data->region_fraction));
+	}
+	if (state->text_seq == data->text_seq)
+		return;
+	data->text_seq = state->text_seq;
+	data->position = 0;
+}
+
+/**
+ * @brief
+ *	Starts showing a scene of the playlist.
+ * @param data Our private structure.
+ * @param scene The scene.
+ * @param now The time at which the scene starts.
+ */
+static void		cheeky_start_scene(data_t*		data,
+					   const scene_t*	scene,
+					   ktime_t		now)
+{
+	data->scene_wraps = 0;
+	data->scene_end = scene->duration ?
+		ktime_add_ns(now, scene->duration) : KTIME_MAX;
+}
+
+/**
+ * @brief
+ *	The scheduler shared by all the devices, which services the frame
+ *	deadlines of every device from a single timer.
+ */
+static scheduler_t		cheeky_scheduler;
+
+/**
+ * @brief
+ *	Serializes the changes of the walls, so that a device is part of one
+ *	wall at most.
+ */
+static DEFINE_MUTEX(cheeky_wall_lock);
+
+/**
+ * @brief
+ *	The char device giving the same text and effects to every display.
+ */
+static broadcast_t		cheeky_broadcast;
+
+/**
+ * @brief
+ *	Returns the state published on a device, or the state it replaced if
+ *	it was broadcast and its broadcast did not start at this pass yet.  The
+ *	caller must be in an RCU read-side critical section.
+ * @param data Our private structure.
+ * @return The state of the display.
+ */
+static const state_t*	cheeky_display_state(data_t*	data)
+{
+	const state_t*	state = rcu_dereference(data->state);
+
+	if ((long) (state->broadcast_gen - cheeky_scheduler.broadcast_gen) > 0)
+		return (state->previous);
+
+	return (state);
+}
+
+/**
+ * @brief
+ *	Returns the state of the screen with the highest priority which did
+ *	not expire, if any.  The caller must be in an RCU read-side critical
+ *	section.
+ * @param data Our private structure.
+ * @param now The time of the frame rendered.
+ * @return The state of the screen, NULL to show the display itself.
+ */
+static const state_t*	cheeky_screen_state(data_t*	data,
+					    ktime_t	now)
+{
+	const screen_t*	screen;
+	const state_t*	state;
+
+	list_for_each_entry_rcu(screen, &data->screens, node) {
+		state = rcu_dereference(screen->state);
+		if (!state || !ktime_before(now, screen->expires))
+			continue;
+		data->screen_shown = 1;
+		data->screen_end = screen->expires;
+		return (state);
+	}
+	data->screen_shown = 0;
+	data->screen_end = KTIME_MAX;
+
+	return (NULL);
+}
+
+/**
+ * @brief
+ *	Returns the state the scheduler shows: the screen with the highest
+ *	priority, if any, or the scene of the playlist played, if any, or the
+ *	state published.  The playlist moves to its next scene when the
+ *	current one is over.  The caller must be in an RCU read-side critical
+ *	section.
+ * @param data Our private structure.
+ * @param now The time of the frame rendered.
+ * @return The state to show.
+ */
+static const state_t*	cheeky_scene_state(data_t*	data,
+					   ktime_t	now)
+{
+	const playlist_t*	playlist;
+	const state_t*	state;
+	const scene_t*	scene;
+
+	state = cheeky_screen_state(data, now);
+	if (state)
+		return (state);
+
+	playlist = rcu_dereference(data->playlist);
+	if (!playlist) {
+		data->scene_end = KTIME_MAX;
+		return (cheeky_display_state(data));
+	}
+
+	/* A new playlist starts from its first scene */
+	if (playlist->seq != data->playlist_seq) {
+		data->playlist_seq = playlist->seq;
+		data->playlist_done = 0;
+		data->scene = 0;
+		cheeky_start_scene(data, &playlist->scenes[0], now);
+	}
+
+	while (!data->playlist_done) {
+		scene = &playlist->scenes[data->scene];
+		if (scene->duration ? ktime_before(now, data->scene_end) :
+		    data->scene_wraps < scene->passes)
+			return (scene->state);
+		if (++(data->scene) == playlist->count) {
+			data->scene = 0;
+			if (!(playlist->flags & PLAYLIST_LOOP)) {
+				data->playlist_done = 1;
+				data->scene_end = KTIME_MAX;
+				break;
+			}
+		}
+		cheeky_start_scene(data, &playlist->scenes[data->scene], now);
+	}
+
+	return (cheeky_display_state(data));
+}
+
+/**
+ * @brief
+ *	Programs the timer of the scheduler for the earliest deadline queued.
+ */
+static void		cheeky_scheduler_arm(void)
+{
+	struct timerqueue_node*	node;
+	unsigned long			flags;
+
+	spin_lock_irqsave(&cheeky_scheduler.lock, flags);
+	node = timerqueue_getnext(&cheeky_scheduler.queue);
+	if (node)
+		hrtimer_start(&cheeky_scheduler.timer,
+			      node->expires,
+			      HRTIMER_MODE_ABS);
+	spin_unlock_irqrestore(&cheeky_scheduler.lock, flags);
+}
+
+/**
+ * @brief
+ *	Queues a device to be serviced at a given time.  A device already
+ *	queued for an earlier time is left as is, a device which is not
+ *	running is never queued.
+ * @param data Our private structure.
+ * @param when The time at which the device must be serviced.
+ */
+static void		cheeky_schedule(data_t*	data,
+					ktime_t	when)
+{
+	unsigned long		flags;
+
+	spin_lock_irqsave(&cheeky_scheduler.lock, flags);
+	if (!data->running	||
+	    (data->sched_queued &&
+	     !ktime_after(data->sched_node.expires, when))) {
+		spin_unlock_irqrestore(&cheeky_scheduler.lock, flags);
+		return;
+	}
+	if (data->sched_queued)
+		timerqueue_del(&cheeky_scheduler.queue, &data->sched_node);
+	data->sched_node.expires = when;
+	timerqueue_add(&cheeky_scheduler.queue, &data->sched_node);
+	data->sched_queued = 1;
+	spin_unlock_irqrestore(&cheeky_scheduler.lock, flags);
+
+	cheeky_scheduler_arm();
+}
+
+/**
+ * @brief
+ *	Wakes the scheduler up for a device after its text or its params
+ *	changed, in case it is idle.
+ * @param data Our private structure.
+ */
+static void		cheeky_kick(data_t*	data)
+{
+	atomic_set(&data->kicked, 1);
+	cheeky_schedule(data, ktime_get());
+}
+
+/**
+ * @brief
+ *	Releases a state of the display, and its text and its layout if no other
+ *	state uses them.
+ * @param state The state to release, it must not be published anymore.
+ */
+static void		cheeky_free_state(state_t*	state)
+{
+	if (state->previous)
+		cheeky_free_state(state->previous);
+	if (state->text)
+		kref_put(&state->text->ref, cheeky_free_text);
+	if (state->layout)
+		kref_put(&state->layout->ref, cheeky_free_layout);
+	kfree(state->frames);
+	kfree(state);
+}
+
+/**
+ * @brief
+ *	Called once the scheduler cannot see a replaced state anymore.
+ * @param rcu The rcu head of the state.
+ */
+static void		cheeky_free_state_rcu(struct rcu_head*	rcu)
+{
+	cheeky_free_state(container_of(rcu, state_t, rcu));
+}
+
+/**
+ * @brief
+ *	Releases a playlist and the states of its scenes.
+ * @param playlist The playlist, it must not be set anymore.
+ */
+static void		cheeky_free_playlist(playlist_t*	playlist)
+{
+	unsigned int		i;
+
+	for (i = 0; i < playlist->count; ++i)
+		if (playlist->scenes[i].state)
+			cheeky_free_state(playlist->scenes[i].state);
+	kfree(playlist);
+}
+
+/**
+ * @brief
+ *	Called once the scheduler cannot see a replaced playlist anymore.
+ * @param rcu The rcu head of the playlist.
+ */
+static void		cheeky_free_playlist_rcu(struct rcu_head*	rcu)
+{
+	cheeky_free_playlist(container_of(rcu, playlist_t, rcu));
+}
+
+/**
+ * @brief
+ *	Sets the playlist played by the scheduler, in place of the current
+ *	one which is released once the scheduler cannot use it anymore.  The
+ *	caller must hold state_lock.
+ * @param data Our private structure.
+ * @param playlist The new playlist, the driver keeps it, or NULL to show
+ * the state published.
+ */
+static void		cheeky_replace_playlist(data_t*	data,
+						playlist_t*	playlist)
+{
+	playlist_t*		old;
+
+	old = rcu_dereference_protected(data->playlist,
+					lockdep_is_held(&data->state_lock));
+	if (!old && !playlist)
+		return;
+	if (playlist)
+		playlist->seq = ++(data->playlists);
+	rcu_assign_pointer(data->playlist, playlist);
+	if (old)
+		call_rcu(&old->rcu, cheeky_free_playlist_rcu);
+}
+
+/**
+ * @brief
+ *	Makes a private copy of a state, which can be modified before being
+ *	published.  The text and the layout are shared, the cycle of frames is
+ *	not copied.
+ * @param old The state to copy, NULL to get an empty state.
+ * @return The new state, NULL if we are out of memory.
+ */
+static state_t*		cheeky_dup_state(const state_t*	old)
+{
+	state_t*		state;
+
+	state = kzalloc(sizeof(state_t), GFP_KERNEL);
+	if (!state || !old)
+		return (state);
+
+	*state = *old;
+	state->frames = NULL;
+	state->broadcast_gen = 0;
+	state->previous = NULL;
+	if (state->text)
+		kref_get(&state->text->ref);
+	if (state->layout)
+		kref_get(&state->layout->ref);
+
+	return (state);
+}
+
+/**
+ * @brief
+ *	Computes the cycle of frames of a new state, unless it already has one,
+ *	and publishes it in place of the current one, which is released once
+ *	the scheduler cannot use it anymore.  The playlist, if any, is stopped.
+ *	The caller must hold state_lock.
+ * @param data Our private structure.
+ * @param state The new state, the driver keeps it.
+ */
+static void		cheeky_publish_state(data_t*	data,
+					     state_t*	state)
+{
+	state_t*		old;
+
+	/* A text rendered before the font was swapped is rendered again */
+	cheeky_refont_state(state);
+	if (!state->frames)
+		cheeky_build_frames(state);
+
+	old = rcu_dereference_protected(data->state,
+					lockdep_is_held(&data->state_lock));
+	state->seq = ++(data->states);
+	rcu_assign_pointer(data->state, state);
+	/* A state broadcast keeps the one it replaces until it starts */
+	if (old && old != state->previous)
+		call_rcu(&old->rcu, cheeky_free_state_rcu);
+	cheeky_replace_playlist(data, NULL);
+
+	cheeky_kick(data);
+}
+
+/**
+ * @brief
+ *	Publishes a new state of a screen in place of its current one, which is
+ *	released once the scheduler cannot use it anymore.  The caller must
+ *	hold state_lock.
+ * @param data Our private structure.
+ * @param screen The screen.
+ * @param state The new state, the screen keeps it.
+ */
+static void		cheeky_publish_screen(data_t*	data,
+					      screen_t*	screen,
+					      state_t*	state)
+{
+	state_t*		old;
+
+	cheeky_refont_state(state);
+	if (!state->frames)
+		cheeky_build_frames(state);
+
+	old = rcu_dereference_protected(screen->state,
+					lockdep_is_held(&data->state_lock));
+	state->seq = ++(data->states);
+	rcu_assign_pointer(screen->state, state);
+	if (old)
+		call_rcu(&old->rcu, cheeky_free_state_rcu);
+
+	cheeky_kick(data);
+}
+
+/**
+ * @brief
+ *	Called once the scheduler cannot see a screen given up anymore.
+ * @param rcu The rcu head of the screen.
+ */
+static void		cheeky_free_screen_rcu(struct rcu_head*	rcu)
+{
+	screen_t*		screen = container_of(rcu, screen_t, rcu);
+
+	if (rcu_access_pointer(screen->state))
+		cheeky_free_state(rcu_dereference_protected(screen->state, 1));
+	kfree(screen);
+}
+
+/**
+ * @brief
+ *	Gives a file a new screen in place of its current one, the new screen
+ *	taking over the state of the old one.  The screens stay sorted by
+ *	priority, a new screen going before the ones of the same priority.
+ *	The caller must hold state_lock.
+ * @param data Our private structure.
+ * @param client The file.
+ * @param screen The new screen, NULL to give the screen up.
+ */
+static void		cheeky_replace_screen(data_t*		data,
+					      client_t*		client,
+					      screen_t*		screen)
+{
+	screen_t*		old = client->screen;
+	screen_t*		pos;
+
+	if (!old && !screen)
+		return;
+	if (old) {
+		list_del_rcu(&old->node);
+		if (screen) {
+			RCU_INIT_POINTER(screen->state,
+					 rcu_dereference_protected(old->state,
+					 lockdep_is_held(&data->state_lock)));
+			kfree_rcu(old, rcu);
+		}
+		else
+			call_rcu(&old->rcu, cheeky_free_screen_rcu);
+	}
+	if (screen) {
+		list_for_each_entry(pos, &data->screens, node)
+			if (pos->priority <= screen->priority)
+				break;
+		list_add_tail_rcu(&screen->node, &pos->node);
+	}
+	client->screen = screen;
+
+	cheeky_kick(data);
+}
+
+/**
+ * @brief
+ *	Renders a new text message.  This is done out of any lock, the scheduler
+ *	then only reads windows of the strip.
+ * @param buffer The text, allocated with kmalloc.  The driver keeps it.
+ * @param length The length of text, at least MIN_CHARS.
+ * @return The rendered text, NULL if we are out of memory.
+ */
+static text_t*		cheeky_new_text(char*	buffer,
+					size_t	length)
+{
+	text_t*		text;
+
+	text = kmalloc(sizeof(text_t), GFP_KERNEL);
+	if (!text) {
+		kfree(buffer);
+		return (NULL);
+	}
+	kref_init(&text->ref);
+	text->buffer = buffer;
+	text->length = length;
+	text->columns = length * GLYPH_WIDTH;
+	text->nb_fields = 0;
+	text->live = NULL;
+	text->strip = cheeky_render_strip(buffer, length, &text->strip_words,
+					  &text->font_seq);
+	if (!text->strip) {
+		kref_put(&text->ref, cheeky_free_text);
+		return (NULL);
+	}
+
+	return (text);
+}
+
+/**
+ * @brief
+ *	Gives a text with live fields the copy that the scheduler fills at
+ *	each frame.  It is allocated here, with the text, so that the
+ *	scheduler never allocates.
+ * @param text The text, which is not published yet.  It is released on
+ * failure.
+ * @return The text, NULL if we are out of memory.
+ */
+static text_t*		cheeky_new_live(text_t*	text)
+{
+	text_t*		live;
+
+	if (!text || !text->nb_fields)
+		return (text);
+
+	live = kmalloc(sizeof(text_t), GFP_KERNEL);
+	if (!live)
+		goto error;
+	*live = *text;
+	kref_init(&live->ref);
+	live->buffer = kmemdup(text->buffer, text->length, GFP_KERNEL);
+	live->strip = kmemdup(text->strip,
+			      NB_ROWS * text->strip_words * sizeof(__u32),
+			      GFP_KERNEL);
+	if (!live->buffer || !live->strip) {
+		kref_put(&live->ref, cheeky_free_text);
+		goto error;
+	}
+	text->live = live;
+
+	return (text);
+
+ error:
+	kref_put(&text->ref, cheeky_free_text);
+	return (NULL);
+}
+
+/**
+ * @brief
+ *	Renders a text again with the font in use.
+ * @param text The text.
+ * @return A new reference on the text if it already uses the font in use,
+ * otherwise a new text, NULL if we are out of memory.
+ */
+static text_t*		cheeky_refont_text(text_t*	text)
+{
+	text_t*		fresh;
+	char*			buffer;
+
+	if (text->font_seq == cheeky_font_seq()) {
+		kref_get(&text->ref);
+		return (text);
+	}
+
+	buffer = kmemdup(text->buffer, text->length, GFP_KERNEL);
+	if (!buffer)
+		return (NULL);
+	fresh = cheeky_new_text(buffer, text->length);
+	if (!fresh)
+		return (NULL);
+	memcpy(fresh->fields, text->fields, text->nb_fields * sizeof(field_t));
+	fresh->nb_fields = text->nb_fields;
+
+	return (cheeky_new_live(fresh));
+}
+
+/**
+ * @brief
+ *	Copies a layout with the texts of its regions rendered again with the
+ *	font in use.  The copy keeps the seq of the layout, so that the regions
+ *	go on scrolling.
+ * @param old The layout.
+ * @return The new layout, NULL if we are out of memory.
+ */
+static layout_t*	cheeky_refont_layout(const layout_t*	old)
+{
+	layout_t*		layout;
+	unsigned int		i;
+
+	layout = kmemdup(old, sizeof(layout_t), GFP_KERNEL);
+	if (!layout)
+		return (NULL);
+	kref_init(&layout->ref);
+	for (i = 0; i < layout->count; ++i)
+		layout->regions[i].text = NULL;
+
+	for (i = 0; i < layout->count; ++i) {
+		if (!old->regions[i].text)
+			continue;
+		layout->regions[i].text =
+			cheeky_refont_text(old->regions[i].text);
+		if (!layout->regions[i].text) {
+			kref_put(&layout->ref, cheeky_free_layout);
+			return (NULL);
+		}
+	}
+
+	return (layout);
+}
+
+/**
+ * @brief
+ *	Tells if a state shows a text rendered with another font than the one
+ *	in use.
+ * @param state The state.
+ * @return 1 if the state must be rendered again, 0 otherwise.
+ */
+static int		cheeky_font_stale(const state_t*	state)
+{
+	unsigned long		seq = cheeky_font_seq();
+	unsigned int		i;
+
+	if (state->text && state->text->font_seq != seq)
+		return (1);
+	for (i = 0; state->layout && i < state->layout->count; ++i)
+		if (state->layout->regions[i].text &&
+		    state->layout->regions[i].text->font_seq != seq)
+			return (1);
+
+	return (0);
+}
+
+/**
+ * @brief
+ *	Renders the text and the layout of a state which is not published yet
+ *	again with the font in use, if they were rendered with another one.
+ *	Its cycle of frames is then left to cheeky_build_frames.
+ * @param state The state.
+ * @return 0 on success, -ENOMEM if the state keeps the previous glyphs.
+ */
+static int		cheeky_refont_state(state_t*	state)
+{
+	layout_t*		layout = NULL;
+	text_t*		text = NULL;
+
+	if (!cheeky_font_stale(state))
+		return (0);
+
+	if (state->text) {
+		text = cheeky_refont_text(state->text);
+		if (!text)
+			return (-ENOMEM);
+	}
+	if (state->layout) {
+		layout = cheeky_refont_layout(state->layout);
+		if (!layout) {
+			if (text)
+				kref_put(&text->ref, cheeky_free_text);
+			return (-ENOMEM);
+		}
+	}
+
+	if (state->text)
+		kref_put(&state->text->ref, cheeky_free_text);
+	state->text = text;
+	if (state->layout)
+		kref_put(&state->layout->ref, cheeky_free_layout);
+	state->layout = layout;
+	kfree(state->frames);
+	state->frames = NULL;
+
+	return (0);
+}
+
+/**
+ * @brief
+ *	Reads the live field at the start of a template, if any: %T for the
+ *	time (HH:MM:SS), %R for the time without seconds (HH:MM), %n for the
+ *	counter n on COUNTER_WIDTH characters, or %wn for the counter n on w
+ *	characters, w being from 1 to 9.
+ * @param template The template.
+ * @param left The number of characters left in the template.
+ * @param field Where to store the field.
+ * @return The number of characters of the field in the template, 0 if the
+ * template does not start with a field.
+ */
+static size_t		cheeky_parse_field(const char*	template,
+					   size_t	left,
+					   field_t*	field)
+{
+	if (left < 2 || template[0] != '%')
+		return (0);
+
+	field->slot = 0;
+	switch (template[1]) {
+	case 'T':
+		field->kind = FIELD_TIME;
+		field->width = 8;
+		return (2);
+	case 'R':
+		field->kind = FIELD_CLOCK;
+		field->width = 5;
+		return (2);
+	}
+
+	field->kind = FIELD_COUNTER;
+	if (left >= 3						&&
+	    template[1] >= '1' && template[1] <= '9'		&&
+	    template[2] >= '0' &&
+	    template[2] < '0' + CHEEKY_NB_COUNTERS) {
+		field->width = template[1] - '0';
+		field->slot = template[2] - '0';
+		return (3);
+	}
+	if (template[1] >= '0' && template[1] < '0' + CHEEKY_NB_COUNTERS) {
+		field->width = COUNTER_WIDTH;
+		field->slot = template[1] - '0';
+		return (2);
+	}
+
+	return (0);
+}
+
+/**
+ * @brief
+ *	Expands a template: the live fields are written as whitespaces and
+ *	"%%" as a single '%'.  With no buffer, only the length of the text
+ *	expanded is computed.
+ * @param template The template.
+ * @param length The length of the template.
+ * @param buffer Where to store the text expanded, NULL to only compute its
+ * length.
+ * @param fields Where to store the live fields, MAX_FIELDS at most.
+ * @param nb_fields Where to store the number of live fields.
+ * @return The length of the text expanded, at most MAX_CHARS.
+ */
+static size_t		cheeky_expand_template(const char*	template,
+					       size_t		length,
+					       char*		buffer,
+					       field_t*		fields,
+					       unsigned int*	nb_fields)
+{
+	size_t		consumed;
+	size_t		out = 0;
+	size_t		i = 0;
+
+	*nb_fields = 0;
+	while (i < length && out < MAX_CHARS) {
+		if (i + 1 < length && template[i] == '%' &&
+		    template[i + 1] == '%') {
+			if (buffer)
+				buffer[out] = '%';
+			++out;
+			i += 2;
+			continue;
+		}
+		consumed = 0;
+		if (*nb_fields < MAX_FIELDS)
+			consumed = cheeky_parse_field(template + i, length - i,
+						      &fields[*nb_fields]);
+		if (!consumed || out + fields[*nb_fields].width > MAX_CHARS) {
+			if (buffer)
+				buffer[out] = template[i];
+			++out;
+			++i;
+			continue;
+		}
+		fields[*nb_fields].offset = out;
+		if (buffer)
+			memset(buffer + out, ' ', fields[*nb_fields].width);
+		out += fields[(*nb_fields)++].width;
+		i += consumed;
+	}
+
+	return (out);
+}
+
+/**
+ * @brief
+ *	Renders a new text message from a template.  Its live fields are
+ *	rendered as whitespaces, the scheduler fills them at each frame, and
+ *	"%%" is printed as a single '%'.  The text is sized from the length of
+ *	the template expanded.
+ * @param template The template, allocated with kmalloc.  The driver keeps
+ * it.
+ * @param length The length of the template, at least MIN_CHARS.
+ * @return The rendered text, NULL if we are out of memory.
+ */
+static text_t*		cheeky_new_template(char*	template,
+					    size_t	length)
+{
+	field_t		fields[MAX_FIELDS];
+	unsigned int		nb_fields;
+	size_t		out;
+	text_t*		text;
+	char*			buffer;
+
+	if (!memchr(template, '%', length))
+		return (cheeky_new_text(template, length));
+
+	/* "%%" may make the text shorter than the display */
+	out = cheeky_expand_template(template, length, NULL, fields,
+				     &nb_fields);
+	buffer = kmalloc(max_t(size_t, out, MIN_CHARS), GFP_KERNEL);
+	if (!buffer) {
+		kfree(template);
+		return (NULL);
+	}
+	cheeky_expand_template(template, length, buffer, fields, &nb_fields);
+	kfree(template);
+	if (out < MIN_CHARS) {
+		memset(buffer + out, ' ', MIN_CHARS - out);
+		out = MIN_CHARS;
+	}
+
+	text = cheeky_new_text(buffer, out);
+	if (!text)
+		return (NULL);
+	memcpy(text->fields, fields, nb_fields * sizeof(field_t));
+	text->nb_fields = nb_fields;
+
+	return (cheeky_new_live(text));
+}
+
+/**
+ * @brief
+ *	Copies a rendered text with count characters replaced from offset.  When
+ *	the text does not grow, only the glyph columns of the characters
+ *	replaced are rendered again, in a copy of the strip.
+ * @param old The text to patch.
+ * @param patch The new characters.
+ * @param offset The index of the first character replaced.  The characters
+ * between the end of the text and offset, if any, are whitespaces.
+ * @param count The number of characters replaced, at least 1.
+ * @return The patched text, NULL if we are out of memory.
+ */
+static text_t*		cheeky_patch_text(const text_t*	old,
+					  const char*		patch,
+					  size_t		offset,
+					  size_t		count)
+{
+	text_t*		text;
+	size_t		length;
+	char*			buffer;
+
+	length = max(old->length, offset + count);
+	buffer = kmalloc(length, GFP_KERNEL);
+	if (!buffer)
+		return (NULL);
+	memcpy(buffer, old->buffer, old->length);
+	memset(buffer + old->length, ' ', length - old->length);
+	memcpy(buffer + offset, patch, count);
+
+	/*
+	 * A longer text changes the size of the strip, and a text rendered
+	 * with another font would mix two fonts: render it all again
+	 */
+	if (length != old->length || old->font_seq != cheeky_font_seq()) {
+		text = cheeky_new_text(buffer, length);
+		if (text) {
+			memcpy(text->fields, old->fields,
+			       old->nb_fields * sizeof(field_t));
+			text->nb_fields = old->nb_fields;
+		}
+		return (cheeky_new_live(text));
+	}
+
+	text = kmalloc(sizeof(text_t), GFP_KERNEL);
+	if (!text) {
+		kfree(buffer);
+		return (NULL);
+	}
+	*text = *old;
+	kref_init(&text->ref);
+	text->buffer = buffer;
+	text->live = NULL;
+	text->strip = kmemdup(old->strip,
+			      NB_ROWS * old->strip_words * sizeof(__u32),
+			      GFP_KERNEL);
+	if (!text->strip) {
+		kref_put(&text->ref, cheeky_free_text);
+		return (NULL);
+	}
+
+	cheeky_render_chars(text, offset, patch, count);
+
+	return (cheeky_new_live(text));
+}
+
+/**
+ * @brief
+ *	Replaces the text of a state which is not published yet.  The caller
+ *	must hold state_lock.
+ * @param data Our private structure.
+ * @param state The new state of the display.
+ * @param text The new text, the state keeps the reference.
+ */
+static void		cheeky_replace_text(data_t*	data,
+					    state_t*	state,
+					    text_t*	text)
+{
+	if (state->text)
+		kref_put(&state->text->ref, cheeky_free_text);
+	state->text = text;
+	state->text_seq = ++(data->texts);
+	SET_CUSTOM(state->params, 0);
+	SET_GREY(state->params, 0);
+}
+
+/**
+ * @brief
+ *	Replaces the text printed on the display.
+ * @param data Our private structure.
+ * @param buffer The new text, allocated with kmalloc.  The driver keeps it.
+ * @param length The length of text, at least MIN_CHARS.
+ * @return 0 on success, a negative number on failure.
+ */
+static int		cheeky_set_text(data_t*	data,
+					char*		buffer,
+					size_t		length)
+{
+	state_t*		state;
+	text_t*		text;
+
+	text = cheeky_new_template(buffer, length);
+	if (!text)
+		return (-ENOMEM);
+
+	mutex_lock(&data->state_lock);
+	state = cheeky_dup_state(rcu_dereference_protected(data->state,
+				 lockdep_is_held(&data->state_lock)));
+	if (!state) {
+		mutex_unlock(&data->state_lock);
+		kref_put(&text->ref, cheeky_free_text);
+		return (-ENOMEM);
+	}
+	cheeky_replace_text(data, state, text);
+	cheeky_ticker_stop(data);
+	cheeky_publish_state(data, state);
+	mutex_unlock(&data->state_lock);
+
+	return (0);
+}
+
+/**
+ * @brief
+ *	Moves a frame deadline to the next frame period.  Periods already over,
+ *	when rendering or sending took too long, are skipped instead of making
+ *	the following frames late.
+ * @param deadline The deadline of the previous frame, updated.
+ * @param period The frame period, in nanoseconds.
+ * @return The number of frame periods elapsed, at least 1.
+ */
+static unsigned int	cheeky_next_deadline(ktime_t*	deadline,
+					     __u64	period)
+{
+	__u64			late;
+	ktime_t		now;
+
+	*deadline = ktime_add_ns(*deadline, period);
+
+	now = ktime_get();
+	if (!ktime_before(now, *deadline)) {
+		late = div_u64(ktime_to_ns(ktime_sub(now, *deadline)), period) + 1;
+		*deadline = ktime_add_ns(*deadline, late * period);
+		return (late + 1);
+	}
+
+	return (1);
+}
+
+/**
+ * @brief
+ *	Accumulates the rate of the effects over some frame periods, with 32
+ *	fractional bits, and returns the whole steps the effects must advance.
+ *	The effects of a smooth display advance by exactly one step per frame.
+ * @param data Our private structure.
+ * @param state The state of the display, as published.
+ * @param periods The number of frame periods elapsed.
+ * @return The number of steps of the effects.
+ */
+static unsigned int	cheeky_scroll_steps(data_t*		data,
+					    const state_t*	state,
+					    unsigned int	periods)
+{
+	__u64			step;
+	unsigned int		steps;
+
+	if (GET_SMOOTH(state->params) && state->rate &&
+	    !cheeky_has_layout(state)) {
+		data->step_fraction = 0;
+		return (periods);
+	}
+
+	step = div_u64((__u64) state->rate << 32,
+		       1000 * clamp_t(unsigned int, frame_rate, 1, 1000));
+	data->step_fraction += step * periods;
+	steps = data->step_fraction >> 32;
+	data->step_fraction &= 0xffffffff;
+
+	return (steps);
+}
+
+/**
+ * @brief
+ *	Moves a greyscale image to its next subframe.  The subframes whose
+ *	deadline is over are skipped, and counted as dropped.
+ * @param data Our private structure.
+ * @param state The state of the display, as published.
+ * @param periods The number of frame periods elapsed.
+ */
+static void		cheeky_next_subframe(data_t*		data,
+					     const state_t*	state,
+					     unsigned int	periods)
+{
+	if (!GET_GREY(state->params))
+		return;
+	data->subframe = (data->subframe + periods) % GREY_SUBFRAMES;
+	data->subframes_dropped += periods - 1;
+}
+
+/**
+ * @brief
+ *	Counts the whole passes of the scrolling text, and wakes up the files
+ *	polling for them.
+ * @param data Our private structure.
+ * @param wraps The number of passes the text just finished.
+ */
+static void		cheeky_wrapped(data_t*		data,
+				       unsigned int	wraps)
+{
+	unsigned long		flags;
+
+	spin_lock_irqsave(&data->event_lock, flags);
+	data->wraps += wraps;
+	spin_unlock_irqrestore(&data->event_lock, flags);
+
+	wake_up_interruptible_poll(&data->event_wait, EPOLLPRI);
+}
+
+/**
+ * @brief
+ *	This is a helper function used to update all parameters
+ *	at each loop turn. Sexyer than having this code in the loop...
+ *	It does not wait, so that the next frame can be rendered while the
+ *	current one is being sent.
+ * @param steps The number of steps the effects advance.
+ * @param vdecale The number of vertical LED to shift (if vmove is activated).
+ * @param flash A on/off switch.
+ * @param data Our private data.
+ * @param state The state of the display, as published.
+ */
+static void		cheeky_update_params(unsigned int	steps,
+					  __u8*		vdecale,
+					  __u8*		flash,
+					  data_t	*data,
+					  const state_t*	state)
+{
+	unsigned int		columns = state->text->columns;
+	unsigned int		wraps;
+	__s8			hmove;
+	__s8			vmove;
+
+	if (!steps)
+		return;
+
+	hmove = GET_HMOVE(state->params);
+	vmove = GET_VMOVE(state->params);
+
+	/*
+	 * Move the window of the strip by one LED column per step, the ticker
+	 * scrolls instead of the text when it is active
+	 */
+	if (!cheeky_ticker_advance(data, steps) && hmove) {
+		/* The text wraps each time it comes back to its first column */
+		if (hmove & LED_RIGHT_TO_LEFT) {
+			wraps = (data->position + steps) / columns;
+			data->position = (data->position + steps) % columns;
+		}
+		else {
+			wraps = (steps + (columns - data->position) % columns) /
+				columns;
+			data->position = (data->position + columns -
+					  steps % columns) % columns;
+		}
+		if (wraps) {
+			data->scene_wraps += wraps;
+			cheeky_wrapped(data, wraps);
+		}
+	}
+	if (vmove)
+		*vdecale = (*vdecale + steps) % VMOVE_STEPS;
+
+	/* Turn of the LED if we flash this turn */
+	if (GET_FLASH(state->params) && (steps & 1))
+		*flash = !(*flash);
+}
+
+/**
+ * @brief
+ *	Tells if a usb packet of next_packets has to be sent, that is if it
+ *	differs from the last one the device acknowledged or if the keepalive
+ *	interval has elapsed since it was sent.
+ * @param data Our private structure.
+ * @param i The index of the packet.
+ * @return 1 if the packet has to be sent, 0 otherwise.
+ */
+static int		cheeky_packet_dirty(data_t*	data,
+					    __u8	i)
+{
+	if (!test_bit(i, &data->sent_valid))
+		return (1);
+	if (keepalive &&
+	    !ktime_before(ktime_get(),
+			  ktime_add_ns(data->sent_time[i],
+				       (__u64) keepalive * NSEC_PER_MSEC)))
+		return (1);
+
+	return (memcmp(&data->next_packets[i],
+		       &data->sent_packets[i],
+		       sizeof(usb_packet_t)) != 0);
+}
+
+/**
+ * @brief
+ *	Called when the device received all the usb packets of a frame, or when
+ *	none of them had to be sent.  The frame is counted, and the files
+ *	waiting for it are woken up.
+ * @param data Our private structure.
+ */
+static void		cheeky_frame_done(data_t*	data)
+{
+	unsigned long		flags;
+	__u64			elapsed;
+
+	spin_lock_irqsave(&data->event_lock, flags);
+	++(data->frames_done);
+	data->frame_time = ktime_get();
+
+	/* The frame rate is measured over periods of at least one second */
+	elapsed = ktime_to_ns(ktime_sub(data->frame_time, data->rate_start));
+	if (elapsed >= NSEC_PER_SEC) {
+		data->achieved_rate = div64_u64((data->frames_done -
+						 data->rate_frames) *
+						NSEC_PER_SEC, elapsed);
+		data->rate_start = data->frame_time;
+		data->rate_frames = data->frames_done;
+	}
+	if (!data->frame_error)
+		data->shown_seq = data->submit_seq;
+	spin_unlock_irqrestore(&data->event_lock, flags);
+
+	wake_up_interruptible_poll(&data->event_wait, EPOLLPRI);
+}
+
+/**
+ * @brief
+ *	Called when the transfer of one usb packet is over.  The packet is
+ *	remembered as displayed if it succeeded, and the frame is done with
+ *	its last packet.
+ * @param urb The urb of the packet.
+ */
+static void		cheeky_packet_complete(struct urb*	urb)
+{
+	data_t*		data = urb->context;
+	__u8			i;
+
+	i = (usb_packet_t*) urb->transfer_buffer - data->display_packets;
+	if (urb->status) {
+		clear_bit(i, &data->sent_valid);
+		data->frame_error = 1;
+	}
+	else {
+		data->sent_packets[i] = data->display_packets[i];
+		data->sent_time[i] = ktime_get();
+		set_bit(i, &data->sent_valid);
+	}
+
+	if (atomic_dec_and_test(&data->in_flight))
+		cheeky_frame_done(data);
+}
+
+/**
+ * @brief
+ *	Copies the packets of next_packets which changed since the last frame
+ *	to the DMA buffers and submits their urbs, and counts the ones skipped.
+ *	The previous frame must be completed.
+ * @param data Our private structure.
+ */
+static void		cheeky_submit_packets(data_t*	data)
+{
+	int			ret;
+	__u8			i;
+
+	for (i = 0; i < NB_PACKETS; ++i) {
+		if (!cheeky_packet_dirty(data, i)) {
+			++(data->packets_skipped);
+			continue;
+		}
+		data->display_packets[i] = data->next_packets[i];
+		usb_anchor_urb(data->urbs[i], &data->submitted);
+		atomic_inc(&data->in_flight);
+		ret = usb_submit_urb(data->urbs[i], GFP_KERNEL);
+		if (ret) {
+			usb_unanchor_urb(data->urbs[i]);
+			atomic_dec(&data->in_flight);
+			clear_bit(i, &data->sent_valid);
+			continue;
+		}
+		++(data->packets_sent);
+	}
+}
+
+/**
+ * @brief
+ *	Tells if the display shows the same frame forever with the current text
+ *	and params, that is if no effect and no region is animated.
+ * @param state The state of the display, as published.
+ * @return 1 if the display is static, 0 otherwise.
+ */
+static int		cheeky_is_static(const state_t*	state)
+{
+	if (GET_GREY(state->params) || cheeky_layout_moves(state))
+		return (0);
+	if (!state->rate)
+		return (1);
+
+	return (!GET_FLASH(state->params) &&
+		state->frame_positions * state->frame_vsteps == 1);
+}
+
+/**
+ * @brief
+ *	Tells if the text of a state shows the time.
+ * @param state The state of the display, as published.
+ * @return 1 if the text has a time field, 0 otherwise.
+ */
+static int		cheeky_has_clock(const state_t*	state)
+{
+	unsigned int		i;
+
+	if (GET_CUSTOM(state->params))
+		return (0);
+	for (i = 0; i < state->text->nb_fields; ++i)
+		if (state->text->fields[i].kind != FIELD_COUNTER)
+			return (1);
+
+	return (0);
+}
+
+/**
+ * @brief
+ *	Tells if a display already shows its next frame, with nothing in
+ *	flight, and finds when its packets have to be sent again for the
+ *	keepalive.
+ * @param panel The display.
+ * @param until The time at which the first packet has to be sent again,
+ * lowered if a packet of the display is due earlier.
+ * @return 1 if the display is up to date, 0 otherwise.
+ */
+static int		cheeky_panel_idle(data_t*	panel,
+					  ktime_t*	until)
+{
+	ktime_t		keepalive_time;
+	__u8			i;
+
+	if (atomic_read(&panel->in_flight))
+		return (0);
+
+	for (i = 0; i < NB_PACKETS; ++i) {
+		if (!test_bit(i, &panel->sent_valid)	||
+		    memcmp(&panel->next_packets[i],
+			   &panel->sent_packets[i],
+			   sizeof(usb_packet_t)))
+			return (0);
+		if (!keepalive)
+			continue;
+		keepalive_time = ktime_add_ns(panel->sent_time[i],
+					      (__u64) keepalive * NSEC_PER_MSEC);
+		if (ktime_before(keepalive_time, *until))
+			*until = keepalive_time;
+	}
+
+	return (1);
+}
+
+/**
+ * @brief
+ *	Tells if the scheduler can stop servicing a device at each deadline:
+ *	the display is static, nothing is in flight, the device and the other
+ *	displays of its wall already show the next frame and nobody changed the
+ *	text or params meanwhile.
+ * @param data Our private structure.
+ * @param state The state of the display, as published.
+ * @param until Where to store the time at which the first packet has to
+ * be sent again for the keepalive, or a clock field changes, or the scene of
+ * the playlist ends, or the screen shown expires, KTIME_MAX if never.
+ * @return 1 if the device can go idle, 0 otherwise.
+ */
+static int		cheeky_can_idle(data_t*		data,
+					const state_t*	state,
+					ktime_t*		until)
+{
+	const wall_t*		wall = READ_ONCE(data->wall);
+	ktime_t		clock_time;
+	unsigned int		i;
+	__u32			rem;
+
+	if (atomic_xchg(&data->kicked, 0)	||
+	    cheeky_video_pending(data)		||
+	    cheeky_ticker_pending(data, state)	||
+	    !cheeky_is_static(state))
+		return (0);
+
+	*until = KTIME_MAX;
+	for (i = 0; i < cheeky_nb_panels(wall); ++i)
+		if (!cheeky_panel_idle(cheeky_panel(data, wall, i), until))
+			return (0);
+
+	/* A clock field has to be shown again at the next second */
+	if (cheeky_has_clock(state)) {
+		div_u64_rem(ktime_get_real_ns(), NSEC_PER_SEC, &rem);
+		clock_time = ktime_add_ns(ktime_get(), NSEC_PER_SEC - rem);
+		if (ktime_before(clock_time, *until))
+			*until = clock_time;
+	}
+
+	/* The next scene of the playlist has to be shown on time */
+	if (ktime_before(data->scene_end, *until))
+		*until = data->scene_end;
+
+	/* The display falls back to the next screen on time */
+	if (ktime_before(data->screen_end, *until))
+		*until = data->screen_end;
+
+	return (1);
+}
+
+/**
+ * @brief
+ *	Returns the last frame tick of the scheduler before a given time.  All
+ *	devices with the same frame period use the same frame grid, so that the
+ *	devices due at a tick are serviced by one timer interrupt and one pass
+ *	of the scheduler.
+ * @param now The time to align.
+ * @param period The frame period, in nanoseconds.
+ * @return The last tick before now.
+ */
+static ktime_t		cheeky_align_deadline(ktime_t	now,
+					      __u32	period)
+{
+	__u32			rem;
+
+	div_u64_rem(ktime_to_ns(now), period, &rem);
+
+	return (ktime_sub(now, ns_to_ktime(rem)));
+}
+
+/**
+ * @brief
+ *	Submits the frame rendered for a display.  A display whose previous
+ *	frame is still in flight drops this frame instead of making the
+ *	scheduler wait, and has its urbs unlinked if they are stuck for more
+ *	than 250ms.
+ * @param panel The display.
+ * @param now The time of this pass of the scheduler.
+ */
+static void		cheeky_submit_panel(data_t*	panel,
+					    ktime_t	now)
+{
+	if (atomic_read(&panel->in_flight)) {
+		++(panel->frames_dropped);
+		if (panel->next_grey)
+			++(panel->subframes_dropped);
+		if (ktime_after(now, ktime_add_ns(panel->submit_time,
+						  250 * NSEC_PER_MSEC)))
+			usb_unlink_anchored_urbs(&panel->submitted);
+		return;
+	}
+
+	/* The extra count keeps the frame from being done during submission */
+	panel->submit_seq = panel->next_seq;
+	panel->frame_error = 0;
+	atomic_inc(&panel->in_flight);
+	cheeky_submit_packets(panel);
+	if (atomic_dec_and_test(&panel->in_flight))
+		cheeky_frame_done(panel);
+	panel->submit_time = now;
+}
+
+/**
+ * @brief
+ *	Submits the frame rendered for a device at its deadline, and the frames
+ *	of the other displays of its wall, so that the whole wall changes at
+ *	the same tick.
+ * @param data Our private structure.
+ * @param now The time of this pass of the scheduler.
+ */
+static void		cheeky_submit_frame(data_t*	data,
+					    ktime_t	now)
+{
+	const state_t*	state;
+	const wall_t*		wall;
+	unsigned int		i;
+
+	++(data->wakeups);
+
+	/* The text or params may have changed while we were idle */
+	if (data->idle) {
+		data->idle = 0;
+		rcu_read_lock();
+		state = cheeky_scene_state(data, now);
+		cheeky_follow_state(data, state);
+		data->deadline = cheeky_align_deadline(now, data->period);
+		cheeky_current_frame(data, state, data->vdecale, data->flash);
+		rcu_read_unlock();
+	}
+
+	wall = READ_ONCE(data->wall);
+	for (i = 0; i < cheeky_nb_panels(wall); ++i)
+		cheeky_submit_panel(cheeky_panel(data, wall, i), now);
+}
+
+/**
+ * @brief
+ *	Advances the effects of a device, renders its next frame while the
+ *	current one is in flight, and queues the device again for its next
+ *	deadline, or for its keepalive if it can go idle.  It never takes a
+ *	lock shared with the writers, the state is read under RCU.
+ * @param data Our private structure.
+ */
+static void		cheeky_prepare_frame(data_t*	data)
+{
+	const state_t*	state;
+	ktime_t		idle_until;
+	unsigned int		periods;
+	int			idle;
+
+	rcu_read_lock();
+	periods = cheeky_next_deadline(&data->deadline, data->period);
+	state = cheeky_scene_state(data, data->deadline);
+	cheeky_follow_state(data, state);
+	cheeky_next_subframe(data, state, periods);
+	cheeky_update_params(cheeky_scroll_steps(data, state, periods),
+			  &data->vdecale,
+			  &data->flash,
+			  data,
+			  state);
+	cheeky_layout_advance(data, state, periods);
+	cheeky_current_frame(data, state, data->vdecale, data->flash);
+	idle = cheeky_can_idle(data, state, &idle_until);
+	rcu_read_unlock();
+
+	if (idle) {
+		/* Nothing moves, wait to be kicked or for the keepalive */
+		data->idle = 1;
+		if (ktime_before(idle_until, KTIME_MAX))
+			cheeky_schedule(data, idle_until);
+	}
+	else
+		cheeky_schedule(data, data->deadline);
+}
+
+/**
+ * @brief
+ *	The work of the scheduler.  It takes all the devices whose deadline is
+ *	over out of the queue, submits all their frames first and then renders
+ *	their next frames, so that the submissions of the devices due at the
+ *	same tick are batched.  It never waits for a device nor takes a lock
+ *	of the writers, and a state broadcast starts on the same pass for all
+ *	the devices.
+ * @param work The work of the scheduler.
+ */
+static void		cheeky_scheduler_work(struct work_struct*	work)
+{
+	struct timerqueue_node*	node;
+	unsigned long			flags;
+	data_t*			data;
+	data_t*			next;
+	ktime_t			now;
+	LIST_HEAD(batch);
+
+	now = ktime_get();
+	spin_lock_irqsave(&cheeky_scheduler.lock, flags);
+	while ((node = timerqueue_getnext(&cheeky_scheduler.queue)) &&
+	       !ktime_after(node->expires, now)) {
+		timerqueue_del(&cheeky_scheduler.queue, node);
+		data = container_of(node, data_t, sched_node);
+		data->sched_queued = 0;
+		list_add_tail(&data->sched_batch, &batch);
+	}
+	spin_unlock_irqrestore(&cheeky_scheduler.lock, flags);
+
+	/* The broadcasts started from now on are shown from this pass */
+	cheeky_scheduler.broadcast_gen =
+		smp_load_acquire(&cheeky_broadcast.gen);
+	list_for_each_entry(data, &batch, sched_batch)
+		cheeky_submit_frame(data, now);
+	list_for_each_entry_safe(data, next, &batch, sched_batch) {
+		list_del(&data->sched_batch);
+		cheeky_prepare_frame(data);
+	}
+
+	cheeky_scheduler_arm();
+}
+
+/**
+ * @brief
+ *	Called in interrupt context when the earliest deadline is over, it only
+ *	hands the work over to the workqueue of the scheduler.
+ * @param timer The timer of the scheduler.
+ * @return Always HRTIMER_NORESTART, the work programs the timer again.
+ */
+static enum hrtimer_restart	cheeky_scheduler_timer(struct hrtimer*	timer)
+{
+	queue_work(cheeky_scheduler.workqueue, &cheeky_scheduler.work);
+
+	return (HRTIMER_NORESTART);
+}
+
+/**
+ * @brief
+ *	Starts servicing a device which has just been plugged.
+ * @param data Our private structure.
+ */
+static void		cheeky_start(data_t*	data)
+{
+	unsigned long		flags;
+
+	spin_lock_irqsave(&cheeky_scheduler.lock, flags);
+	data->running = 1;
+	data->idle = 1;
+	spin_unlock_irqrestore(&cheeky_scheduler.lock, flags);
+
+	cheeky_kick(data);
+}
+
+/**
+ * @brief
+ *	Takes a device out of the queue of the scheduler, which does not queue
+ *	it again until it is started.
+ * @param data Our private structure.
+ */
+static void		cheeky_unqueue(data_t*	data)
+{
+	unsigned long		flags;
+
+	spin_lock_irqsave(&cheeky_scheduler.lock, flags);
+	data->running = 0;
+	if (data->sched_queued)
+		timerqueue_del(&cheeky_scheduler.queue, &data->sched_node);
+	data->sched_queued = 0;
+	spin_unlock_irqrestore(&cheeky_scheduler.lock, flags);
+}
+
+/**
+ * @brief
+ *	Stops servicing a device which is being unplugged.  When it returns the
+ *	scheduler does not use the device anymore and no urb is in flight.
+ * @param data Our private structure.
+ */
+static void		cheeky_stop(data_t*	data)
+{
+	cheeky_unqueue(data);
+	flush_work(&cheeky_scheduler.work);
+	usb_kill_anchored_urbs(&data->submitted);
+}
+
+/**
+ * @brief
+ *	Tells if a display is part of a wall.
+ * @param wall The wall, NULL if none.
+ * @param panel The display.
+ * @return 1 if the display is one of the displays of the wall, 0 otherwise.
+ */
+static int		cheeky_in_wall(const wall_t*	wall,
+				       const data_t*	panel)
+{
+	unsigned int		i;
+
+	for (i = 0; wall && i < wall->count; ++i)
+		if (wall->panels[i] == panel)
+			return (1);
+
+	return (0);
+}
+
+/**
+ * @brief
+ *	Sets the wall a device is the first display of, in place of its current
+ *	one.  The other displays of the wall leave the scheduler, which
+ *	services them with the device, and the displays which are not part of
+ *	the wall anymore go back to their own state.  The caller must hold
+ *	cheeky_wall_lock.
+ * @param data Our private structure.
+ * @param wall The new wall, the driver keeps it, or NULL to split the wall.
+ */
+static void		cheeky_replace_wall(data_t*	data,
+					    wall_t*	wall)
+{
+	wall_t*		old = data->wall;
+	data_t*		panel;
+	unsigned int		i;
+
+	for (i = 1; wall && i < wall->count; ++i) {
+		WRITE_ONCE(wall->panels[i]->wall_leader, data);
+		cheeky_unqueue(wall->panels[i]);
+		/* The writes waiting for their text on the panel give up */
+		wake_up_interruptible(&wall->panels[i]->event_wait);
+	}
+	WRITE_ONCE(data->wall, wall);
+
+	/* Once the scheduler is done with the old wall, nobody can see it */
+	flush_work(&cheeky_scheduler.work);
+	for (i = 1; old && i < old->count; ++i) {
+		panel = old->panels[i];
+		if (!cheeky_in_wall(wall, panel)) {
+			panel->wall_leader = NULL;
+			if (!panel->disconnected)
+				cheeky_start(panel);
+		}
+		kref_put(&panel->ref, cheeky_delete);
+	}
+	kfree(old);
+
+	cheeky_kick(data);
+}
+
+/**
+ * @brief
+ *	Splits the wall a device is part of, when it is unplugged.
+ * @param data Our private structure.
+ */
+static void		cheeky_leave_wall(data_t*	data)
+{
+	mutex_lock(&cheeky_wall_lock);
+	if (data->wall_leader)
+		cheeky_replace_wall(data->wall_leader, NULL);
+	else if (data->wall)
+		cheeky_replace_wall(data, NULL);
+	mutex_unlock(&cheeky_wall_lock);
+}
+
+/**
+ * @brief
+ *	(Not implemented yet). This function will read the text (if any) that
+ *	is displayed on the led display, and copy it to buf.
+ * @param file Used to retreive our priavte data.
+ * @param buf Buffer where we would copy the text printed on the cheeky display.
+ * @param count The maximum size of buf.
+ * @param pos An offset to copy to from the buf address.
+ * @return The number of character red.
+ */
+static ssize_t		cheeky_read(struct file*	file,
+				 char __user*	buf,
+				 size_t		count,
+				 loff_t*	pos)
+{
+	return (0);
+}
+
+/**
+ * @brief
+ *	Copies a text from user space, truncated to MAX_CHARS and padded with
+ *	whitespaces to MIN_CHARS.
+ * @param buf The text in user space.
+ * @param count The length of buf.
+ * @param text Where to store the copy, allocated with kmalloc.
+ * @param length Where to store the length of the copy.
+ * @return 0 on success, a negative number on failure.
+ */
+static int		cheeky_copy_text(const char __user*	buf,
+					 size_t		count,
+					 char**		text,
+					 size_t*		length)
+{
+	size_t		real;
+
+	real = min((size_t) MAX_CHARS, count);
+	*length = max((size_t) MIN_CHARS, real);
+	*text = kmalloc(*length, GFP_KERNEL);
+	if (!*text)
+		return (-ENOMEM);
+	if (copy_from_user(*text, buf, real)) {
+		printk(KERN_WARNING "cheeky_display: Cannot copy from user.\n");
+		kfree(*text);
+		return (-EFAULT);
+	}
+	/* If the buffer is lower than 7 bytes, we fill it with whitespaces */
+	memset(*text + real, ' ', *length - real);
+
+	return (0);
+}
+
+/**
+ * @brief
+ *	Turns a text written into a request setting it, for the writers which
+ *	replace the whole text.
+ * @param buf The text in user space.
+ * @param count The length of buf, truncated to MAX_CHARS.
+ * @param request Where to store the request.
+ */
+static void		cheeky_text_request(const char __user*	buf,
+					    size_t		count,
+					    cheeky_state_t*	request)
+{
+	memset(request, 0, sizeof(cheeky_state_t));
+	request->version = CHEEKY_STATE_VERSION;
+	request->mask = STATE_TEXT;
+	request->text = (__u64) (unsigned long) buf;
+	request->length = min((size_t) MAX_CHARS, count);
+}
+
+/**
+ * @brief
+ *	Appends a text to the ring of the ticker, and starts the ticker if it
+ *	was not active.  When the ring is full, it waits for the scroll to
+ *	free some space, unless the file is non blocking.
+ * @param data Our private structure.
+ * @param file The file written, opened with O_APPEND.
+ * @param buf The text in user space.
+ * @param count The length of buf.
+ * @return The number of characters appended, a negative number on failure.
+ */
+static ssize_t		cheeky_append(data_t*		data,
+				      struct file*		file,
+				      const char __user*	buf,
+				      size_t			count)
+{
+	unsigned int		wanted;
+	unsigned int		avail;
+	char*			text;
+	ssize_t		ret;
+
+	if (!count)
+		return (0);
+
+	/* Wait for some room, rather than appending a character at a time */
+	wanted = min_t(size_t, count, TICKER_WAKE);
+	while ((avail = cheeky_ticker_avail(data)) < wanted) {
+		if (file->f_flags & O_NONBLOCK) {
+			if (avail)
+				break;
+			return (-EAGAIN);
+		}
+		if (wait_event_interruptible(data->ticker_wait,
+					     cheeky_ticker_avail(data) >= wanted ||
+					     data->disconnected))
+			return (-ERESTARTSYS);
+		if (data->disconnected)
+			return (-ENODEV);
+	}
+
+	count = min_t(size_t, count, avail);
+	text = memdup_user(buf, count);
+	if (IS_ERR(text))
+		return (PTR_ERR(text));
+
+	spin_lock(&data->ticker_lock);
+	if (!data->ticker_active) {
+		/* The ticker comes in from the right of a blank display */
+		data->ticker_active = 1;
+		data->ticker_offset = 0;
+		memset(data->ticker_window, ' ', TICKER_WINDOW);
+	}
+	ret = kfifo_in(&data->ticker, text, count);
+	spin_unlock(&data->ticker_lock);
+
+	kfree(text);
+	cheeky_kick(data);
+
+	return (ret);
+}
+
+/**
+ * @brief
+ *	Replaces some characters of the text in place.  The scroll goes on from
+ *	where it is, and the frames of the cycle which do not show the
+ *	characters replaced are kept.
+ * @param data Our private structure.
+ * @param buf The new characters in user space.
+ * @param count The length of buf.
+ * @param offset The index of the first character to replace.
+ * @return The number of characters replaced, a negative number on failure.
+ */
+static ssize_t		cheeky_patch(data_t*		data,
+				     const char __user*	buf,
+				     size_t		count,
+				     loff_t		offset)
+{
+	const state_t*	old;
+	state_t*		state;
+	text_t*		text = NULL;
+	char*			patch;
+
+	if (offset >= MAX_CHARS)
+		return (-ENOSPC);
+	count = min_t(size_t, count, MAX_CHARS - offset);
+	if (!count)
+		return (0);
+
+	patch = memdup_user(buf, count);
+	if (IS_ERR(patch))
+		return (PTR_ERR(patch));
+
+	mutex_lock(&data->state_lock);
+	old = rcu_dereference_protected(data->state,
+					lockdep_is_held(&data->state_lock));
+	state = cheeky_dup_state(old);
+	if (state)
+		text = cheeky_patch_text(old->text, patch, offset, count);
+	kfree(patch);
+	if (!text) {
+		mutex_unlock(&data->state_lock);
+		if (state)
+			cheeky_free_state(state);
+		return (-ENOMEM);
+	}
+
+	/* The text_seq is kept, so that the scroll does not start again */
+	kref_put(&state->text->ref, cheeky_free_text);
+	state->text = text;
+	SET_CUSTOM(state->params, 0);
+	SET_GREY(state->params, 0);
+	cheeky_patch_frames(state, old, offset * GLYPH_WIDTH,
+			    count * GLYPH_WIDTH);
+	cheeky_ticker_stop(data);
+	cheeky_publish_state(data, state);
+	mutex_unlock(&data->state_lock);
+
+	return (count);
+}
+
+/**
+ * @brief
+ *	Tells if the device received a frame of a state, or of a later one.
+ * @param data Our private structure.
+ * @param seq The seq of the state.
+ * @return 1 if the state was shown, 0 otherwise.
+ */
+static int		cheeky_shown(data_t*		data,
+				     unsigned long	seq)
+{
+	unsigned long		flags;
+	int			shown;
+
+	spin_lock_irqsave(&data->event_lock, flags);
+	shown = (long) (data->shown_seq - seq) >= 0;
+	spin_unlock_irqrestore(&data->event_lock, flags);
+
+	return (shown);
+}
+
+/**
+ * @brief
+ *	Tells if a write on a file opened with O_SYNC is done waiting: the
+ *	device received a frame of the state written, or this state was
+ *	replaced by a later one, or it cannot be shown because the display is
+ *	a panel of a wall led by another display or because a screen of a
+ *	higher priority is shown.
+ * @param client The file written.
+ * @param seq The seq of the state written.
+ * @return 1 if the write is done waiting, 0 otherwise.
+ */
+static int		cheeky_synced(client_t*		client,
+				      unsigned long	seq)
+{
+	data_t*		data = client->data;
+	const screen_t*	screen;
+	const screen_t*	own;
+	const state_t*	state;
+	ktime_t		now = ktime_get();
+	int			done = 0;
+
+	if (cheeky_shown(data, seq)	||
+	    data->disconnected		||
+	    READ_ONCE(data->wall_leader))
+		return (1);
+
+	rcu_read_lock();
+	own = READ_ONCE(client->screen);
+	state = own ? rcu_dereference(own->state) : NULL;
+	if (!state) {
+		own = NULL;
+		state = rcu_dereference(data->state);
+	}
+	if (state->seq != seq)
+		done = 1;
+
+	/* The screens are sorted from the highest priority */
+	list_for_each_entry_rcu(screen, &data->screens, node) {
+		if (done || screen == own)
+			break;
+		if (rcu_access_pointer(screen->state) &&
+		    ktime_before(now, screen->expires))
+			done = 1;
+	}
+	rcu_read_unlock();
+
+	return (done);
+}
+
+/**
+ * @brief
+ *	Waits until the device received a whole frame of the state published,
+ *	or of the one of the screen of the file, for the writes on a file opened
+ *	with O_SYNC.  It returns at once if this state cannot be shown, and as
+ *	soon as it is replaced by a later one.
+ * @param client The file written.
+ * @return 0 on success, a negative number on failure.
+ */
+static int		cheeky_sync(client_t*	client)
+{
+	data_t*		data = client->data;
+	const state_t*	state;
+	unsigned long		seq;
+
+	mutex_lock(&data->state_lock);
+	state = rcu_dereference_protected(data->state,
+					  lockdep_is_held(&data->state_lock));
+	if (client->screen && rcu_access_pointer(client->screen->state))
+		state = rcu_dereference_protected(client->screen->state,
+					lockdep_is_held(&data->state_lock));
+	seq = state->seq;
+	mutex_unlock(&data->state_lock);
+
+	if (wait_event_interruptible(data->event_wait,
+				     cheeky_synced(client, seq)))
+		return (-ERESTARTSYS);
+
+	return (data->disconnected ? -ENODEV : 0);
+}
+
+/**
+ * @brief
+ *	Moves the offset of a file in the text, and puts the file in the mode
+ *	where each write patches the text at its offset.
+ * @param file The file.
+ * @param offset The offset, as for lseek().
+ * @param whence The origin of the offset, as for lseek().
+ * @return The new offset, a negative number on failure.
+ */
+static loff_t		cheeky_llseek(struct file*	file,
+				      loff_t		offset,
+				      int		whence)
+{
+	client_t*		client = file->private_data;
+	loff_t		ret;
+
+	ret = default_llseek(file, offset, whence);
+	if (ret >= 0)
+		WRITE_ONCE(client->positioned, 1);
+
+	return (ret);
+}
+
+/**
+ * @brief
+ *	Changes the text to be displayed ont the led display by the ascii
+ *	string in buf (not all ascii characters are supported yet).  On a file
+ *	opened with O_APPEND, the text is appended to the ticker instead.  On a
+ *	file positioned with lseek(), or for a pwrite() at an offset above 0, the
+ *	write replaces the characters of the text from its offset, even 0,
+ *	keeping the others and the scroll.  On a file with a screen, each write
+ *	replaces the text of the screen.  On a file opened with O_SYNC, it
+ *	returns once the device shows the new text.
+ * @param file Used to retreive our private data.
+ * @param buf A pointer to the text that will be printed on the led display.
+ * @param count The number of character to be displayed on the led display. If
+ * this number is greater than MAX_CHARS, the text will be truncated.
+ * @param ppos The offset of the write in the text.  It is not moved by a
+ * write replacing the whole text, so that each write() on a file never
+ * positioned replaces the text.
+ * @return The number of character written.
+ */
+static ssize_t		cheeky_write(struct file*		file,
+				  const char __user*	buf,
+				  size_t	count,
+				  loff_t*	ppos)
+{
+	client_t*		client = file->private_data;
+	data_t*		data = client->data;
+	cheeky_state_t	request;
+	ssize_t		written;
+	size_t		length;
+	char*			text;
+	int			ret;
+
+	if (data->disconnected)
+		return (-ENODEV);
+
+	if (READ_ONCE(client->screen)) {
+		cheeky_text_request(buf, count, &request);
+		ret = cheeky_set_state(client, &request);
+		if (ret)
+			return (ret);
+		written = request.length;
+	}
+	else if (file->f_flags & O_APPEND)
+		return (cheeky_append(data, file, buf, count));
+	else if (*ppos > 0 || READ_ONCE(client->positioned)) {
+		written = cheeky_patch(data, buf, count, *ppos);
+		if (written <= 0)
+			return (written);
+		*ppos += written;
+	}
+	else {
+		/* Copying buffer from user */
+		ret = cheeky_copy_text(buf, count, &text, &length);
+		if (ret)
+			return (ret);
+
+		ret = cheeky_set_text(data, text, length);
+		if (ret)
+			return (ret);
+		written = min((size_t) MAX_CHARS, count);
+	}
+
+	/* O_SYNC includes O_DSYNC */
+	if (file->f_flags & O_DSYNC) {
+		ret = cheeky_sync(client);
+		if (ret)
+			return (ret);
+	}
+
+	return (written);
+}
+
+/**
+ * @brief
+ *	Applies the effects selected by the mask of a request to a state which
+ *	is not published yet.
+ * @param state The new state of the display.
+ * @param request The fields to apply.
+ */
+static void		cheeky_apply_state(state_t*			state,
+					   const cheeky_state_t*	request)
+{
+	if (request->mask & STATE_BRIGHNESS)
+		SET_BRIGHNESS(state->params, request->brighness);
+	if (request->mask & STATE_SPEED) {
+		SET_SPEED(state->params, request->speed);
+		state->rate = SPEED_TO_RATE(GET_SPEED(state->params));
+	}
+	if (request->mask & STATE_RATE)
+		state->rate = min_t(__u32, request->rate, MAX_RATE);
+	if (request->mask & STATE_HMOVE)
+		SET_HMOVE(state->params, request->hmove);
+	if (request->mask & STATE_VMOVE)
+		SET_VMOVE(state->params, request->vmove);
+	if (request->mask & STATE_FLASH)
+		SET_FLASH(state->params, request->flash);
+	if (request->mask & STATE_NEGATIVE)
+		SET_NEGATIVE(state->params, request->negative);
+	if (request->mask & STATE_SMOOTH)
+		SET_SMOOTH(state->params, request->smooth);
+}
+
+/**
+ * @brief
+ *	Checks the version and the mask of a request.  The first version of
+ *	cheeky_state_t has no smooth field.
+ * @param request The request, zeroed past the end of its version.
+ * @return 0 if the request is valid, -EINVAL otherwise.
+ */
+static int		cheeky_check_state(const cheeky_state_t*	request)
+{
+	__u32			all = STATE_ALL;
+
+	if (request->version == 1)
+		all &= ~STATE_SMOOTH;
+	if (!request->version				||
+	    request->version > CHEEKY_STATE_VERSION	||
+	    request->mask & ~all			||
+	    request->reserved)
+		return (-EINVAL);
+
+	return (0);
+}
+
+/**
+ * @brief
+ *	Checks a request and renders its text, if any.  This is done before
+ *	taking any lock.
+ * @param request The request.
+ * @param text Where to store the rendered text, NULL if the request does
+ * not change the text.
+ * @return 0 on success, a negative number on failure.
+ */
+static int		cheeky_request_text(const cheeky_state_t*	request,
+					    text_t**			text)
+{
+	size_t		length;
+	char*			buffer;
+	int			ret;
+
+	*text = NULL;
+	ret = cheeky_check_state(request);
+	if (ret || !(request->mask & STATE_TEXT))
+		return (ret);
+
+	ret = cheeky_copy_text(u64_to_user_ptr(request->text),
+			       request->length,
+			       &buffer,
+			       &length);
+	if (ret)
+		return (ret);
+	*text = cheeky_new_template(buffer, length);
+
+	return (*text ? 0 : -ENOMEM);
+}
+
+/**
+ * @brief
+ *	Returns the state a file changes: the one of its screen if it has one
+ *	and set it, otherwise the one of the display.  The caller must hold
+ *	state_lock.
+ * @param client The file.
+ * @return The state to copy.
+ */
+static const state_t*	cheeky_client_state(client_t*	client)
+{
+	data_t*		data = client->data;
+
+	if (client->screen && rcu_access_pointer(client->screen->state))
+		return (rcu_dereference_protected(client->screen->state,
+					lockdep_is_held(&data->state_lock)));
+
+	return (rcu_dereference_protected(data->state,
+					  lockdep_is_held(&data->state_lock)));
+}
+
+/**
+ * @brief
+ *	Publishes a new state on the screen of a file if it has one, otherwise
+ *	on the display.  The caller must hold state_lock.
+ * @param client The file.
+ * @param state The new state, the driver keeps it.
+ */
+static void		cheeky_client_publish(client_t*	client,
+					      state_t*	state)
+{
+	if (client->screen)
+		cheeky_publish_screen(client->data, client->screen, state);
+	else
+		cheeky_publish_state(client->data, state);
+}
+
+/**
+ * @brief
+ *	Changes the text and any effect of the display, or of the screen of
+ *	the file if it has one, at once.  Everything is published in a single
+ *	new state, so the scheduler goes from one frame to the next without
+ *	showing a half applied request.  The first state of a screen is
+ *	applied over the one of the display.
+ * @param client The file.
+ * @param request The fields to apply, and their mask.
+ * @return 0 on success, a negative number on failure.
+ */
+static int		cheeky_set_state(client_t*			client,
+					 const cheeky_state_t*	request)
+{
+	data_t*		data = client->data;
+	text_t*		text;
+	state_t*		state;
+	int			ret;
+
+	ret = cheeky_request_text(request, &text);
+	if (ret)
+		return (ret);
+
+	mutex_lock(&data->state_lock);
+	state = cheeky_dup_state(cheeky_client_state(client));
+	if (!state) {
+		mutex_unlock(&data->state_lock);
+		if (text)
+			kref_put(&text->ref, cheeky_free_text);
+		return (-ENOMEM);
+	}
+	if (text) {
+		cheeky_replace_text(data, state, text);
+		if (!client->screen)
+			cheeky_ticker_stop(data);
+	}
+	cheeky_apply_state(state, request);
+	cheeky_client_publish(client, state);
+	mutex_unlock(&data->state_lock);
+
+	return (0);
+}
+
+/**
+ * @brief
+ *	Gives the file a screen of its own, or gives it up.  The screen shows
+ *	the text of the display until the file sets its own.
+ * @param client The file.
+ * @param arg The cheeky_screen_t, in user space.
+ * @return 0 on success, a negative number on failure.
+ */
+static int		cheeky_set_screen(client_t*		client,
+					  const void __user*	arg)
+{
+	data_t*		data = client->data;
+	cheeky_screen_t	request;
+	screen_t*		screen = NULL;
+
+	if (copy_from_user(&request, arg, sizeof(cheeky_screen_t)))
+		return (-EFAULT);
+
+	if (request.priority) {
+		screen = kzalloc(sizeof(screen_t), GFP_KERNEL);
+		if (!screen)
+			return (-ENOMEM);
+		screen->priority = request.priority;
+		screen->expires = request.ttl ?
+			ktime_add_ms(ktime_get(), request.ttl) : KTIME_MAX;
+	}
+
+	mutex_lock(&data->state_lock);
+	cheeky_replace_screen(data, client, screen);
+	mutex_unlock(&data->state_lock);
+
+	return (0);
+}
+
+/**
+ * @brief
+ *	Checks that a region fits in the display.
+ * @param region The region.
+ * @return 0 if the region is valid, -EINVAL otherwise.
+ */
+static int		cheeky_check_region(const cheeky_region_t*	region)
+{
+	if (!region->width || region->x + region->width > NB_COLUMNS	||
+	    !region->height || region->y + region->height > NB_ROWS	||
+	    region->op > REGION_XOR					||
+	    region->hmove > LED_LEFT_TO_RIGHT				||
+	    region->reserved)
+		return (-EINVAL);
+
+	return (0);
+}
+
+/**
+ * @brief
+ *	Splits the display, or the screen of the file, into regions composed
+ *	at each frame.  The texts of the regions are rendered before taking
+ *	the lock.
+ * @param client The file.
+ * @param arg The cheeky_layout_t, in user space.
+ * @return 0 on success, a negative number on failure.
+ */
+static int		cheeky_set_layout(client_t*		client,
+					  const void __user*	arg)
+{
+	cheeky_region_t	regions[CHEEKY_MAX_REGIONS];
+	data_t*		data = client->data;
+	layout_t*		layout = NULL;
+	cheeky_layout_t	request;
+	region_t*		region;
+	state_t*		state;
+	size_t		length;
+	char*			buffer;
+	unsigned int		i;
+	int			ret;
+
+	if (copy_from_user(&request, arg, sizeof(cheeky_layout_t)))
+		return (-EFAULT);
+	if (request.count > CHEEKY_MAX_REGIONS || request.reserved)
+		return (-EINVAL);
+	if (copy_from_user(regions, u64_to_user_ptr(request.regions),
+			   request.count * sizeof(cheeky_region_t)))
+		return (-EFAULT);
+	for (i = 0; i < request.count; ++i)
+		if (cheeky_check_region(&regions[i]))
+			return (-EINVAL);
+
+	if (request.count) {
+		layout = kzalloc(sizeof(layout_t), GFP_KERNEL);
+		if (!layout)
+			return (-ENOMEM);
+		kref_init(&layout->ref);
+	}
+	for (i = 0; i < request.count; ++i) {
+		region = &layout->regions[layout->count++];
+		region->x = regions[i].x;
+		region->y = regions[i].y;
+		region->width = regions[i].width;
+		region->height = regions[i].height;
+		region->hmove = regions[i].hmove;
+		region->op = regions[i].op;
+		region->rate = min_t(__u32, regions[i].rate, MAX_RATE);
+		if (!regions[i].length)
+			continue;
+		ret = cheeky_copy_text(u64_to_user_ptr(regions[i].text),
+				       regions[i].length,
+				       &buffer,
+				       &length);
+		if (!ret) {
+			region->text = cheeky_new_text(buffer, length);
+			ret = region->text ? 0 : -ENOMEM;
+		}
+		if (ret) {
+			kref_put(&layout->ref, cheeky_free_layout);
+			return (ret);
+		}
+	}
+
+	mutex_lock(&data->state_lock);
+	state = cheeky_dup_state(cheeky_client_state(client));
+	if (!state) {
+		mutex_unlock(&data->state_lock);
+		if (layout)
+			kref_put(&layout->ref, cheeky_free_layout);
+		return (-ENOMEM);
+	}
+	if (state->layout)
+		kref_put(&state->layout->ref, cheeky_free_layout);
+	state->layout = layout;
+	if (layout)
+		layout->seq = ++(data->layouts);
+	cheeky_client_publish(client, state);
+	mutex_unlock(&data->state_lock);
+
+	return (0);
+}
+
+/**
+ * @brief
+ *	Shows the usb packets given by the user instead of the text of the
+ *	display, or of the screen of the file if it has one.
+ * @param client The file.
+ * @param packets The NB_PACKETS usb packets, in user space.
+ * @return 0 on success, a negative number on failure.
+ */
+static int		cheeky_set_custom(client_t*		client,
+					  const void __user*	packets)
+{
+	usb_packet_t		custom[NB_PACKETS];
+	data_t*		data = client->data;
+	state_t*		state;
+
+	/* Copy the user packets before taking the lock of the state */
+	if (copy_from_user(custom, packets,
+			   sizeof(usb_packet_t) * NB_PACKETS))
+		return (-EFAULT);
+
+	mutex_lock(&data->state_lock);
+	state = cheeky_dup_state(cheeky_client_state(client));
+	if (!state) {
+		mutex_unlock(&data->state_lock);
+		return (-ENOMEM);
+	}
+	SET_CUSTOM(state->params, 1);
+	SET_GREY(state->params, 0);
+	memcpy(state->custom_packets, custom,
+	       sizeof(usb_packet_t) * NB_PACKETS);
+	if (!client->screen)
+		cheeky_ticker_stop(data);
+	cheeky_client_publish(client, state);
+	mutex_unlock(&data->state_lock);
+
+	return (0);
+}
+
+/**
+ * @brief
+ *	Checks that a device can be the first display of a new wall: it is not
+ *	part of another wall, and each other display is plugged, appears once,
+ *	and is not part of another wall.  The caller must hold
+ *	cheeky_wall_lock.
+ * @param data Our private structure.
+ * @param wall The new wall, NULL to split the wall.
+ * @return 0 if the wall can be set, a negative number otherwise.
+ */
+static int		cheeky_check_wall(const data_t*	data,
+					  const wall_t*	wall)
+{
+	const data_t*		panel;
+	unsigned int		i;
+	unsigned int		j;
+
+	if (data->wall_leader)
+		return (-EBUSY);
+
+	for (i = 1; wall && i < wall->count; ++i) {
+		panel = wall->panels[i];
+		if (panel->disconnected)
+			return (-ENODEV);
+		for (j = 0; j < i; ++j)
+			if (wall->panels[j] == panel)
+				return (-EINVAL);
+		if (panel->wall ||
+		    (panel->wall_leader && panel->wall_leader != data))
+			return (-EBUSY);
+	}
+
+	return (0);
+}
+
+/**
+ * @brief
+ *	Groups a device and the displays placed on its right into a wall, or
+ *	splits its wall.  The displays of a wall show the text of the device,
+ *	each one the 21 columns following the ones of the display on its left,
+ *	and are all serviced at the deadlines of the device.
+ * @param data Our private structure.
+ * @param arg The cheeky_wall_t in user space.
+ * @return 0 on success, a negative number on failure.
+ */
+static int		cheeky_set_wall(data_t*			data,
+					const cheeky_wall_t __user*	arg)
+{
+	cheeky_wall_t		request;
+	wall_t*		wall = NULL;
+	struct file*		file;
+	data_t*		panel;
+	unsigned int		i;
+	int			ret = 0;
+
+	if (copy_from_user(&request, arg, sizeof(cheeky_wall_t)))
+		return (-EFAULT);
+	if (request.count >= CHEEKY_MAX_PANELS)
+		return (-EINVAL);
+
+	/* The wall holds a reference on each display, taken from its file */
+	if (request.count) {
+		wall = kzalloc(struct_size(wall, panels, request.count + 1),
+			       GFP_KERNEL);
+		if (!wall)
+			return (-ENOMEM);
+		wall->panels[wall->count++] = data;
+		for (i = 0; i < request.count; ++i) {
+			file = fget(request.panels[i]);
+			if (!file) {
+				ret = -EBADF;
+				goto error;
+			}
+			if (file->f_op != &cheeky_fops) {
+				fput(file);
+				ret = -EINVAL;
+				goto error;
+			}
+			panel = ((client_t*) file->private_data)->data;
+			kref_get(&panel->ref);
+			fput(file);
+			wall->panels[wall->count++] = panel;
+		}
+	}
+
+	mutex_lock(&cheeky_wall_lock);
+	ret = cheeky_check_wall(data, wall);
+	if (!ret)
+		cheeky_replace_wall(data, wall);
+	mutex_unlock(&cheeky_wall_lock);
+	if (!ret)
+		return (0);
+
+error:
+	for (i = 1; wall && i < wall->count; ++i)
+		kref_put(&wall->panels[i]->ref, cheeky_delete);
+	kfree(wall);
+	return (ret);
+}
+
+/**
+ * @brief
+ *	Shows a greyscale image given by the user instead of the text of the
+ *	display, or of the screen of the file if it has one.  The image is
+ *	dithered over GREY_SUBFRAMES subframes, all rendered here, and the
+ *	scheduler cycles through them at grey_rate subframes per second.
+ * @param client The file.
+ * @param image The GREY_SIZE bytes of the image, in user space.
+ * @return 0 on success, a negative number on failure.
+ */
+static int		cheeky_set_grey(client_t*		client,
+					const void __user*	image)
+{
+	__u8			levels[NB_ROWS][NB_COLUMNS];
+	__u8			pixels[GREY_SIZE];
+	data_t*		data = client->data;
+	state_t*		state;
+	__u8			column;
+	__u8			row;
+	__u8			byte;
+
+	/* Copy and unpack the image before taking the lock of the state */
+	if (copy_from_user(pixels, image, GREY_SIZE))
+		return (-EFAULT);
+	for (row = 0; row < NB_ROWS; ++row)
+		for (column = 0; column < NB_COLUMNS; ++column) {
+			byte = pixels[row * GREY_LINE_LENGTH + column / 2];
+			levels[row][column] = column & 1 ? byte & 0xf :
+				byte >> 4;
+		}
+
+	mutex_lock(&data->state_lock);
+	state = cheeky_dup_state(cheeky_client_state(client));
+	if (!state) {
+		mutex_unlock(&data->state_lock);
+		return (-ENOMEM);
+	}
+	memcpy(state->grey, levels, sizeof(levels));
+	SET_CUSTOM(state->params, 1);
+	SET_GREY(state->params, 1);
+	if (!client->screen)
+		cheeky_ticker_stop(data);
+	cheeky_client_publish(client, state);
+	mutex_unlock(&data->state_lock);
+
+	return (0);
+}
+
+/**
+ * @brief
+ *	Builds and renders the state of a scene of a playlist, over the state
+ *	of the previous scene.  The caller must hold state_lock.
+ * @param data Our private structure.
+ * @param scene Where to store the scene.
+ * @param previous The state of the previous scene, or the state published
+ * for the first scene.
+ * @param request The scene given by the user.
+ * @return 0 on success, a negative number on failure.
+ */
+static int		cheeky_build_scene(data_t*			data,
+					   scene_t*			scene,
+					   const state_t*		previous,
+					   const cheeky_scene_t*	request)
+{
+	text_t*		text;
+	size_t		length;
+	char*			buffer;
+	int			ret;
+
+	ret = cheeky_check_state(&request->state);
+	if (ret)
+		return (ret);
+	if (!request->duration && !request->passes)
+		return (-EINVAL);
+
+	scene->duration = (__u64) request->duration * NSEC_PER_MSEC;
+	scene->passes = request->passes;
+	scene->state = cheeky_dup_state(previous);
+	if (!scene->state)
+		return (-ENOMEM);
+
+	if (request->state.mask & STATE_TEXT) {
+		ret = cheeky_copy_text(u64_to_user_ptr(request->state.text),
+				       request->state.length,
+				       &buffer,
+				       &length);
+		if (ret)
+			return (ret);
+		text = cheeky_new_template(buffer, length);
+		if (!text)
+			return (-ENOMEM);
+		cheeky_replace_text(data, scene->state, text);
+	}
+	if (request->packets) {
+		if (copy_from_user(scene->state->custom_packets,
+				   u64_to_user_ptr(request->packets),
+				   sizeof(usb_packet_t) * NB_PACKETS))
+			return (-EFAULT);
+		SET_CUSTOM(scene->state->params, 1);
+		SET_GREY(scene->state->params, 0);
+	}
+	cheeky_apply_state(scene->state, &request->state);
+
+	/* A scene counting passes must end, so its text must scroll */
+	if (!scene->duration					&&
+	    (!GET_HMOVE(scene->state->params)			||
+	     GET_CUSTOM(scene->state->params)			||
+	     !scene->state->rate))
+		return (-EINVAL);
+	cheeky_build_frames(scene->state);
+
+	return (0);
+}
+
+/**
+ * @brief
+ *	Sets a playlist on the display, which the scheduler plays on its own.
+ *	The states of all the scenes are built and rendered here, so that
+ *	moving from a scene to the next costs nothing.
+ * @param data Our private structure.
+ * @param arg The cheeky_playlist_t in user space.
+ * @return 0 on success, a negative number on failure.
+ */
+static int		cheeky_set_playlist(data_t*			data,
+					    const cheeky_playlist_t __user*	arg)
+{
+	cheeky_playlist_t	request;
+	cheeky_scene_t*	scenes;
+	playlist_t*		playlist;
+	const state_t*	previous;
+	unsigned int		i;
+	int			ret = 0;
+
+	if (copy_from_user(&request, arg, sizeof(cheeky_playlist_t)))
+		return (-EFAULT);
+	if (request.count > MAX_SCENES || request.flags & ~PLAYLIST_ALL)
+		return (-EINVAL);
+
+	/* An empty playlist stops the current one */
+	if (!request.count) {
+		mutex_lock(&data->state_lock);
+		cheeky_replace_playlist(data, NULL);
+		mutex_unlock(&data->state_lock);
+		cheeky_kick(data);
+		return (0);
+	}
+
+	scenes = memdup_user(u64_to_user_ptr(request.scenes),
+			     request.count * sizeof(cheeky_scene_t));
+	if (IS_ERR(scenes))
+		return (PTR_ERR(scenes));
+	playlist = kzalloc(sizeof(playlist_t) +
+			   request.count * sizeof(scene_t), GFP_KERNEL);
+	if (!playlist) {
+		kfree(scenes);
+		return (-ENOMEM);
+	}
+	playlist->flags = request.flags;
+
+	mutex_lock(&data->state_lock);
+	previous = rcu_dereference_protected(data->state,
+					     lockdep_is_held(&data->state_lock));
+	for (i = 0; i < request.count && !ret; ++i) {
+		ret = cheeky_build_scene(data, &playlist->scenes[i],
+					 previous, &scenes[i]);
+		playlist->count = i + 1;
+		previous = playlist->scenes[i].state;
+	}
+	if (!ret) {
+		cheeky_replace_playlist(data, playlist);
+		/* The ticker would hide the scenes and stall the rotation */
+		cheeky_ticker_stop(data);
+	}
+	mutex_unlock(&data->state_lock);
+
+	kfree(scenes);
+	if (ret) {
+		cheeky_free_playlist(playlist);
+		return (ret);
+	}
+	cheeky_kick(data);
+
+	return (0);
+}
+
+/**
+ * @brief
+ *	Sets or increments one of the counters shown by the live fields of the
+ *	text.  The text is not rendered again, only the glyphs of the fields.
+ * @param data Our private structure.
+ * @param arg The cheeky_counter_t in user space.
+ * @return 0 on success, a negative number on failure.
+ */
+static int		cheeky_set_counter(data_t*			data,
+					   const cheeky_counter_t __user*	arg)
+{
+	cheeky_counter_t	request;
+
+	if (copy_from_user(&request, arg, sizeof(cheeky_counter_t)))
+		return (-EFAULT);
+	if (request.slot >= CHEEKY_NB_COUNTERS)
+		return (-EINVAL);
+
+	switch (request.op) {
+	case COUNTER_SET:
+		atomic64_set(&data->counters[request.slot], request.value);
+		break;
+	case COUNTER_ADD:
+		atomic64_add(request.value, &data->counters[request.slot]);
+		break;
+	default:
+		return (-EINVAL);
+	}
+	cheeky_kick(data);
+
+	return (0);
+}
+
+/**
+ * @brief
+ *	Copies the counters of the events of a display to user space, and
+ *	clears the POLLPRI event of the file.
+ * @param client The file reading the counters.
+ * @param counters The counters in user space.
+ * @return 0 on success, a negative number on failure.
+ */
+static int		cheeky_get_counters(client_t*		client,
+					    cheeky_counters_t __user*	counters)
+{
+	cheeky_counters_t	copy;
+	data_t*		data = client->data;
+	unsigned long		flags;
+
+	spin_lock_irqsave(&data->event_lock, flags);
+	copy.frames = data->frames_done;
+	copy.wraps = data->wraps;
+	copy.frame_time = ktime_to_ns(data->frame_time);
+	client->frames_seen = copy.frames;
+	client->wraps_seen = copy.wraps;
+	spin_unlock_irqrestore(&data->event_lock, flags);
+
+	if (copy_to_user(counters, &copy, sizeof(cheeky_counters_t)))
+		return (-EFAULT);
+
+	return (0);
+}
+
+/**
+ * @brief
+ *	Tells if a display had a frame or a wrap which the file did not read
+ *	with IOCTL_CMD_GET_COUNTERS yet.
+ * @param client The file polled.
+ * @return 1 if there is a new event, 0 otherwise.
+ */
+static int		cheeky_new_events(client_t*	client)
+{
+	data_t*		data = client->data;
+	unsigned long		flags;
+	int			events;
+
+	spin_lock_irqsave(&data->event_lock, flags);
+	events = client->frames_seen != data->frames_done ||
+		client->wraps_seen != data->wraps;
+	spin_unlock_irqrestore(&data->event_lock, flags);
+
+	return (events);
+}
+
+/**
+ * @brief
+ *	Copies the argument of IOCTL_CMD_SET_STATE, or turns the argument of a
+ *	command which sets a single field into a cheeky_state_t.
+ * @param cmd The command.
+ * @param arg The argument of the command, in user space.
+ * @param request Where to store the request.
+ * @return 0 on success, a negative number on failure.
+ */
+static int		cheeky_state_request(unsigned int	cmd,
+					     unsigned long	arg,
+					     cheeky_state_t*	request)
+{
+	__u32*		field;
+
+	memset(request, 0, sizeof(cheeky_state_t));
+	switch (cmd) {
+	case IOCTL_CMD_SET_STATE_V1:
+	case IOCTL_CMD_SET_STATE:
+		if (copy_from_user(request, (void __user*) arg,
+				   _IOC_SIZE(cmd)))
+			return (-EFAULT);
+		return (0);
+	case IOCTL_CMD_BRIGHNESS:
+		request->mask = STATE_BRIGHNESS;
+		field = &request->brighness;
+		break;
+	case IOCTL_CMD_FLASH:
+		request->mask = STATE_FLASH;
+		field = &request->flash;
+		break;
+	case IOCTL_CMD_SPEED:
+		request->mask = STATE_SPEED;
+		field = &request->speed;
+		break;
+	case IOCTL_CMD_RATE:
+		request->mask = STATE_RATE;
+		field = &request->rate;
+		break;
+	case IOCTL_CMD_HMOVE:
+		request->mask = STATE_HMOVE;
+		field = &request->hmove;
+		break;
+	case IOCTL_CMD_VMOVE:
+		request->mask = STATE_VMOVE;
+		field = &request->vmove;
+		break;
+	case IOCTL_CMD_NEGATIVE:
+		request->mask = STATE_NEGATIVE;
+		field = &request->negative;
+		break;
+	case IOCTL_CMD_SMOOTH:
+		request->mask = STATE_SMOOTH;
+		field = &request->smooth;
+		break;
+	default:
+		printk(KERN_WARNING "cheeky_display: 0x%x unsupported ioctl command.\n",
+		       cmd);
+		return (-EINVAL);
+		break;
+	}
+	if (get_user(*field, (__u32 __user*) arg))
+		return (-EFAULT);
+	request->version = CHEEKY_STATE_VERSION;
+
+	return (0);
+}
+
+/**
+ * @brief
+ *	Extends features of this driver. Here are the 17 comands that are
+ *	supported yet:
+ *	- IOCTL_CMD_SET_STATE
+ *	- IOCTL_CMD_SET_PLAYLIST
+ *	- IOCTL_CMD_COUNTER
+ *	- IOCTL_CMD_GET_COUNTERS
+ *	- IOCTL_CMD_SET_WALL
+ *	- IOCTL_CMD_SET_SCREEN
+ *	- IOCTL_CMD_SET_LAYOUT
+ *	- IOCTL_CMD_BRIGHNESS
+ *	- IOCTL_CMD_SPEED
+ *	- IOCTL_CMD_RATE
+ *	- IOCTL_CMD_HMOVE
+ *	- IOCTL_CMD_VMOVE
+ *	- IOCTL_CMD_FLASH
+ *	- IOCTL_CMD_NEGATIVE
+ *	- IOCTL_CMD_SMOOTH
+ *	- IOCTL_CMD_CUSTOM
+ *	- IOCTL_CMD_GREY
+ *	It only uses the data attached to the file when it was opened and the
+ *	lock of the state of this device, so that ioctls on different displays
+ *	never serialize.
+ * @param file Used to retreive our private data.
+ * @param cmd One of the comands above.
+ * @param arg A pointer to the parameter for each comand, a __u32 whose
+ * authorized values, depending on the cmd argument are :
+ *	- cmd = IOCTL_CMD_SET_STATE: arg is a pointer to a cheeky_state_t
+ *	holding the text and the effects to change at once.
+ *	- cmd = IOCTL_CMD_SET_PLAYLIST: arg is a pointer to a cheeky_playlist_t
+ *	holding the scenes to play, 0 scenes stopping the playlist.
+ *	- cmd = IOCTL_CMD_COUNTER: arg is a pointer to a cheeky_counter_t
+ *	setting or incrementing a counter shown by the live fields of the text.
+ *	- cmd = IOCTL_CMD_GET_COUNTERS: arg is a pointer to a cheeky_counters_t
+ *	where to copy the counters of the frames and of the wraps.
+ *	- cmd = IOCTL_CMD_SET_WALL: arg is a pointer to a cheeky_wall_t holding
+ *	the displays placed on the right of this one.
+ *	- cmd = IOCTL_CMD_SET_SCREEN: arg is a pointer to a cheeky_screen_t
+ *	giving the file a screen of its own, with its priority and how long it
+ *	is shown.  The following IOCTL_CMD_SET_STATE, IOCTL_CMD_CUSTOM,
+ *	IOCTL_CMD_GREY and writes change the screen, and IOCTL_CMD_SET_PLAYLIST
+ *	and IOCTL_CMD_COUNTER fail with -EBUSY.
+ *	- cmd = IOCTL_CMD_SET_LAYOUT: arg is a pointer to a cheeky_layout_t
+ *	holding the regions composed instead of the text, 0 regions printing
+ *	the text on the whole display again.
+ *	- cmd = IOCTL_CMD_BRIGHNESS: should be one of LED_LOW_BR, LED_MIDDLE_BR
+ *	or LED_HIGH_BR
+ *	- cmd = IOCTL_CMD_SPEED: should be a number between 0 and 15, 15 is the
+ *	fastest.  Level n scrolls at 4 + 2 * n LED columns per second.
+ *	- cmd = IOCTL_CMD_RATE: the exact speed of the effects, in thousandths
+ *	of LED column per second.
+ *	- cmd = IOCTL_CMD_HMOVE: should be one of LED_NO_HMOVE,
+ *	LED_RIGHT_TO_LEFT or LED_LEFT_TO_RIGHT
+ *	- cmd = IOCTL_CMD_VMOVE: should be one of LED_NO_VMOVE, LED_UP_TO_DOWN
+ *	or LED_DOWN_TO_UP.
+ *	- cmd = IOCTL_CMD_FLASH: should be one of LED_FLASHING or LED_NO_FLASH.
+ *	- cmd = IOCTL_CMD_NEGATIVE: should be one of LED_NEGATIVE_ON or
+ *	LED_NEGATIVE_OFF.
+ *	- cmd = IOCTL_CMD_SMOOTH: should be one of LED_SMOOTH_ON or
+ *	LED_SMOOTH_OFF.
+ *	- cmd = IOCTL_CMD_CUSTOM: arg is a pointer to a 32bytes memory area
+ *	(CUSTOM_SIZE)
+ *	corresponsding to the 4 usb packets that will be sent to the
+ *	device. This is used to give the ability to a user to write whatever he
+ *	wants to the device and not juste ascii text.
+ *	- cmd = IOCTL_CMD_GREY: arg is a pointer to the GREY_SIZE bytes of a
+ *	greyscale image.
+ *	Each command from IOCTL_CMD_BRIGHNESS to IOCTL_CMD_SMOOTH is a
+ *	IOCTL_CMD_SET_STATE with a single field.
+ * @return 0 on success, a negative number on failure.
+ */
+static long		cheeky_ioctl(struct file*	file,
+				  unsigned int	cmd,
+				  unsigned long	arg)
+{
+	client_t*		client = file->private_data;
+	data_t*		data = client->data;
+	cheeky_state_t	request;
+	int			ret;
+
+	if (data->disconnected)
+		return (-ENODEV);
+
+	switch (cmd) {
+	case IOCTL_CMD_SET_PLAYLIST:
+	case IOCTL_CMD_COUNTER:
+		/* They belong to the display, which a screen must not change */
+		if (READ_ONCE(client->screen))
+			return (-EBUSY);
+		if (cmd == IOCTL_CMD_COUNTER)
+			return (cheeky_set_counter(data, (void __user*) arg));
+		return (cheeky_set_playlist(data, (void __user*) arg));
+	case IOCTL_CMD_GET_COUNTERS:
+		return (cheeky_get_counters(client, (void __user*) arg));
+	case IOCTL_CMD_CUSTOM:
+		return (cheeky_set_custom(client, (void __user*) arg));
+	case IOCTL_CMD_GREY:
+		return (cheeky_set_grey(client, (void __user*) arg));
+	case IOCTL_CMD_SET_WALL:
+		return (cheeky_set_wall(data, (void __user*) arg));
+	case IOCTL_CMD_SET_SCREEN:
+		return (cheeky_set_screen(client, (void __user*) arg));
+	case IOCTL_CMD_SET_LAYOUT:
+		return (cheeky_set_layout(client, (void __user*) arg));
+	}
+
+	ret = cheeky_state_request(cmd, arg, &request);
+	if (ret)
+		return (ret);
+
+	return (cheeky_set_state(client, &request));
+}
+
+/**
+ * @brief
+ *	Releases our private structure once the device is unplugged and the
+ *	last file opened on it is closed.
+ * @param ref The reference counter of our private structure.
+ */
+static void		cheeky_delete(struct kref*	ref)
+{
+	data_t*		data = container_of(ref, data_t, ref);
+
+	cheeky_free_state(rcu_dereference_protected(data->state, 1));
+	if (rcu_access_pointer(data->playlist))
+		cheeky_free_playlist(rcu_dereference_protected(data->playlist,
+							       1));
+	kfifo_free(&data->ticker);
+	usb_put_dev(data->udev);
+	kfree(data);
+}
+
+/**
+ * @brief
+ *	This function registers privates datas to the file
+ *	structure, as to be able to use those datas in
+ *	read/write/ioctl functions.  The file holds a reference on them until
+ *	it is released, so that they outlive an unplug.
+ * @param inode Used to retreive the minor.
+ * @param file Used to attach private data to the char device.
+ * @return 0 on success, a negative number on failure.
+ */
+static int		cheeky_open(struct inode*	inode,
+				 struct file*	file)
+{
+	struct usb_interface*	interface;
+	unsigned long			flags;
+	client_t*			client;
+	data_t*		data;
+	int			minor;
+
+	/* Minor retreiving */
+	minor = iminor(inode);
+	interface = usb_find_interface(&cheeky_driver, minor);
+	if (!interface)	{
+		printk(KERN_WARNING "cheeky_display: cannot find device for minor.\n");
+		return (-ENODEV);
+	}
+
+	/* Attaching our data to the usb device */
+	data = usb_get_intfdata(interface);
+	if (!data)
+		return (-ENODEV);
+
+	client = kzalloc(sizeof(client_t), GFP_KERNEL);
+	if (!client)
+		return (-ENOMEM);
+
+	kref_get(&data->ref);
+	client->data = data;
+
+	/* Only the events after the opening are reported */
+	spin_lock_irqsave(&data->event_lock, flags);
+	client->frames_seen = data->frames_done;
+	client->wraps_seen = data->wraps;
+	spin_unlock_irqrestore(&data->event_lock, flags);
+
+	file->private_data = client;
+
+	return (0);
+}
+
+/**
+ * @brief
+ *	This function releases the memory attached to the file descriptor.
+ * @return Always 0.
+ */
+static int		cheeky_release(struct inode*	inode,
+				    struct file*	file)
+{
+	client_t*		client = file->private_data;
+	data_t*		data = client->data;
+
+	/* The display falls back to the next screen */
+	mutex_lock(&data->state_lock);
+	cheeky_replace_screen(data, client, NULL);
+	mutex_unlock(&data->state_lock);
+
+	file->private_data = NULL;
+	kref_put(&data->ref, cheeky_delete);
+	kfree(client);
+
+	return (0);
+}
+
+/**
+ * @brief
+ *	Tells if the display can be written without waiting, and if it had
+ *	events.  A file opened with O_APPEND is writable once TICKER_WAKE
+ *	characters are free in the ring of the ticker, the other files always
+ *	are.  POLLPRI is reported after a frame or a wrap, until the file reads
+ *	the counters with IOCTL_CMD_GET_COUNTERS.
+ * @param file Used to retreive our private data.
+ * @param wait The poll table.
+ * @return The events ready.
+ */
+static __poll_t		cheeky_poll(struct file*	file,
+				    poll_table*		wait)
+{
+	client_t*		client = file->private_data;
+	data_t*		data = client->data;
+	__poll_t		events = 0;
+
+	poll_wait(file, &data->event_wait, wait);
+	if (file->f_flags & O_APPEND)
+		poll_wait(file, &data->ticker_wait, wait);
+	if (data->disconnected)
+		return (EPOLLERR | EPOLLHUP);
+
+	if (cheeky_new_events(client))
+		events |= EPOLLPRI;
+	if (!(file->f_flags & O_APPEND)	||
+	    cheeky_ticker_avail(data) >= TICKER_WAKE)
+		events |= EPOLLOUT | EPOLLWRNORM;
+
+	return (events);
+}
+
+/**
+ * @brief
+ *	This structure tells the kernel which function we register with the
+ *	char device.
+ */
+static const struct file_operations	cheeky_fops = {
+	.owner	= THIS_MODULE,
+	.open	= cheeky_open,
+	.release	= cheeky_release,
+	.read	= cheeky_read,
+	.write	= cheeky_write,
+	.poll	= cheeky_poll,
+	.llseek	= cheeky_llseek,
+	.unlocked_ioctl	= cheeky_ioctl,
+	.compat_ioctl	= compat_ptr_ioctl,
+};
+
+/**
+ * @brief
+ *	Gives a state broadcast to a device, in place of its own.  The frames
+ *	rendered for the broadcast are copied, so that the device costs no
+ *	rendering.  The device keeps showing its previous state until the
+ *	generation of the broadcast starts.  The caller must hold the lock of
+ *	the broadcast.
+ * @param data Our private structure.
+ * @param shared The state broadcast.
+ * @param gen The generation of the broadcast.
+ * @return 0 on success, a negative number on failure.
+ */
+static int		cheeky_give_state(data_t*		data,
+					  const state_t*	shared,
+					  unsigned long		gen)
+{
+	state_t*		state;
+	state_t*		old;
+	unsigned int		nb_frames;
+
+	state = cheeky_dup_state(shared);
+	if (!state)
+		return (-ENOMEM);
+	if (shared->frames) {
+		nb_frames = shared->frame_positions * shared->frame_vsteps + 1;
+		state->frames = kmemdup(shared->frames,
+					sizeof(usb_packet_t) * NB_PACKETS *
+					nb_frames,
+					GFP_KERNEL);
+	}
+
+	mutex_lock(&data->state_lock);
+	old = rcu_dereference_protected(data->state,
+					lockdep_is_held(&data->state_lock));
+	if (old->text != state->text) {
+		state->text_seq = ++(data->texts);
+		cheeky_ticker_stop(data);
+	}
+	else
+		state->text_seq = old->text_seq;
+	state->broadcast_gen = gen;
+	state->previous = old;
+	cheeky_publish_state(data, state);
+	mutex_unlock(&data->state_lock);
+
+	return (0);
+}
+
+/**
+ * @brief
+ *	Releases the state a broadcast state replaced on a device, once the
+ *	broadcast started and no pass of the scheduler can show it anymore.
+ *	The caller must hold the lock of the broadcast.
+ * @param data Our private structure.
+ */
+static void		cheeky_drop_previous(data_t*	data)
+{
+	state_t*		state;
+
+	mutex_lock(&data->state_lock);
+	state = rcu_dereference_protected(data->state,
+					  lockdep_is_held(&data->state_lock));
+	if (state->previous) {
+		cheeky_free_state(state->previous);
+		state->previous = NULL;
+	}
+	mutex_unlock(&data->state_lock);
+}
+
+/**
+ * @brief
+ *	Applies a request to the state of /dev/cheeky_all, renders it once and
+ *	gives it to every device plugged.  The devices only switch to it when
+ *	its generation starts, which the scheduler samples once per pass, so
+ *	they all switch on the same frame.  The scheduler never waits for this.
+ * @param request The fields to apply, and their mask.
+ * @return 0 on success, a negative number on failure.
+ */
+static int		cheeky_broadcast_state(const cheeky_state_t*	request)
+{
+	unsigned long		gen;
+	state_t*		state;
+	text_t*		text;
+	data_t*		data;
+	int			ret;
+
+	ret = cheeky_request_text(request, &text);
+	if (ret)
+		return (ret);
+
+	mutex_lock(&cheeky_broadcast.lock);
+	state = cheeky_dup_state(cheeky_broadcast.state);
+	if (!state) {
+		mutex_unlock(&cheeky_broadcast.lock);
+		if (text)
+			kref_put(&text->ref, cheeky_free_text);
+		return (-ENOMEM);
+	}
+	if (text) {
+		kref_put(&state->text->ref, cheeky_free_text);
+		state->text = text;
+	}
+	cheeky_apply_state(state, request);
+	cheeky_refont_state(state);
+	cheeky_build_frames(state);
+	cheeky_free_state(cheeky_broadcast.state);
+	cheeky_broadcast.state = state;
+
+	gen = cheeky_broadcast.gen + 1;
+	list_for_each_entry(data, &cheeky_broadcast.devices, broadcast_node)
+		if (cheeky_give_state(data, state, gen))
+			ret = -ENOMEM;
+
+	/* Start the broadcast, and wake up the devices which went idle */
+	smp_store_release(&cheeky_broadcast.gen, gen);
+	list_for_each_entry(data, &cheeky_broadcast.devices, broadcast_node)
+		cheeky_kick(data);
+
+	/* Once the pass running is over, nobody shows the previous states */
+	flush_work(&cheeky_scheduler.work);
+	list_for_each_entry(data, &cheeky_broadcast.devices, broadcast_node)
+		cheeky_drop_previous(data);
+	mutex_unlock(&cheeky_broadcast.lock);
+
+	return (ret);
+}
+
+/**
+ * @brief
+ *	Called when someone writes to /dev/cheeky_all: the text replaces the
+ *	one of every display.
+ * @param file The file written.
+ * @param buf The text in user space.
+ * @param count The length of buf, truncated to MAX_CHARS.
+ * @param ppos Unused, each write replaces the whole text.
+ * @return The number of characters written, a negative number on failure.
+ */
+static ssize_t		cheeky_all_write(struct file*		file,
+					 const char __user*	buf,
+					 size_t		count,
+					 loff_t*		ppos)
+{
+	cheeky_state_t	request;
+	int			ret;
+
+	cheeky_text_request(buf, count, &request);
+	ret = cheeky_broadcast_state(&request);
+	if (ret)
+		return (ret);
+
+	return (request.length);
+}
+
+/**
+ * @brief
+ *	The ioctls of /dev/cheeky_all: IOCTL_CMD_SET_STATE and the commands
+ *	setting a single field, which are applied to every display.
+ * @param file The file.
+ * @param cmd The command.
+ * @param arg The argument of the command, as for cheeky_ioctl.
+ * @return 0 on success, a negative number on failure.
+ */
+static long		cheeky_all_ioctl(struct file*	file,
+					 unsigned int	cmd,
+					 unsigned long	arg)
+{
+	cheeky_state_t	request;
+	int			ret;
+
+	ret = cheeky_state_request(cmd, arg, &request);
+	if (ret)
+		return (ret);
+
+	return (cheeky_broadcast_state(&request));
+}
+
+/**
+ * @brief
+ *	The functions of /dev/cheeky_all.
+ */
+static const struct file_operations	cheeky_all_fops = {
+	.owner	= THIS_MODULE,
+	.write	= cheeky_all_write,
+	.llseek	= noop_llseek,
+	.unlocked_ioctl	= cheeky_all_ioctl,
+	.compat_ioctl	= compat_ptr_ioctl,
+};
+
+/**
+ * @brief
+ *	Sets the first state of /dev/cheeky_all, the one of a display just
+ *	plugged, and registers the char device.
+ * @return 0 on success, a negative number on failure.
+ */
+static int __init	cheeky_broadcast_register(void)
+{
+	state_t*		state;
+	char*			text;
+	int			ret;
+
+	mutex_init(&cheeky_broadcast.lock);
+	INIT_LIST_HEAD(&cheeky_broadcast.devices);
+
+	state = cheeky_dup_state(NULL);
+	text = kmemdup("WORKING ", 8, GFP_KERNEL);
+	if (!state || !text) {
+		kfree(state);
+		kfree(text);
+		return (-ENOMEM);
+	}
+	SET_BRIGHNESS(state->params, LED_HIGH_BR);
+	SET_SPEED(state->params, 5);
+	state->rate = SPEED_TO_RATE(5);
+	state->text = cheeky_new_template(text, 8);
+	if (!state->text) {
+		cheeky_free_state(state);
+		return (-ENOMEM);
+	}
+	cheeky_build_frames(state);
+	cheeky_broadcast.state = state;
+
+	cheeky_broadcast.misc.minor = MISC_DYNAMIC_MINOR;
+	cheeky_broadcast.misc.name = "cheeky_all";
+	cheeky_broadcast.misc.fops = &cheeky_all_fops;
+	cheeky_broadcast.misc.mode = S_IWUSR | S_IWGRP;
+	ret = misc_register(&cheeky_broadcast.misc);
+	if (ret)
+		cheeky_free_state(state);
+
+	return (ret);
+}
+
+/**
+ * @brief
+ *	Removes /dev/cheeky_all and releases its state.
+ */
+static void		cheeky_broadcast_unregister(void)
+{
+	misc_deregister(&cheeky_broadcast.misc);
+	cheeky_free_state(cheeky_broadcast.state);
+}
+
+/**
+ * @brief
+ *	Renders a published state again with the font in use, and publishes the
+ *	copy in its place under the same seq: the scroll goes on, and the
+ *	writes waiting for the state to be shown keep waiting for its copy.
+ *	The caller must hold state_lock.
+ * @param data Our private structure.
+ * @param slot The pointer the state is published with.
+ * @return 0 on success, -ENOMEM if the state keeps the previous glyphs.
+ */
+static int		cheeky_refont_published(data_t*		data,
+						state_t __rcu**	slot)
+{
+	state_t*		state;
+	state_t*		old;
+
+	old = rcu_dereference_protected(*slot,
+					lockdep_is_held(&data->state_lock));
+	if (!old || !cheeky_font_stale(old))
+		return (0);
+
+	state = cheeky_dup_state(old);
+	if (!state)
+		return (-ENOMEM);
+	if (cheeky_refont_state(state)) {
+		cheeky_free_state(state);
+		return (-ENOMEM);
+	}
+	cheeky_build_frames(state);
+	rcu_assign_pointer(*slot, state);
+	call_rcu(&old->rcu, cheeky_free_state_rcu);
+
+	return (0);
+}
+
+/**
+ * @brief
+ *	Renders the scenes of the playlist of a device again with the font in
+ *	use.  The new playlist keeps the seq of the old one, so that the
+ *	scheduler goes on with the scene it plays.  The caller must hold
+ *	state_lock.
+ * @param data Our private structure.
+ * @return 0 on success, -ENOMEM if the playlist keeps the previous glyphs.
+ */
+static int		cheeky_refont_playlist(data_t*	data)
+{
+	playlist_t*		playlist;
+	playlist_t*		old;
+	state_t*		state;
+	unsigned int		i;
+
+	old = rcu_dereference_protected(data->playlist,
+					lockdep_is_held(&data->state_lock));
+	if (!old)
+		return (0);
+	for (i = 0; i < old->count; ++i)
+		if (cheeky_font_stale(old->scenes[i].state))
+			break;
+	if (i == old->count)
+		return (0);
+
+	playlist = kzalloc(sizeof(playlist_t) + old->count * sizeof(scene_t),
+			   GFP_KERNEL);
+	if (!playlist)
+		return (-ENOMEM);
+	playlist->seq = old->seq;
+	playlist->flags = old->flags;
+	for (i = 0; i < old->count; ++i) {
+		state = cheeky_dup_state(old->scenes[i].state);
+		if (state && cheeky_refont_state(state)) {
+			cheeky_free_state(state);
+			state = NULL;
+		}
+		playlist->scenes[i] = old->scenes[i];
+		playlist->scenes[i].state = state;
+		playlist->count = i + 1;
+		if (!state) {
+			cheeky_free_playlist(playlist);
+			return (-ENOMEM);
+		}
+		cheeky_build_frames(state);
+	}
+
+	rcu_assign_pointer(data->playlist, playlist);
+	call_rcu(&old->rcu, cheeky_free_playlist_rcu);
+
+	return (0);
+}
+
+/**
+ * @brief
+ *	Renders again with the font in use the state of /dev/cheeky_all, and
+ *	the states, the screens and the playlist of every device plugged, so
+ *	that a new font replaces the previous one everywhere from the next
+ *	frame on.  The caller must hold cheeky_font_lock.
+ * @return 0 on success, -ENOMEM if some texts keep the previous glyphs.
+ */
+static int		cheeky_refont_all(void)
+{
+	screen_t*		screen;
+	data_t*		data;
+	int			ret = 0;
+
+	mutex_lock(&cheeky_broadcast.lock);
+	if (cheeky_refont_state(cheeky_broadcast.state))
+		ret = -ENOMEM;
+	if (!cheeky_broadcast.state->frames)
+		cheeky_build_frames(cheeky_broadcast.state);
+
+	list_for_each_entry(data, &cheeky_broadcast.devices, broadcast_node) {
+		mutex_lock(&data->state_lock);
+		if (cheeky_refont_published(data, &data->state))
+			ret = -ENOMEM;
+		list_for_each_entry(screen, &data->screens, node)
+			if (cheeky_refont_published(data, &screen->state))
+				ret = -ENOMEM;
+		if (cheeky_refont_playlist(data))
+			ret = -ENOMEM;
+		mutex_unlock(&data->state_lock);
+		cheeky_kick(data);
+	}
+	mutex_unlock(&cheeky_broadcast.lock);
+
+	return (ret);
+}
+
+/**
+ * @brief
+ *	Checks a binary font and unpacks its glyphs into a new font_t.
+ * @param blob The binary font, as described in cheeky_driver.h.
+ * @param size The size of the binary font.
+ * @param font Where to store the new font.
+ * @return 0 on success, a negative number on failure.
+ */
+static int		cheeky_parse_font(const __u8*		blob,
+					  size_t		size,
+					  font_t**		font)
+{
+	cheeky_font_header_t	header;
+	const __u8*		index;
+	const __u8*		glyphs;
+	unsigned int		glyph;
+	unsigned int		first;
+	unsigned int		count;
+	unsigned int		nb_glyphs;
+	unsigned int		i;
+	__u8			row;
+
+	if (size < sizeof(header) || size > CHEEKY_FONT_MAX_SIZE)
+		return (-EINVAL);
+	memcpy(&header, blob, sizeof(header));
+	first = le16_to_cpu(header.first);
+	count = le16_to_cpu(header.count);
+	nb_glyphs = le16_to_cpu(header.glyphs);
+	if (le32_to_cpu(header.magic) != CHEEKY_FONT_MAGIC	||
+	    le16_to_cpu(header.version) != CHEEKY_FONT_VERSION	||
+	    header.width != GLYPH_WIDTH				||
+	    header.height != NB_ROWS				||
+	    header.reserved					||
+	    first + count > 256					||
+	    nb_glyphs > 256					||
+	    size != sizeof(header) + count * 2 + nb_glyphs * NB_ROWS)
+		return (-EINVAL);
+
+	index = blob + sizeof(header);
+	glyphs = index + count * 2;
+	for (i = 0; i < nb_glyphs * NB_ROWS; ++i)
+		if (glyphs[i] >> GLYPH_WIDTH)
+			return (-EINVAL);
+
+	*font = kzalloc(sizeof(font_t), GFP_KERNEL);
+	if (!*font)
+		return (-ENOMEM);
+	for (i = 0; i < count; ++i) {
+		glyph = index[i * 2] | index[i * 2 + 1] << 8;
+		if (glyph == CHEEKY_FONT_NONE)
+			continue;
+		if (glyph >= nb_glyphs) {
+			kfree(*font);
+			return (-EINVAL);
+		}
+		for (row = 0; row < NB_ROWS; ++row)
+			(*font)->glyphs[first + i].rows[row] =
+				glyphs[glyph * NB_ROWS + row];
+	}
+
+	return (0);
+}
+
+/**
+ * @brief
+ *	Loads a font and makes it the font in use.  The ticker changes at the
+ *	next frame, and the texts already rendered are rendered again and
+ *	published at once, so that they change at the next frame too.
+ *	cheeky_font_lock must be held.
+ * @param name The name of the binary font in the firmware directory, empty
+ * for the built-in font.
+ * @return 0 on success, a negative number on failure.
+ */
+static int		cheeky_load_font(const char*	name)
+{
+	const struct firmware*	firmware;
+	font_t*			font;
+	font_t*			old;
+	int			ret;
+
+	if (!*name) {
+		ret = cheeky_parse_font(cheeky_default_font,
+					sizeof(cheeky_default_font), &font);
+	} else {
+		ret = request_firmware(&firmware, name, cheeky_font_device);
+		if (ret)
+			return (ret);
+		ret = cheeky_parse_font(firmware->data, firmware->size, &font);
+		release_firmware(firmware);
+	}
+	if (ret)
+		return (ret);
+
+	old = rcu_dereference_protected(cheeky_font,
+					lockdep_is_held(&cheeky_font_lock));
+	font->seq = old ? old->seq + 1 : 1;
+	rcu_assign_pointer(cheeky_font, font);
+	/* No text is rendered before the first font is loaded */
+	if (!old)
+		return (0);
+	kfree_rcu(old, rcu);
+
+	if (cheeky_refont_all())
+		printk(KERN_WARNING "cheeky_display: Unable to render all the texts with the new font.\n");
+
+	return (0);
+}
+
+/**
+ * @brief
+ *	Sets the font parameter, loading the font at once when the module is
+ *	already running.  The parameter keeps its previous value if the font
+ *	cannot be loaded.
+ * @param val The name of the binary font, empty for the built-in font.
+ * @param kp The parameter.
+ * @return 0 on success, a negative number on failure.
+ */
+static int		cheeky_set_font_param(const char*			val,
+					      const struct kernel_param*	kp)
+{
+	char*			buffer;
+	char*			name;
+	int			ret = 0;
+
+	buffer = kstrdup(val, GFP_KERNEL);
+	if (!buffer)
+		return (-ENOMEM);
+	name = strim(buffer);
+
+	mutex_lock(&cheeky_font_lock);
+	if (cheeky_font_device)
+		ret = cheeky_load_font(name);
+	if (!ret)
+		ret = param_set_charp(name, kp);
+	mutex_unlock(&cheeky_font_lock);
+
+	kfree(buffer);
+	return (ret);
+}
+
+/**
+ * @brief
+ *	The operations of the font parameter.
+ */
+static const struct kernel_param_ops	cheeky_font_ops = {
+	.set	= cheeky_set_font_param,
+	.get	= param_get_charp,
+	.free	= param_free_charp,
+};
+
+#ifdef CONFIG_FB_SYSMEM_HELPERS_DEFERRED
+/**
+ * @brief
+ *	The fixed parameters of the framebuffer of a display: one bit per LED,
+ *	the leftmost LED being the most significant bit of the first byte of
+ *	a line, and 1 for a LED turned on.
+ */
+static const struct fb_fix_screeninfo	cheeky_fb_fix = {
+	.id		= "cheeky",
+	.type		= FB_TYPE_PACKED_PIXELS,
+	.visual	= FB_VISUAL_MONO10,
+	.line_length	= FB_LINE_LENGTH,
+	.smem_len	= FB_SIZE,
+	.accel		= FB_ACCEL_NONE,
+};
+
+/**
+ * @brief
+ *	The variable parameters of the framebuffer of a display, which cannot
+ *	be changed.
+ */
+static const struct fb_var_screeninfo	cheeky_fb_var = {
+	.xres		= NB_COLUMNS,
+	.yres		= NB_ROWS,
+	.xres_virtual	= NB_COLUMNS,
+	.yres_virtual	= NB_ROWS,
+	.bits_per_pixel	= 1,
+	.red		= { 0, 1, 0 },
+	.green		= { 0, 1, 0 },
+	.blue		= { 0, 1, 0 },
+	.activate	= FB_ACTIVATE_NOW,
+};
+
+/**
+ * @brief
+ *	Packs the framebuffer into usb packets and shows them as custom packets,
+ *	unless they did not change.  The packets which changed since the last
+ *	frame are then the only ones sent, at the next frame deadline.
+ * @param info The framebuffer of the display.
+ */
+static void		cheeky_fb_update(struct fb_info*	info)
+{
+	usb_packet_t		packets[NB_PACKETS];
+	const __u8*		line;
+	const state_t*	old;
+	data_t*		data = info->par;
+	state_t*		state;
+	__u32			rows[NB_PACKETS * 2];
+	__u8			row;
+
+	if (data->disconnected)
+		return;
+
+	/* Turn each line into a row with the leftmost LED in the lowest bit */
+	memset(rows, 0, sizeof(rows));
+	for (row = 0; row < NB_ROWS; ++row) {
+		line = (const __u8*) info->screen_buffer + row * FB_LINE_LENGTH;
+		rows[row] = cheeky_mono_row(line);
+	}
+
+	mutex_lock(&data->state_lock);
+	old = rcu_dereference_protected(data->state,
+					lockdep_is_held(&data->state_lock));
+	for (row = 0; row < NB_PACKETS; ++row)
+		cheeky_pack_packet(&packets[row], row,
+				   rows[row * 2], rows[row * 2 + 1],
+				   old->params);
+	if (GET_CUSTOM(old->params) && !GET_GREY(old->params) &&
+	    !memcmp(old->custom_packets, packets, sizeof(packets))) {
+		mutex_unlock(&data->state_lock);
+		return;
+	}
+
+	state = cheeky_dup_state(old);
+	if (state) {
+		memcpy(state->custom_packets, packets, sizeof(packets));
+		SET_CUSTOM(state->params, 1);
+		SET_GREY(state->params, 0);
+		cheeky_publish_state(data, state);
+	}
+	mutex_unlock(&data->state_lock);
+}
+
+/**
+ * @brief
+ *	Called by the deferred I/O of the framebuffer, after the pages mapped
+ *	by an application were written.
+ * @param info The framebuffer of the display.
+ * @param pagereflist The pages written, the framebuffer holds one page.
+ */
+static void		cheeky_fb_deferred_io(struct fb_info*		info,
+					      struct list_head*	pagereflist)
+{
+	cheeky_fb_update(info);
+}
+
+/**
+ * @brief
+ *	Packs the framebuffer after it was written with write() or drawn by the
+ *	kernel.
+ * @param work The damage work of the display.
+ */
+static void		cheeky_fb_damage_work(struct work_struct*	work)
+{
+	data_t*		data = container_of(to_delayed_work(work), data_t,
+					    fb_damage);
+
+	cheeky_fb_update(data->info);
+}
+
+/**
+ * @brief
+ *	Called when the framebuffer is written with write() or drawn by the
+ *	kernel, which may happen in atomic context: the update is left to the
+ *	damage work, delayed like the deferred I/O to pack at most once per
+ *	frame period.
+ */
+static void		cheeky_fb_damage_range(struct fb_info*	info,
+					       off_t		off,
+					       size_t		len)
+{
+	data_t*		data = info->par;
+
+	schedule_delayed_work(&data->fb_damage, data->fbdefio.delay);
+}
+
+/**
+ * @brief
+ *	Called when an area of the framebuffer is drawn by the kernel.
+ */
+static void		cheeky_fb_damage_area(struct fb_info*	info,
+					      u32		x,
+					      u32		y,
+					      u32		width,
+					      u32		height)
+{
+	data_t*		data = info->par;
+
+	schedule_delayed_work(&data->fb_damage, data->fbdefio.delay);
+}
+
+FB_GEN_DEFAULT_DEFERRED_SYSMEM_OPS(cheeky_fb,
+				   cheeky_fb_damage_range,
+				   cheeky_fb_damage_area)
+
+/**
+ * @brief
+ *	Releases the framebuffer once the device is unplugged and the last
+ *	application using it closed it.
+ * @param info The framebuffer of the display.
+ */
+static void		cheeky_fb_destroy(struct fb_info*	info)
+{
+	data_t*		data = info->par;
+
+	cancel_delayed_work_sync(&data->fb_damage);
+	fb_deferred_io_cleanup(info);
+	vfree(info->screen_buffer);
+	framebuffer_release(info);
+	kref_put(&data->ref, cheeky_delete);
+}
+
+static const struct fb_ops	cheeky_fb_ops = {
+	.owner		= THIS_MODULE,
+	FB_DEFAULT_DEFERRED_OPS(cheeky_fb),
+	.fb_destroy	= cheeky_fb_destroy,
+};
+
+/**
+ * @brief
+ *	Exposes a display as a NB_COLUMNS x NB_ROWS monochrome framebuffer.
+ *	Applications mmap it and write the pixels in place, the deferred I/O
+ *	packs them at most once per frame period.
+ * @param data Our private structure.
+ * @return 0 on success, a negative number on failure.
+ */
+static int		cheeky_fb_register(data_t*	data)
+{
+	struct fb_info*	info;
+	int			ret;
+
+	info = framebuffer_alloc(0, &data->interface->dev);
+	if (!info)
+		return (-ENOMEM);
+
+	info->screen_buffer = vzalloc(FB_SIZE);
+	if (!info->screen_buffer) {
+		framebuffer_release(info);
+		return (-ENOMEM);
+	}
+	info->par = data;
+	info->fbops = &cheeky_fb_ops;
+	info->fix = cheeky_fb_fix;
+	info->var = cheeky_fb_var;
+
+	data->fbdefio.delay = HZ / clamp_t(unsigned int, frame_rate, 1, HZ);
+	data->fbdefio.deferred_io = cheeky_fb_deferred_io;
+	info->fbdefio = &data->fbdefio;
+	ret = fb_deferred_io_init(info);
+	if (ret)
+		goto error;
+
+	/* The kernel may draw as soon as the framebuffer is registered */
+	data->info = info;
+	INIT_DELAYED_WORK(&data->fb_damage, cheeky_fb_damage_work);
+	ret = register_framebuffer(info);
+	if (ret) {
+		cancel_delayed_work_sync(&data->fb_damage);
+		data->info = NULL;
+		fb_deferred_io_cleanup(info);
+		goto error;
+	}
+
+	/* The framebuffer may outlive the device, until it is closed */
+	kref_get(&data->ref);
+
+	return (0);
+
+ error:
+	vfree(info->screen_buffer);
+	framebuffer_release(info);
+	return (ret);
+}
+
+/**
+ * @brief
+ *	Removes the framebuffer of a display which is being unplugged.  It is
+ *	released when the last application using it closes it.
+ * @param data Our private structure.
+ */
+static void		cheeky_fb_unregister(data_t*	data)
+{
+	if (data->info)
+		unregister_framebuffer(data->info);
+}
+#else
+static int		cheeky_fb_register(data_t*	data)
+{
+	return (-ENODEV);
+}
+
+static void		cheeky_fb_unregister(data_t*	data)
+{
+}
+#endif /* CONFIG_FB_SYSMEM_HELPERS_DEFERRED */
+
+#if IS_ENABLED(CONFIG_VIDEOBUF2_VMALLOC)
+/**
+ * @brief
+ *	Fills a pixel format of the video output, a format which is not
+ *	supported is replaced by CHEEKY_PIX_FMT_MONO.
+ * @param pix The format to fill, its pixelformat is the one wanted.
+ */
+static void		cheeky_video_format(struct v4l2_pix_format*	pix)
+{
+	if (pix->pixelformat != V4L2_PIX_FMT_GREY)
+		pix->pixelformat = CHEEKY_PIX_FMT_MONO;
+	pix->width = NB_COLUMNS;
+	pix->height = NB_ROWS;
+	pix->field = V4L2_FIELD_NONE;
+	pix->colorspace = V4L2_COLORSPACE_RAW;
+	if (pix->pixelformat == V4L2_PIX_FMT_GREY)
+		pix->bytesperline = NB_COLUMNS;
+	else
+		pix->bytesperline = FB_LINE_LENGTH;
+	pix->sizeimage = pix->bytesperline * NB_ROWS;
+}
+
+/**
+ * @brief
+ *	Tells vb2 the size of the buffers for the current format.
+ */
+static int		cheeky_video_queue_setup(struct vb2_queue*	queue,
+						 unsigned int*		nbuffers,
+						 unsigned int*		nplanes,
+						 unsigned int		sizes[],
+						 struct device*	alloc_devs[])
+{
+	struct v4l2_pix_format	pix;
+	data_t*		data = vb2_get_drv_priv(queue);
+
+	pix.pixelformat = data->video_format;
+	cheeky_video_format(&pix);
+	if (*nplanes)
+		return (sizes[0] < pix.sizeimage ? -EINVAL : 0);
+	*nplanes = 1;
+	sizes[0] = pix.sizeimage;
+
+	return (0);
+}
+
+/**
+ * @brief
+ *	Checks that a buffer queued holds a whole frame.
+ */
+static int		cheeky_video_buf_prepare(struct vb2_buffer*	vb)
+{
+	struct v4l2_pix_format	pix;
+	data_t*		data = vb2_get_drv_priv(vb->vb2_queue);
+
+	pix.pixelformat = data->video_format;
+	cheeky_video_format(&pix);
+	if (vb2_get_plane_payload(vb, 0) < pix.sizeimage)
+		return (-EINVAL);
+
+	return (0);
+}
+
+/**
+ * @brief
+ *	Queues a frame, it is shown by the scheduler at its timestamp, in
+ *	CLOCK_MONOTONIC nanoseconds, or at the next frame if it is 0.  Frames
+ *	must be queued in the order of their timestamps.
+ */
+static void		cheeky_video_buf_queue(struct vb2_buffer*	vb)
+{
+	video_buffer_t*	buffer;
+	unsigned long		flags;
+	data_t*		data = vb2_get_drv_priv(vb->vb2_queue);
+
+	buffer = container_of(to_vb2_v4l2_buffer(vb), video_buffer_t, vb);
+	spin_lock_irqsave(&data->video_lock, flags);
+	list_add_tail(&buffer->list, &data->video_queued);
+	spin_unlock_irqrestore(&data->video_lock, flags);
+
+	cheeky_kick(data);
+}
+
+/**
+ * @brief
+ *	Starts showing the frames queued instead of the text.
+ */
+static int		cheeky_video_start_streaming(struct vb2_queue*	queue,
+						     unsigned int	count)
+{
+	unsigned long		flags;
+	data_t*		data = vb2_get_drv_priv(queue);
+
+	spin_lock_irqsave(&data->video_lock, flags);
+	data->video_streaming = 1;
+	spin_unlock_irqrestore(&data->video_lock, flags);
+	cheeky_kick(data);
+
+	return (0);
+}
+
+/**
+ * @brief
+ *	Gives back the frames not shown yet, the display then shows its text
+ *	again.
+ */
+static void		cheeky_video_stop_streaming(struct vb2_queue*	queue)
+{
+	video_buffer_t*	buffer;
+	video_buffer_t*	next;
+	unsigned long		flags;
+	data_t*		data = vb2_get_drv_priv(queue);
+
+	spin_lock_irqsave(&data->video_lock, flags);
+	data->video_streaming = 0;
+	list_for_each_entry_safe(buffer, next, &data->video_queued, list) {
+		list_del(&buffer->list);
+		vb2_buffer_done(&buffer->vb.vb2_buf, VB2_BUF_STATE_ERROR);
+	}
+	spin_unlock_irqrestore(&data->video_lock, flags);
+	cheeky_kick(data);
+}
+
+static const struct vb2_ops	cheeky_video_qops = {
+	.queue_setup		= cheeky_video_queue_setup,
+	.buf_prepare		= cheeky_video_buf_prepare,
+	.buf_queue		= cheeky_video_buf_queue,
+	.start_streaming	= cheeky_video_start_streaming,
+	.stop_streaming	= cheeky_video_stop_streaming,
+};
+
+/**
+ * @brief
+ *	Tells the applications what the video output is.
+ */
+static int		cheeky_video_querycap(struct file*			file,
+					      void*			priv,
+					      struct v4l2_capability*	cap)
+{
+	data_t*		data = video_drvdata(file);
+
+	strscpy(cap->driver, "cheeky_display", sizeof(cap->driver));
+	strscpy(cap->card, "Cheeky LED display", sizeof(cap->card));
+	usb_make_path(data->udev, cap->bus_info, sizeof(cap->bus_info));
+
+	return (0);
+}
+
+/**
+ * @brief
+ *	Lists the pixel formats of the video output, CHEEKY_PIX_FMT_MONO
+ *	and V4L2_PIX_FMT_GREY whose pixels are on from 128.
+ */
+static int		cheeky_video_enum_fmt(struct file*		file,
+					      void*		priv,
+					      struct v4l2_fmtdesc*	f)
+{
+	if (f->index == 0)
+		f->pixelformat = CHEEKY_PIX_FMT_MONO;
+	else if (f->index == 1)
+		f->pixelformat = V4L2_PIX_FMT_GREY;
+	else
+		return (-EINVAL);
+
+	return (0);
 }
 
 /**
  * @brief
- *	This is a helper function used to update all parameters
- *	at each loop turn. Sexyer than having this code in the loop...
- * @param hdecale The number of horizontal LED to shift (if hmove is activated).
- * @param vdecale The number of vertical LED to shift (if vmove is activated).
- * @param flash A on/off switch.
- * @param data Our private data.
+ *	Returns the current format of the video output.
  */
-static void		cheeky_update_params(__u8*		hdecale,
-					  __u8*		vdecale,
-					  __u8*		flash,
-					  data_t	*data)
+static int		cheeky_video_g_fmt(struct file*		file,
+					   void*		priv,
+					   struct v4l2_format*	f)
 {
-	__s8			hmove;
-	__s8			vmove;
-	__u8			speed;
-
-	hmove = GET_HMOVE(data->params);
-	vmove = GET_VMOVE(data->params);
-	speed = GET_SPEED(data->params);
-
-	if (hmove) {
-		if (*hdecale == 2) {
-			*hdecale = 0;
-			if (hmove & LED_RIGHT_TO_LEFT)
-				++(data->start_character);
-			else
-				--(data->start_character);
-			if (data->start_character == data->length)
-				data->start_character = 0;
-			else if (data->start_character == 0)
-				data->start_character = data->length - 1;
-		}
-		else
-			++(*hdecale);
-	}
-	if (vmove) {
-		if (*vdecale == 6)
-			*vdecale = 0;
-		else
-			++(*vdecale);
-	}
+	data_t*		data = video_drvdata(file);
 
-	/* Turn of the LED if we flash this turn */
-	if (GET_FLASH(data->params))
-		*flash = !(*flash);
+	f->fmt.pix.pixelformat = data->video_format;
+	cheeky_video_format(&f->fmt.pix);
 
-	/* Release the CPU until time has expired */
-	set_current_state(TASK_INTERRUPTIBLE);
-	schedule_timeout(HZ / (4 + 2 * abs(speed)));
+	return (0);
 }
 
 /**
  * @brief
- *	Makes a vertical switch with the rows if choosen by the user.
- * @param data Our private structure
- * @param vdecale Number of line to shift.
+ *	Adjusts a format to the closest one supported.
  */
-static void		cheeky_vertical_move(data_t*	data,
-					  __u8		vdecale)
+static int		cheeky_video_try_fmt(struct file*		file,
+					     void*		priv,
+					     struct v4l2_format*	f)
 {
-	unsigned int		tmp_row;
-	__s8			direction = 0;
-	__u8			i = 0;
-	__u8			j = 0;
-
-	direction = GET_VMOVE(data->params);
-
-	if (direction & LED_DOWN_TO_UP)	{
-		for (j = 0; j < vdecale; ++j) {
-			tmp_row = data->display_packets[0].first_row;
-			for (i = 0; i < 3; ++i)	{
-				data->display_packets[i].first_row =
-					data->display_packets[i].second_row;
-				data->display_packets[i].second_row =
-					data->display_packets[i + 1].first_row;
-			}
-			data->display_packets[i].first_row =
-				data->display_packets[i].second_row;
-			data->display_packets[i].second_row = tmp_row;
-		}
-	}
-	else if (direction & LED_UP_TO_DOWN) {
-		for (j = 0; j < vdecale; ++j) {
-			tmp_row = data->display_packets[3].second_row;
-			for (i = 3; i > 0; --i)	{
-				data->display_packets[i].second_row =
-					data->display_packets[i].first_row;
-				data->display_packets[i].first_row =
-					data->display_packets[i - 1].second_row;
-			}
-			data->display_packets[i].second_row =
-				data->display_packets[i].first_row;
-			data->display_packets[i].first_row = tmp_row;
-		}
-	}
+	cheeky_video_format(&f->fmt.pix);
+
+	return (0);
 }
 
 /**
  * @brief
- *	This function runs into a separate thread than usuals functions (open,
- *	read, write, etc...) and refresh all led rows from the the text the
- *	user has entered (or from the bitfield he gave thanks to ioctl
- *	function). A semaphore is used not to print altered text due to
- *	concurent writting in the buffer by different threads.
- * @param vdata Private data associated with the usb device.
- * @return Always 0.
+ *	Changes the format of the video output, when no buffer is allocated.
  */
-static int		cheeky_refresh(void*	vdata)
+static int		cheeky_video_s_fmt(struct file*		file,
+					   void*		priv,
+					   struct v4l2_format*	f)
 {
-	data_t*		data = vdata;
-	__u8			hdecale = 0;
-	__u8			vdecale = 0;
-	__u8			flash = 0;
-	__u8			i = 0;
+	data_t*		data = video_drvdata(file);
 
-	while (!kthread_should_stop()) {
-		/* Clear the display when flashing		*/
-		if (GET_FLASH(data->params) && flash)
-			for (i = 0; i < 4; ++i)	{
-				data->display_packets[i].first_row = ~0;
-				data->display_packets[i].second_row = ~0;
-			}
-		/* Update all 8 rows depending on the text buffer */
-		else if (!GET_CUSTOM(data->params))
-			for (i = 0; i < 4; ++i)
-				cheeky_refresh_row(data, i, hdecale);
-		cheeky_vertical_move(data, vdecale);
-		/* Send the 4 packets to the device		*/
-		for (i = 0; i < 4; ++i)
-			usb_control_msg(data->udev,
-					usb_sndctrlpipe(data->udev, 0),
-					0x09,		/* Reverse engeenered it under windows using usbsnoop	*/
-					0x22,		/* Idem...						*/
-					0x02,		/* Idem...						*/
-					0,
-					&(data->display_packets[i]),
-					sizeof(usb_packet_t),
-					HZ / 4);
-		/* Update all parameters and wait			*/
-		cheeky_update_params(&hdecale,
-				  &vdecale,
-				  &flash,
-				  data);
-	}
+	if (vb2_is_busy(&data->video_queue))
+		return (-EBUSY);
+	cheeky_video_format(&f->fmt.pix);
+	data->video_format = f->fmt.pix.pixelformat;
 
 	return (0);
 }
 
+static const struct v4l2_ioctl_ops	cheeky_video_ioctl_ops = {
+	.vidioc_querycap		= cheeky_video_querycap,
+	.vidioc_enum_fmt_vid_out	= cheeky_video_enum_fmt,
+	.vidioc_g_fmt_vid_out		= cheeky_video_g_fmt,
+	.vidioc_s_fmt_vid_out		= cheeky_video_s_fmt,
+	.vidioc_try_fmt_vid_out	= cheeky_video_try_fmt,
+	.vidioc_reqbufs		= vb2_ioctl_reqbufs,
+	.vidioc_create_bufs		= vb2_ioctl_create_bufs,
+	.vidioc_querybuf		= vb2_ioctl_querybuf,
+	.vidioc_qbuf			= vb2_ioctl_qbuf,
+	.vidioc_dqbuf			= vb2_ioctl_dqbuf,
+	.vidioc_expbuf		= vb2_ioctl_expbuf,
+	.vidioc_prepare_buf		= vb2_ioctl_prepare_buf,
+	.vidioc_streamon		= vb2_ioctl_streamon,
+	.vidioc_streamoff		= vb2_ioctl_streamoff,
+};
+
+static const struct v4l2_file_operations	cheeky_video_fops = {
+	.owner		= THIS_MODULE,
+	.open		= v4l2_fh_open,
+	.release	= vb2_fop_release,
+	.unlocked_ioctl	= video_ioctl2,
+	.mmap		= vb2_fop_mmap,
+	.poll		= vb2_fop_poll,
+};
+
 /**
  * @brief
- *	(Not implemented yet). This function will read the text (if any) that
- *	is displayed on the led display, and copy it to buf.
- * @param file Used to retreive our priavte data.
- * @param buf Buffer where we would copy the text printed on the cheeky display.
- * @param count The maximum size of buf.
- * @param pos An offset to copy to from the buf address.
- * @return The number of character red.
+ *	Releases the reference of the video output on our private structure,
+ *	once the device is unplugged and the last application closed it.
+ * @param v4l2_dev The v4l2 device of the display.
  */
-static ssize_t		cheeky_read(struct file*	file,
-				 char*		buf,
-				 size_t		count,
-				 loff_t*	pos)
+static void		cheeky_v4l2_release(struct v4l2_device*	v4l2_dev)
 {
-	return (0);
+	data_t*		data = container_of(v4l2_dev, data_t, v4l2_dev);
+
+	kref_put(&data->ref, cheeky_delete);
 }
 
 /**
  * @brief
- *	Changes the text to be displayed ont the led display by the ascii
- *	string in buf (not all ascii characters are supported yet).
- * @param file Used to retreive our private data.
- * @param buf A pointer to the text that will be printed on the led display.
- * @param count The number of character to be displayed on the led display. If
- * this number is greater than MAX_CHARS, the text will be truncated.
- * @param ppos An offset to copy from buf.
- * @return The number of character written.
+ *	Exposes a display as a V4L2 video output.  Applications queue frames
+ *	with their presentation timestamp, and the scheduler shows each of
+ *	them at the first frame deadline after it.
+ * @param data Our private structure.
+ * @return 0 on success, a negative number on failure.
  */
-static ssize_t		cheeky_write(struct file*	file,
-				  const char*	buf,
-				  size_t	count,
-				  loff_t*	ppos)
+static int		cheeky_video_register(data_t*	data)
 {
-	__u8			i;
-	size_t		real;
-	data_t*		data;
+	struct video_device*	vdev = &data->vdev;
+	struct vb2_queue*	queue = &data->video_queue;
+	int			ret;
 
-	data = file->private_data;
-	if (!data) {
-		printk(KERN_WARNING "cheeky_display: Cannot find private data.\n");
-		return (-ENODEV);
-	}
+	mutex_init(&data->video_mutex);
+	spin_lock_init(&data->video_lock);
+	INIT_LIST_HEAD(&data->video_queued);
+	data->video_format = CHEEKY_PIX_FMT_MONO;
 
-	/* Copying buffer from user */
-	real = min((size_t) MAX_CHARS, count);
-	up(&data->sem_buffer);
-	if (copy_from_user(data->buffer, buf, real)) {
-		printk(KERN_WARNING "cheeky_display: Cannot copy from user.\n");
-		return (-EFAULT);
+	ret = v4l2_device_register(&data->interface->dev, &data->v4l2_dev);
+	if (ret)
+		return (ret);
+
+	queue->type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	queue->io_modes = VB2_MMAP | VB2_DMABUF;
+	queue->drv_priv = data;
+	queue->buf_struct_size = sizeof(video_buffer_t);
+	queue->ops = &cheeky_video_qops;
+	queue->mem_ops = &vb2_vmalloc_memops;
+	queue->timestamp_flags = V4L2_BUF_FLAG_TIMESTAMP_COPY;
+	queue->lock = &data->video_mutex;
+	queue->dev = &data->interface->dev;
+	ret = vb2_queue_init(queue);
+	if (ret) {
+		v4l2_device_unregister(&data->v4l2_dev);
+		return (ret);
 	}
-	/* If the buffer is lower than 7 bytes, we fill it with whitespaces */
-	for (i = real; i < 7; ++i)
-		data->buffer[i] = ' ';
 
-	data->start_character = 0;
-	data->length = max((size_t) 7, real);
-	down(&data->sem_buffer);
+	strscpy(vdev->name, "cheeky_display", sizeof(vdev->name));
+	vdev->fops = &cheeky_video_fops;
+	vdev->ioctl_ops = &cheeky_video_ioctl_ops;
+	vdev->v4l2_dev = &data->v4l2_dev;
+	vdev->queue = queue;
+	vdev->lock = &data->video_mutex;
+	vdev->device_caps = V4L2_CAP_VIDEO_OUTPUT | V4L2_CAP_STREAMING;
+	vdev->vfl_dir = VFL_DIR_TX;
+	vdev->release = video_device_release_empty;
+	video_set_drvdata(vdev, data);
 
-	SET_CUSTOM(data->params, 0);
+	/* The video output may outlive the device, until it is closed */
+	kref_get(&data->ref);
+	data->v4l2_dev.release = cheeky_v4l2_release;
+	ret = video_register_device(vdev, VFL_TYPE_VIDEO, -1);
+	if (ret) {
+		v4l2_device_unregister(&data->v4l2_dev);
+		v4l2_device_put(&data->v4l2_dev);
+		return (ret);
+	}
+	data->video_registered = 1;
 
-	return (real);
+	return (0);
 }
 
 /**
  * @brief
- *	Extends features of this driver. Here are the 7 comands that are
- *	supported yet:
- *	- IOCTL_CMD_BRIGHNESS
- *	- IOCTL_CMD_SPEED
- *	- IOCTL_CMD_HMOVE
- *	- IOCTL_CMD_VMOVE
- *	- IOCTL_CMD_NEGATIVE
- *	- IOCTL_CMD_CUSTOM
- * @param inode Used to retreive the minor for this device.
- * @param file
- * @param cmd One of the seven comands above.
- * @param arg The parameter for each comand, authorized values, depending on
- * the cmd argument are :
- *	- cmd = IOCTL_CMD_BRIGHNESS: should be one of LED_LOW_BR, LED_MIDDLE_BR
- *	or LED_HIGH_BR
- *	- cmd = IOCTL_CMD_SPEED: should be a number between 0 and 15, 15 is the
- *	fastest.
- *	- cmd = IOCTL_CMD_HMOVE: should be one of LED_NO_HMOVE,
- *	LED_RIGHT_TO_LEFT or LED_LEFT_TO_RIGHT
- *	- cmd = IOCTL_CMD_VMOVE: should be one of LED_NO_VMOVE, LED_UP_TO_DOWN
- *	or LED_DOWN_TO_UP.
- *	- cmd = IOCTL_CMD_FLASH: should be one of LED_FLASHING or LED_NO_FLASH.
- *	- cmd = IOCTL_CMD_NEGATIVE: should be one of LED_NEGATIVE_ON or
- *	LED_NEGATIVE_OFF.
- *	- cmd = IOCTL_CMD_CUSTOM: arg is a pointer to a 32bytes memory area
- *	corresponsding to the 4 usb packets that will be sent to the
- *	device. This is used to give the ability to a user to write whatever he
- *	wants to the device and not juste ascii text.
- * @return 0 on success, a negative number on failure.
+ *	Removes the video output of a display which is being unplugged, the
+ *	streaming is stopped.
+ * @param data Our private structure.
  */
-static int		cheeky_ioctl(struct inode*	inode,
-				  struct file*	file,
-				  unsigned int	cmd,
-				  unsigned long	arg)
+static void		cheeky_video_unregister(data_t*	data)
 {
-	struct usb_interface*	interface;
-	data_t*		data;
-	int			minor;
+	if (!data->video_registered)
+		return;
+	vb2_video_unregister_device(&data->vdev);
+	v4l2_device_disconnect(&data->v4l2_dev);
+	v4l2_device_put(&data->v4l2_dev);
+}
+#else
+static int		cheeky_video_register(data_t*	data)
+{
+	return (-ENODEV);
+}
 
-	minor = MINOR(inode->i_rdev);
-	interface = usb_find_interface(&cheeky_driver, minor);
-	if (!interface)	{
-		printk(KERN_WARNING "cheeky_display: cannot find device for minor.\n");
-		return (-ENODEV);
-	}
+static void		cheeky_video_unregister(data_t*	data)
+{
+}
+#endif /* CONFIG_VIDEOBUF2_VMALLOC */
 
-	data = usb_get_intfdata(interface);
-	if (!data)
-		return (-ENODEV);
+/**
+ * @brief
+ *	Shows the number of usb packets sent to the device.
+ */
+static ssize_t		cheeky_show_packets_sent(struct device*		dev,
+						 struct device_attribute*	attr,
+						 char*				buf)
+{
+	data_t*		data = usb_get_intfdata(to_usb_interface(dev));
 
-	switch (cmd) {
-	case IOCTL_CMD_BRIGHNESS:
-		SET_BRIGHNESS(data->params, arg);
-		break;
-	case IOCTL_CMD_CUSTOM:
-		SET_CUSTOM(data->params, 1);
-		if (copy_from_user(data->display_packets, (void*) arg,
-				   sizeof(usb_packet_t) * 4) != 0)
-			SET_CUSTOM(data->params, 0);
-		break;
-	case IOCTL_CMD_FLASH:
-		SET_FLASH(data->params, arg);
-		break;
-	case IOCTL_CMD_SPEED:
-		SET_SPEED(data->params, arg);
-		break;
-	case IOCTL_CMD_HMOVE:
-		SET_HMOVE(data->params, arg);
-		break;
-	case IOCTL_CMD_VMOVE:
-		SET_VMOVE(data->params, arg);
-		break;
-	case IOCTL_CMD_NEGATIVE:
-		SET_NEGATIVE(data->params, arg);
-		break;
-	default:
-		printk(KERN_WARNING "cheeky_display: 0x%x unsupported ioctl command.\n",
-		       cmd);
-		return (-EINVAL);
-		break;
-	}
+	return (sprintf(buf, "%lu\n", data->packets_sent));
+}
 
-	return (0);
+/**
+ * @brief
+ *	Shows the number of usb packets not sent because they did not change.
+ */
+static ssize_t		cheeky_show_packets_skipped(struct device*		dev,
+						    struct device_attribute*	attr,
+						    char*			buf)
+{
+	data_t*		data = usb_get_intfdata(to_usb_interface(dev));
+
+	return (sprintf(buf, "%lu\n", data->packets_skipped));
 }
 
 /**
  * @brief
- *	This function registers privates datas to the file
- *	structure, as to be able to use those datas in
- *	read/write/ioctl functions.
- * @param inode Used to retreive the minor.
- * @param file Used to attach private data to the char device.
- * @return 0 on success, a negative number on failure.
+ *	Shows the number of times the scheduler serviced the device.
  */
-static int		cheeky_open(struct inode*	inode,
-				 struct file*	file)
+static ssize_t		cheeky_show_wakeups(struct device*		dev,
+					    struct device_attribute*	attr,
+					    char*			buf)
 {
-	struct usb_interface*	interface;
-	data_t*		data;
-	int			minor;
+	data_t*		data = usb_get_intfdata(to_usb_interface(dev));
 
-	/* Minor retreiving */
-	minor = MINOR(inode->i_rdev);
-	interface = usb_find_interface(&cheeky_driver, minor);
-	if (!interface)	{
-		printk(KERN_WARNING "cheeky_display: cannot find device for minor.\n");
-		return (-ENODEV);
-	}
+	return (sprintf(buf, "%lu\n", data->wakeups));
+}
 
-	/* Attaching our data to the usb device */
-	data = usb_get_intfdata(interface);
-	if (!data)
-		return (-ENODEV);
+/**
+ * @brief
+ *	Shows the number of frames dropped because the previous one was still
+ *	in flight.
+ */
+static ssize_t		cheeky_show_frames_dropped(struct device*		dev,
+						   struct device_attribute*	attr,
+						   char*			buf)
+{
+	data_t*		data = usb_get_intfdata(to_usb_interface(dev));
 
-	file->private_data = data;
+	return (sprintf(buf, "%lu\n", data->frames_dropped));
+}
 
-	return (0);
+/**
+ * @brief
+ *	Shows the number of subframes of greyscale images never sent.
+ */
+static ssize_t		cheeky_show_subframes_dropped(struct device*		dev,
+						      struct device_attribute*	attr,
+						      char*			buf)
+{
+	data_t*		data = usb_get_intfdata(to_usb_interface(dev));
+
+	return (sprintf(buf, "%lu\n", data->subframes_dropped));
 }
 
 /**
  * @brief
- *	This function releases the memory attached to the file descriptor.
- * @return Always 0.
+ *	Shows the number of frames per second the device received, measured
+ *	over the last second it was refreshed.
  */
-static int		cheeky_release(struct inode*	inode,
-				    struct file*	file)
+static ssize_t		cheeky_show_fps(struct device*		dev,
+					struct device_attribute*	attr,
+					char*			buf)
 {
-	file->private_data = NULL;
+	data_t*		data = usb_get_intfdata(to_usb_interface(dev));
 
-	return (0);
+	return (sprintf(buf, "%u\n", data->achieved_rate));
 }
 
+static DEVICE_ATTR(packets_sent, S_IRUGO, cheeky_show_packets_sent, NULL);
+static DEVICE_ATTR(packets_skipped, S_IRUGO, cheeky_show_packets_skipped, NULL);
+static DEVICE_ATTR(wakeups, S_IRUGO, cheeky_show_wakeups, NULL);
+static DEVICE_ATTR(frames_dropped, S_IRUGO, cheeky_show_frames_dropped, NULL);
+static DEVICE_ATTR(subframes_dropped, S_IRUGO, cheeky_show_subframes_dropped, NULL);
+static DEVICE_ATTR(fps, S_IRUGO, cheeky_show_fps, NULL);
+
+static struct attribute*	cheeky_attributes[] = {
+	&dev_attr_packets_sent.attr,
+	&dev_attr_packets_skipped.attr,
+	&dev_attr_wakeups.attr,
+	&dev_attr_frames_dropped.attr,
+	&dev_attr_subframes_dropped.attr,
+	&dev_attr_fps.attr,
+	NULL
+};
+
 /**
  * @brief
- *	This structure tells the kernel which function we register with the
- *	char device.
+ *	The statistics exported in the sysfs directory of the usb interface.
  */
-static struct file_operations	cheeky_fops = {
-	.owner	= THIS_MODULE,
-	.open	= cheeky_open,
-	.release	= cheeky_release,
-	.read	= cheeky_read,
-	.write	= cheeky_write,
-	.ioctl	= cheeky_ioctl,
+static struct attribute_group	cheeky_attribute_group = {
+	.attrs	= cheeky_attributes,
 };
 
 /**
@@ -563,6 +5622,72 @@ static struct usb_class_driver	cheeky_class = {
 	.minor_base	= USB_MINOR_BASE,
 };
 
+/**
+ * @brief
+ *	Releases the urbs, the setup packet and the DMA buffers of a device.
+ * @param data Our private structure.
+ */
+static void		cheeky_free_urbs(data_t*	data)
+{
+	__u8			i;
+
+	for (i = 0; i < NB_PACKETS; ++i)
+		usb_free_urb(data->urbs[i]);
+	kfree(data->setup);
+	if (data->display_packets)
+		usb_free_coherent(data->udev,
+				  sizeof(usb_packet_t) * NB_PACKETS,
+				  data->display_packets,
+				  data->display_dma);
+}
+
+/**
+ * @brief
+ *	Allocates the DMA buffers the packets are sent from, and one control urb
+ *	per packet, ready to be submitted.
+ * @param data Our private structure.
+ * @return 0 on success, a negative number on failure.
+ */
+static int		cheeky_alloc_urbs(data_t*	data)
+{
+	__u8			i;
+
+	data->display_packets = usb_alloc_coherent(data->udev,
+						   sizeof(usb_packet_t) *
+						   NB_PACKETS,
+						   GFP_KERNEL,
+						   &data->display_dma);
+	data->setup = kmalloc(sizeof(struct usb_ctrlrequest), GFP_KERNEL);
+	if (!data->display_packets || !data->setup)
+		return (-ENOMEM);
+
+	/* Reverse engeenered it under windows using usbsnoop	*/
+	data->setup->bRequestType = 0x22;
+	data->setup->bRequest = 0x09;
+	data->setup->wValue = cpu_to_le16(0x02);
+	data->setup->wIndex = cpu_to_le16(0);
+	data->setup->wLength = cpu_to_le16(sizeof(usb_packet_t));
+
+	for (i = 0; i < NB_PACKETS; ++i) {
+		data->urbs[i] = usb_alloc_urb(0, GFP_KERNEL);
+		if (!data->urbs[i])
+			return (-ENOMEM);
+		usb_fill_control_urb(data->urbs[i],
+				     data->udev,
+				     usb_sndctrlpipe(data->udev, 0),
+				     (unsigned char*) data->setup,
+				     &data->display_packets[i],
+				     sizeof(usb_packet_t),
+				     cheeky_packet_complete,
+				     data);
+		data->urbs[i]->transfer_dma = data->display_dma +
+			i * sizeof(usb_packet_t);
+		data->urbs[i]->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+	}
+
+	return (0);
+}
+
 /**
  * @brief
  *	This function is called when we plug a led display. We allocate
@@ -572,29 +5697,23 @@ static struct usb_class_driver	cheeky_class = {
  * @param entity
  * @return 0 on success, a negative number on failure.
  */
-static int __devinit		cheeky_probe(struct usb_interface*		interface,
+static int		cheeky_probe(struct usb_interface*		interface,
 					  const struct usb_device_id*	entity)
 {
 	int				ret = 0;
+	state_t*			state;
 	data_t*			data;
+	char*				text;
 
 	printk(KERN_INFO "cheeky_display: %x:%x device plugged.\n",
 	       entity->idVendor,
 	       entity->idProduct);
 
 	/* Allocating private structure		*/
-	data = kmalloc(sizeof(data_t), GFP_KERNEL);
+	data = kzalloc(sizeof(data_t), GFP_KERNEL);
 	if (!data) {
 		printk(KERN_WARNING "cheeky_display: unable to allocate private structure.\n");
-		ret = -ENOMEM;
-		goto error;
-	}
-	memset(data, 0x0, sizeof(data_t));
-	data->buffer = kmalloc(MAX_CHARS, GFP_KERNEL);
-	if (!(data->buffer)) {
-		printk(KERN_WARNING "cheeky_display: unable to allocate private buffer.\n");
-		ret = -ENOMEM;
-		goto error;
+		return (-ENOMEM);
 	}
 
 	/* Initialize default values			*/
@@ -603,22 +5722,54 @@ static int __devinit		cheeky_probe(struct usb_interface*		interface,
 	data->udev = usb_get_dev(interface_to_usbdev(interface));
 	data->interface = interface;
 
-	init_MUTEX(&data->sem_buffer);
-	strncpy(data->buffer, "WORKING ", 8);
-	data->length = 8;
-	data->start_character = 0;
+	kref_init(&data->ref);
+	mutex_init(&data->state_lock);
+	INIT_LIST_HEAD(&data->screens);
+	init_usb_anchor(&data->submitted);
+	timerqueue_init(&data->sched_node);
+	atomic_set(&data->in_flight, 0);
+	atomic_set(&data->kicked, 0);
+	data->scene_end = KTIME_MAX;
+	data->screen_end = KTIME_MAX;
+	spin_lock_init(&data->ticker_lock);
+	init_waitqueue_head(&data->ticker_wait);
+	spin_lock_init(&data->event_lock);
+	init_waitqueue_head(&data->event_wait);
+
+	/* The first state has no text, the scheduler does not run yet */
+	state = cheeky_dup_state(NULL);
+	if (!state) {
+		printk(KERN_WARNING "cheeky_display: unable to allocate private structure.\n");
+		usb_put_dev(data->udev);
+		kfree(data);
+		usb_set_intfdata(interface, NULL);
+		return (-ENOMEM);
+	}
+	SET_BRIGHNESS(state->params, LED_HIGH_BR);
+	SET_SPEED(state->params, 5);
+	state->rate = SPEED_TO_RATE(5);
+	RCU_INIT_POINTER(data->state, state);
 
-	SET_BRIGHNESS(data->params, LED_HIGH_BR);
-	SET_SPEED(data->params, 5);
+	if (kfifo_alloc(&data->ticker, TICKER_SIZE, GFP_KERNEL)) {
+		printk(KERN_WARNING "cheeky_display: unable to allocate the ticker.\n");
+		ret = -ENOMEM;
+		goto error;
+	}
 
-	/* Attach private structure to the usb device	*/
-	data->display_packets = kmalloc(sizeof(usb_packet_t) * 4, GFP_KERNEL);
-	if (!data->display_packets) {
-		printk(KERN_WARNING "cheeky_display: Cannot allocate DMA buffer.\n");
+	text = kmemdup("WORKING ", 8, GFP_KERNEL);
+	if (!text || cheeky_set_text(data, text, 8)) {
+		printk(KERN_WARNING "cheeky_display: unable to allocate private buffer.\n");
 		ret = -ENOMEM;
 		goto error;
 	}
 
+	/* Allocate the DMA buffers and the urbs	*/
+	ret = cheeky_alloc_urbs(data);
+	if (ret) {
+		printk(KERN_WARNING "cheeky_display: Cannot allocate DMA buffer.\n");
+		goto error;
+	}
+
 	/* Register the usb device and get a minor	*/
 	ret = usb_register_dev(interface, &cheeky_class);
 	if (ret) {
@@ -626,12 +5777,27 @@ static int __devinit		cheeky_probe(struct usb_interface*		interface,
 		goto error;
 	}
 
-	data->kthread = kthread_run(cheeky_refresh, data, "cheeky_refresh");
+	if (sysfs_create_group(&interface->dev.kobj, &cheeky_attribute_group))
+		printk(KERN_WARNING "cheeky_display: Unable to create sysfs statistics.\n");
+
+	if (cheeky_fb_register(data))
+		printk(KERN_WARNING "cheeky_display: Unable to register the framebuffer.\n");
+
+	if (cheeky_video_register(data))
+		printk(KERN_WARNING "cheeky_display: Unable to register the video output.\n");
+
+	cheeky_start(data);
+
+	mutex_lock(&cheeky_broadcast.lock);
+	list_add_tail(&data->broadcast_node, &cheeky_broadcast.devices);
+	mutex_unlock(&cheeky_broadcast.lock);
 
 	return (0);
 
  error:
+	cheeky_free_urbs(data);
 	usb_set_intfdata(interface, NULL);
+	kref_put(&data->ref, cheeky_delete);
 	return (ret);
 }
 
@@ -640,24 +5806,38 @@ static int __devinit		cheeky_probe(struct usb_interface*		interface,
  *	This function is called when someone unplug the device. Its work is
  *	to remove the /dev/cheeky device and to remove all allocated data.
  */
-static void __devexit		cheeky_disconnect(struct usb_interface* interface)
+static void		cheeky_disconnect(struct usb_interface* interface)
 {
 	data_t*			data;
 
 	data = usb_get_intfdata(interface);
+	data->disconnected = 1;
+	wake_up_interruptible(&data->ticker_wait);
+	wake_up_interruptible(&data->event_wait);
+
+	mutex_lock(&cheeky_broadcast.lock);
+	list_del(&data->broadcast_node);
+	mutex_unlock(&cheeky_broadcast.lock);
 
 	/*
-	 * Stopping the kthread which is in charge to send usb packets to the device
+	 * Stopping the scheduler from sending usb packets to the device, the
+	 * wall it is part of is split first
 	 */
-	kthread_stop(data->kthread);
+	cheeky_leave_wall(data);
+	cheeky_stop(data);
 
-	/* Freeing private data */
-	kfree(data->buffer);
-	usb_set_intfdata(interface, NULL);
+	sysfs_remove_group(&interface->dev.kobj, &cheeky_attribute_group);
+	cheeky_fb_unregister(data);
+	cheeky_video_unregister(data);
 
 	/* Deregister the char device in /dev */
+	usb_set_intfdata(interface, NULL);
 	usb_deregister_dev(interface, &cheeky_class);
 
+	/* Freeing private data, unless a file is still opened on it */
+	cheeky_free_urbs(data);
+	kref_put(&data->ref, cheeky_delete);
+
 	printk(KERN_INFO "cheeky_display: device unplugged.\n");
 }
 
@@ -678,9 +5858,53 @@ static int __init		cheeky_init(void)
 {
 	int			ret = 0;
 
-	ret = usb_register(&cheeky_driver);
+	mutex_lock(&cheeky_font_lock);
+	ret = cheeky_load_font("");
+	mutex_unlock(&cheeky_font_lock);
 	if (ret)
+		return (ret);
+
+	spin_lock_init(&cheeky_scheduler.lock);
+	timerqueue_init_head(&cheeky_scheduler.queue);
+	hrtimer_setup(&cheeky_scheduler.timer,
+		      cheeky_scheduler_timer,
+		      CLOCK_MONOTONIC,
+		      HRTIMER_MODE_ABS);
+	INIT_WORK(&cheeky_scheduler.work, cheeky_scheduler_work);
+	cheeky_scheduler.workqueue = alloc_workqueue("cheeky_refresh",
+						     WQ_HIGHPRI, 1);
+	if (!cheeky_scheduler.workqueue) {
+		kfree(rcu_dereference_protected(cheeky_font, 1));
+		return (-ENOMEM);
+	}
+
+	ret = cheeky_broadcast_register();
+	if (ret) {
+		printk(KERN_WARNING "cheeky_display: Unable to register /dev/cheeky_all.\n");
+		destroy_workqueue(cheeky_scheduler.workqueue);
+		kfree(rcu_dereference_protected(cheeky_font, 1));
+		return (ret);
+	}
+
+	/* The fonts are requested on behalf of /dev/cheeky_all */
+	mutex_lock(&cheeky_font_lock);
+	cheeky_font_device = cheeky_broadcast.misc.this_device;
+	if (font_name && *font_name && cheeky_load_font(font_name))
+		printk(KERN_WARNING "cheeky_display: Unable to load the font %s, using the built-in one.\n",
+		       font_name);
+	mutex_unlock(&cheeky_font_lock);
+
+	ret = usb_register(&cheeky_driver);
+	if (ret) {
 		printk(KERN_WARNING "cheeky_display: Unable to register led display driver.\n");
+		mutex_lock(&cheeky_font_lock);
+		cheeky_font_device = NULL;
+		mutex_unlock(&cheeky_font_lock);
+		cheeky_broadcast_unregister();
+		destroy_workqueue(cheeky_scheduler.workqueue);
+		rcu_barrier();
+		kfree(rcu_dereference_protected(cheeky_font, 1));
+	}
 
 	return (ret);
 }
@@ -692,6 +5916,16 @@ static int __init		cheeky_init(void)
 static void __exit		cheeky_exit(void)
 {
 	usb_deregister(&cheeky_driver);
+	mutex_lock(&cheeky_font_lock);
+	cheeky_font_device = NULL;
+	mutex_unlock(&cheeky_font_lock);
+	cheeky_broadcast_unregister();
+	hrtimer_cancel(&cheeky_scheduler.timer);
+	destroy_workqueue(cheeky_scheduler.workqueue);
+
+	/* Wait for the states and the fonts replaced to be released */
+	rcu_barrier();
+	kfree(rcu_dereference_protected(cheeky_font, 1));
 }
 
 module_init(cheeky_init);
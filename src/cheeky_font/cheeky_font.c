@@ -0,0 +1,378 @@
+/*
+  This file is part of cheeky_driver.
+
+  cheeky_driver is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  cheeky_driver is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with cheeky_driver. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdio.h>
+
+#include "cheeky_driver.h"
+
+/**
+ * @brief
+ *	The font being compiled.
+ */
+typedef struct font_t {
+	unsigned int width;
+	/*!<
+	 * The number of LED columns of each glyph.
+	 */
+	unsigned int height;
+	/*!<
+	 * The number of LED rows of each glyph.
+	 */
+	unsigned int index[256];
+	/*!<
+	 * The glyph of each character, CHEEKY_FONT_NONE if it has none.
+	 */
+	unsigned char glyphs[256][256];
+	/*!<
+	 * The row slices of each glyph, the lowest bit being the leftmost LED.
+	 */
+	unsigned int nb_glyphs;
+	/*!<
+	 * The number of glyphs.
+	 */
+	char names[256][64];
+	/*!<
+	 * The characters of each glyph as written in the description, for the
+	 * comments of the C output.
+	 */
+} font_t;
+
+/**
+ * @brief
+ *	Prints how to use the programm.
+ */
+static void	usage(void)
+{
+	printf("Usage: cheeky_font [-c] description [output]\n"
+	       "Compiles a text font description into a binary font for cheeky_driver,\n"
+	       "written to output (cheeky_font.bin by default).\n"
+	       "\t-c: Prints the binary font as a C array instead\n"
+	       "The description holds a 'width n' and a 'height n' line, then each glyph:\n"
+	       "a line 'glyph c...' listing the characters it is shown for (a single\n"
+	       "character, 'space', or a code such as 0x7e), followed by height lines of\n"
+	       "width characters, '#' for a LED on and '.' for a LED off. The lines\n"
+	       "starting with ';' are comments.\n");
+}
+
+/**
+ * @brief
+ *	Removes the end of line of a line read.
+ * @param line The line.
+ */
+static void	chomp(char*	line)
+{
+	size_t		length = strlen(line);
+
+	while (length && (line[length - 1] == '\n' || line[length - 1] == '\r'))
+		line[--length] = '\0';
+}
+
+/**
+ * @brief
+ *	Returns the character named by a token of a glyph line.
+ * @param token The token: a single character, space, or a code.
+ * @return The character, -1 if the token is invalid.
+ */
+static int	parse_char(const char*	token)
+{
+	char*		end;
+	long		code;
+
+	if (strcmp(token, "space") == 0)
+		return (' ');
+	if (strlen(token) == 1)
+		return ((unsigned char) token[0]);
+	code = strtol(token, &end, 0);
+	if (*end || code < 0 || code > 255)
+		return (-1);
+	return (code);
+}
+
+/**
+ * @brief
+ *	Reads a glyph line and the rows of the glyph which follow it.
+ * @param input The description.
+ * @param line The glyph line, modified.
+ * @param font The font where to add the glyph.
+ * @param line_number The number of the line, updated.
+ * @return 0 on success, -1 on error.
+ */
+static int	parse_glyph(FILE*		input,
+			    char*		line,
+			    font_t*		font,
+			    unsigned int*	line_number)
+{
+	unsigned char*	glyph = font->glyphs[font->nb_glyphs];
+	const char*	name = line + strlen("glyph ");
+	size_t		length = strlen(name);
+	char		row_line[256];
+	unsigned int	column;
+	unsigned int	row;
+	char*		token;
+	int		c;
+
+	if (font->nb_glyphs == 256 || !font->width || !font->height) {
+		printf("cheeky_font: line %u: Too many glyphs, or no size set.\n",
+		       *line_number);
+		return (-1);
+	}
+	if (length >= sizeof(font->names[0])) {
+		printf("cheeky_font: line %u: Too many characters for a glyph.\n",
+		       *line_number);
+		return (-1);
+	}
+	memcpy(font->names[font->nb_glyphs], name, length + 1);
+	for (token = strtok(line + strlen("glyph "), " \t"); token;
+	     token = strtok(NULL, " \t")) {
+		c = parse_char(token);
+		if (c == -1) {
+			printf("cheeky_font: line %u: Wrong character %s.\n",
+			       *line_number, token);
+			return (-1);
+		}
+		font->index[c] = font->nb_glyphs;
+	}
+
+	for (row = 0; row < font->height; ++row) {
+		++(*line_number);
+		if (!fgets(row_line, sizeof(row_line), input)) {
+			printf("cheeky_font: line %u: Missing rows.\n",
+			       *line_number);
+			return (-1);
+		}
+		chomp(row_line);
+		if (strlen(row_line) != font->width) {
+			printf("cheeky_font: line %u: A row must have %u LED.\n",
+			       *line_number, font->width);
+			return (-1);
+		}
+		glyph[row] = 0;
+		for (column = 0; column < font->width; ++column)
+			if (row_line[column] == '#')
+				glyph[row] |= 1 << column;
+	}
+	++(font->nb_glyphs);
+	return (0);
+}
+
+/**
+ * @brief
+ *	Reads a whole font description.
+ * @param input The description.
+ * @param font The font to fill.
+ * @return 0 on success, -1 on error.
+ */
+static int	parse_font(FILE*	input,
+			   font_t*	font)
+{
+	unsigned int	line_number = 0;
+	char		line[256];
+	unsigned int	i;
+
+	memset(font, 0, sizeof(font_t));
+	for (i = 0; i < 256; ++i)
+		font->index[i] = CHEEKY_FONT_NONE;
+
+	while (fgets(line, sizeof(line), input)) {
+		++line_number;
+		chomp(line);
+		if (!line[0] || line[0] == ';')
+			continue;
+		if (sscanf(line, "width %u", &font->width) == 1 ||
+		    sscanf(line, "height %u", &font->height) == 1)
+			continue;
+		if (strncmp(line, "glyph ", strlen("glyph ")) == 0) {
+			if (parse_glyph(input, line, font, &line_number) == -1)
+				return (-1);
+			continue;
+		}
+		printf("cheeky_font: line %u: Unknown line %s.\n",
+		       line_number, line);
+		return (-1);
+	}
+
+	if (!font->width || font->width > 8 ||
+	    !font->height || font->height > 256) {
+		printf("cheeky_font: The glyphs must be 1 to 8 LED wide.\n");
+		return (-1);
+	}
+	return (0);
+}
+
+/**
+ * @brief
+ *	Lays a font out in the binary format read by the driver.
+ * @param font The font.
+ * @param blob Where to store the binary font, at least 16 + 256 * 2 +
+ * 256 * 256 bytes.
+ * @return The size of the binary font.
+ */
+static size_t	build_blob(const font_t*	font,
+			   unsigned char*	blob)
+{
+	unsigned int	first = 0;
+	unsigned int	last = 0;
+	unsigned int	count;
+	size_t		size;
+	unsigned int	i;
+
+	for (i = 0; i < 256; ++i)
+		if (font->index[i] != CHEEKY_FONT_NONE) {
+			if (!last)
+				first = i;
+			last = i + 1;
+		}
+	count = last - first;
+
+	/* The header, in little endian */
+	blob[0] = CHEEKY_FONT_MAGIC & 0xff;
+	blob[1] = (CHEEKY_FONT_MAGIC >> 8) & 0xff;
+	blob[2] = (CHEEKY_FONT_MAGIC >> 16) & 0xff;
+	blob[3] = (CHEEKY_FONT_MAGIC >> 24) & 0xff;
+	blob[4] = CHEEKY_FONT_VERSION;
+	blob[5] = 0;
+	blob[6] = font->width;
+	blob[7] = font->height;
+	blob[8] = first;
+	blob[9] = 0;
+	blob[10] = count & 0xff;
+	blob[11] = count >> 8;
+	blob[12] = font->nb_glyphs & 0xff;
+	blob[13] = font->nb_glyphs >> 8;
+	blob[14] = 0;
+	blob[15] = 0;
+	size = sizeof(cheeky_font_header_t);
+
+	for (i = first; i < last; ++i) {
+		blob[size++] = font->index[i] & 0xff;
+		blob[size++] = font->index[i] >> 8;
+	}
+	for (i = 0; i < font->nb_glyphs; ++i) {
+		memcpy(blob + size, font->glyphs[i], font->height);
+		size += font->height;
+	}
+	return (size);
+}
+
+/**
+ * @brief
+ *	Prints a binary font as a C array, one line for the header, for each
+ *	character of the index and for each glyph.
+ * @param font The font.
+ * @param blob The binary font.
+ */
+static void	print_array(const font_t*		font,
+			    const unsigned char*	blob)
+{
+	size_t		offset = sizeof(cheeky_font_header_t);
+	unsigned int	first = blob[8];
+	unsigned int	count = blob[10] | blob[11] << 8;
+	unsigned int	column;
+	unsigned int	row;
+	unsigned int	i;
+
+	printf("\t/* Header: \"CHKF\", version %u, %ux%u glyphs, characters %u to %u, %u glyphs */\n\t",
+	       CHEEKY_FONT_VERSION, font->width, font->height, first,
+	       first + count - 1, font->nb_glyphs);
+	for (i = 0; i < sizeof(cheeky_font_header_t); ++i)
+		printf("0x%02x,%s", blob[i],
+		       i + 1 < sizeof(cheeky_font_header_t) ? " " : "\n");
+
+	printf("\t/* Index */\n");
+	for (i = 0; i < count; ++i, offset += 2)
+		if (isgraph(first + i))
+			printf("\t0x%02x, 0x%02x,\t/* %c */\n", blob[offset],
+			       blob[offset + 1], first + i);
+		else
+			printf("\t0x%02x, 0x%02x,\t/* %u */\n", blob[offset],
+			       blob[offset + 1], first + i);
+
+	printf("\t/* Glyphs */\n");
+	for (i = 0; i < font->nb_glyphs; ++i) {
+		printf("\t");
+		for (row = 0; row < font->height; ++row) {
+			printf("0b");
+			for (column = font->width; column > 0; --column)
+				printf("%u", (blob[offset] >> (column - 1)) & 1);
+			printf(",%s", row + 1 < font->height ? " " : "");
+			++offset;
+		}
+		printf("\t/* %s */\n", font->names[i]);
+	}
+}
+
+/**
+ * @brief
+ *	The main function of cheeky_font.
+ * @param argc The number of arguments.
+ * @param argv The array of arguments.
+ * @return 0 on success, 1 on error.
+ */
+int		main(int	argc,
+		     char**	argv)
+{
+	static unsigned char	blob[16 + 256 * 2 + 256 * 256];
+	static font_t		font;
+	const char*		output = "cheeky_font.bin";
+	int			array = 0;
+	FILE*			input;
+	FILE*			file;
+	size_t			size;
+
+	if (argc > 1 && strcmp(argv[1], "-c") == 0) {
+		array = 1;
+		++argv;
+		--argc;
+	}
+	if (argc < 2 || argc > 3) {
+		usage();
+		return (1);
+	}
+	if (argc == 3)
+		output = argv[2];
+
+	input = fopen(argv[1], "r");
+	if (!input) {
+		printf("cheeky_font: Unable to open the file %s.\n", argv[1]);
+		return (1);
+	}
+	if (parse_font(input, &font) == -1) {
+		fclose(input);
+		return (1);
+	}
+	fclose(input);
+
+	size = build_blob(&font, blob);
+	if (array) {
+		print_array(&font, blob);
+		return (0);
+	}
+
+	file = fopen(output, "wb");
+	if (!file || fwrite(blob, 1, size, file) != size) {
+		printf("cheeky_font: Unable to write the file %s.\n", output);
+		if (file)
+			fclose(file);
+		return (1);
+	}
+	fclose(file);
+
+	return (0);
+}
@@ -0,0 +1,299 @@
+/*
+  This file is part of cheeky_driver.
+
+  cheeky_driver is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  cheeky_driver is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with cheeky_driver. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Measures the cost of rendering the 4 usb packets of a frame with the
+ * glyph lookup of the driver before and after glyph_table: the linear search
+ * of character_map followed by the ROW() shifts, against one index in a 256
+ * entry table of pre-split row slices.  The render loop is the one of
+ * cheeky_refresh_row(), without the semaphore and the usb packet fields,
+ * which cost the same in both cases.
+ */
+
+#include <arpa/inet.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+#define NB_ROWS			7
+#define NB_PACKETS		4
+#define NB_FRAMES		2000000
+
+#define COMPLETE_BITFIELD(Bf)			\
+	((Bf) << 11)
+
+#define ROW(Number, Bf)					\
+	((Bf)					<<	\
+	 ((Number) * 3)			>>		\
+	 (29))
+
+/**
+ * @brief
+ *	A character and its bitfield, as in character_map before glyph_table.
+ */
+typedef struct character_map_t {
+	char letter;
+	/*!<
+	 * The character to print.
+	 */
+	unsigned int bitfield;
+	/*!<
+	 * The bitfield representing the character.
+	 */
+} character_map_t;
+
+/**
+ * @brief
+ *	The row slices of a glyph, as in glyph_table.
+ */
+typedef struct glyph_t {
+	uint8_t rows[NB_ROWS + 1];
+	/*!<
+	 * The NB_ROWS slices of the glyph, the last one always blank.
+	 */
+} glyph_t;
+
+static const character_map_t	character_map[] = {
+	{'A', COMPLETE_BITFIELD(0b111101101111101101101)},
+	{'B', COMPLETE_BITFIELD(0b011101101011101101011)},
+	{'C', COMPLETE_BITFIELD(0b110001001001001001110)},
+	{'D', COMPLETE_BITFIELD(0b011111101101101111011)},
+	{'E', COMPLETE_BITFIELD(0b111001001011001001111)},
+	{'F', COMPLETE_BITFIELD(0b111001001011001001001)},
+	{'G', COMPLETE_BITFIELD(0b110001001111101101110)},
+	{'H', COMPLETE_BITFIELD(0b101101101111101101101)},
+	{'I', COMPLETE_BITFIELD(0b010000010010010010010)},
+	{'J', COMPLETE_BITFIELD(0b110100100101101101010)},
+	{'K', COMPLETE_BITFIELD(0b101101111001011101101)},
+	{'L', COMPLETE_BITFIELD(0b001001001001001001111)},
+	{'M', COMPLETE_BITFIELD(0b101111111101101101101)},
+	{'N', COMPLETE_BITFIELD(0b101101111111101101101)},
+	{'O', COMPLETE_BITFIELD(0b010101101101101101010)},
+	{'P', COMPLETE_BITFIELD(0b011101101011001001001)},
+	{'Q', COMPLETE_BITFIELD(0b010101101101101111110)},
+	{'R', COMPLETE_BITFIELD(0b011101101011001011101)},
+	{'S', COMPLETE_BITFIELD(0b010101001010100101010)},
+	{'T', COMPLETE_BITFIELD(0b111010010010010010010)},
+	{'U', COMPLETE_BITFIELD(0b101101101101101101010)},
+	{'V', COMPLETE_BITFIELD(0b101101101101101010010)},
+	{'W', COMPLETE_BITFIELD(0b101101101111111101010)},
+	{'X', COMPLETE_BITFIELD(0b101101101010101101101)},
+	{'Y', COMPLETE_BITFIELD(0b101101101010010010010)},
+	{'Z', COMPLETE_BITFIELD(0b111100010010010001111)},
+	{'0', COMPLETE_BITFIELD(0b010101101101101101010)},
+	{'1', COMPLETE_BITFIELD(0b010011010010010010111)},
+	{'2', COMPLETE_BITFIELD(0b010101101100010011111)},
+	{'3', COMPLETE_BITFIELD(0b010101100010100100111)},
+	{'4', COMPLETE_BITFIELD(0b001001001101111100100)},
+	{'5', COMPLETE_BITFIELD(0b111001001011100100011)},
+	{'6', COMPLETE_BITFIELD(0b110001001011101101010)},
+	{'7', COMPLETE_BITFIELD(0b111100100010010001001)},
+	{'8', COMPLETE_BITFIELD(0b010101101010101101010)},
+	{'9', COMPLETE_BITFIELD(0b010101101110100101010)},
+	{'-', COMPLETE_BITFIELD(0b000000000111000000000)},
+	{'_', COMPLETE_BITFIELD(0b000000000000000000111)},
+	{'(', COMPLETE_BITFIELD(0b100010010001010010100)},
+	{')', COMPLETE_BITFIELD(0b001010010100010010001)},
+	{'\\', COMPLETE_BITFIELD(0b001001010010010100100)},
+	{'/', COMPLETE_BITFIELD(0b100100010010010001001)},
+	{'|', COMPLETE_BITFIELD(0b010010010010010010010)},
+	{'\'', COMPLETE_BITFIELD(0b010010000000000000000)},
+	{'<', COMPLETE_BITFIELD(0b100010001001001010100)},
+	{'>', COMPLETE_BITFIELD(0b001010100100100010001)},
+	{'!', COMPLETE_BITFIELD(0b010010010010010000010)},
+	{'?', COMPLETE_BITFIELD(0b010101101100010000010)},
+	{'.', COMPLETE_BITFIELD(0b000000000000000000001)},
+	{',', COMPLETE_BITFIELD(0b000000000000000100010)},
+	{';', COMPLETE_BITFIELD(0b000000010000010001000)},
+	{':', COMPLETE_BITFIELD(0b000000010000010000000)},
+	{'^', COMPLETE_BITFIELD(0b010101000000000000000)},
+	{'=', COMPLETE_BITFIELD(0b000000111000111000000)},
+	{'+', COMPLETE_BITFIELD(0b000000010111010000000)},
+	{'"', COMPLETE_BITFIELD(0b110011000000000000000)},
+	{' ', COMPLETE_BITFIELD(0b000000000000000000000)},
+	{'\0',COMPLETE_BITFIELD(0b000000000000000000000)}
+};
+
+static glyph_t			glyph_table[256];
+
+/**
+ * @brief
+ *	Returns the bitfield of a character by walking character_map.
+ * @param c The character.
+ * @return The bitfield of the character.
+ */
+static unsigned int	get_bitfield(char	c)
+{
+	const character_map_t*	chars_map = character_map;
+
+	while (chars_map->letter != '\0'	&&
+	       chars_map->letter != c) {
+		if (c >= 'a'	&&
+		    c <= 'z'	&&
+		    c - 32 == chars_map->letter)
+			break;
+		else
+			++chars_map;
+	}
+
+	return (chars_map->bitfield);
+}
+
+/**
+ * @brief
+ *	Fills glyph_table from character_map.
+ */
+static void		build_glyph_table(void)
+{
+	unsigned int		bitfield;
+	unsigned int		c;
+	uint8_t			row;
+
+	for (c = 0; c < 256; ++c) {
+		bitfield = get_bitfield((char) c);
+		for (row = 0; row < NB_ROWS; ++row)
+			glyph_table[c].rows[row] = ROW(row, bitfield);
+		glyph_table[c].rows[NB_ROWS] = 0;
+	}
+}
+
+/**
+ * @brief
+ *	Renders the rows of a frame with the search of character_map.
+ * @param text The message.
+ * @param length The length of the message.
+ * @param start The first character shown.
+ * @param rows Where to store the NB_PACKETS * 2 rows.
+ */
+static void		render_search(const char*	text,
+				      size_t		length,
+				      size_t		start,
+				      uint32_t*		rows)
+{
+	unsigned int		bitfield;
+	uint32_t		first_row;
+	uint32_t		second_row;
+	uint8_t			packet;
+	uint8_t			i;
+
+	for (packet = 0; packet < NB_PACKETS; ++packet) {
+		first_row = 0;
+		second_row = 0;
+		for (i = 0; i < 8; ++i) {
+			bitfield = get_bitfield(text[(i + start) % length]);
+			first_row |= ROW(packet * 2, bitfield) << (3 * (i + 1));
+			second_row |= ROW(packet * 2 + 1, bitfield) << (3 * (i + 1));
+		}
+		rows[packet * 2] = htonl(~(first_row << 5));
+		rows[packet * 2 + 1] = htonl(~(second_row << 5));
+	}
+}
+
+/**
+ * @brief
+ *	Renders the rows of a frame with glyph_table.
+ * @param text The message.
+ * @param length The length of the message.
+ * @param start The first character shown.
+ * @param rows Where to store the NB_PACKETS * 2 rows.
+ */
+static void		render_table(const char*	text,
+				     size_t		length,
+				     size_t		start,
+				     uint32_t*		rows)
+{
+	const glyph_t*		glyph;
+	uint32_t		first_row;
+	uint32_t		second_row;
+	uint8_t			packet;
+	uint8_t			i;
+
+	for (packet = 0; packet < NB_PACKETS; ++packet) {
+		first_row = 0;
+		second_row = 0;
+		for (i = 0; i < 8; ++i) {
+			glyph = &glyph_table[(unsigned char) text[(i + start) % length]];
+			first_row |= (uint32_t) glyph->rows[packet * 2] << (3 * (i + 1));
+			second_row |= (uint32_t) glyph->rows[packet * 2 + 1] << (3 * (i + 1));
+		}
+		rows[packet * 2] = htonl(~(first_row << 5));
+		rows[packet * 2 + 1] = htonl(~(second_row << 5));
+	}
+}
+
+/**
+ * @brief
+ *	Returns the time in ns of CLOCK_MONOTONIC.
+ */
+static double		now(void)
+{
+	struct timespec		ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1e9 + ts.tv_nsec);
+}
+
+/**
+ * @brief
+ *	Renders NB_FRAMES frames with both lookups, checks that they render
+ *	the same packets and prints the time of a frame for each.
+ * @return 0 on success, 1 if the two lookups differ.
+ */
+int			main(void)
+{
+	static const char	text[] = "Chiche donne nous tout ! 0123456789";
+	size_t			length = strlen(text);
+	uint32_t		expected[NB_PACKETS * 2];
+	uint32_t		rows[NB_PACKETS * 2];
+	volatile uint32_t	sink = 0;
+	double			start;
+	double			search;
+	double			table;
+	unsigned int		frame;
+
+	build_glyph_table();
+
+	for (frame = 0; frame < length; ++frame) {
+		render_search(text, length, frame, expected);
+		render_table(text, length, frame, rows);
+		if (memcmp(expected, rows, sizeof(rows))) {
+			printf("glyph_bench: The lookups differ at %u.\n", frame);
+			return (1);
+		}
+	}
+
+	start = now();
+	for (frame = 0; frame < NB_FRAMES; ++frame) {
+		render_search(text, length, frame % length, rows);
+		sink += rows[frame % (NB_PACKETS * 2)];
+	}
+	search = (now() - start) / NB_FRAMES;
+
+	start = now();
+	for (frame = 0; frame < NB_FRAMES; ++frame) {
+		render_table(text, length, frame % length, rows);
+		sink += rows[frame % (NB_PACKETS * 2)];
+	}
+	table = (now() - start) / NB_FRAMES;
+
+	printf("%u frames of a %zu character message:\n", NB_FRAMES, length);
+	printf("  character_map search: %.1f ns/frame\n", search);
+	printf("  glyph_table index:    %.1f ns/frame\n", table);
+
+	return (0);
+}